@@ -37,11 +37,26 @@ Author: Daniele Cesarini, University of Bologna
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <pwd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <stddef.h>
 
 #include "slurm/spank.h"
 
@@ -50,34 +65,231 @@ Author: Daniele Cesarini, University of Bologna
 
 #define BUFFER_SIZE 1024
 
+// Paths of the files accessed by the plugin, the defaults are prefixed with the
+// root directory set in plugstack.conf (see config.c)
+struct pm_paths {
+  char driver[BUFFER_SIZE];
+  char governor[BUFFER_SIZE];
+  char scaling_max_freq[BUFFER_SIZE];
+  char scaling_min_freq[BUFFER_SIZE];
+  char cpuinfo_max_freq[BUFFER_SIZE];
+  char cpuinfo_min_freq[BUFFER_SIZE];
+  char cpu_online[BUFFER_SIZE];
+  char topology_package_id[BUFFER_SIZE];
+  char topology_core_id[BUFFER_SIZE];
+  char topology_die_id[BUFFER_SIZE];
+  char cpuinfo[BUFFER_SIZE];
+  char cpufreq_scaling_setspeed[BUFFER_SIZE];
+  char cpufreq_policy_dir[BUFFER_SIZE];
+  char cpufreq_affected_cpus[BUFFER_SIZE];
+  char ipstate_no_turbo[BUFFER_SIZE];
+  char ipstate_max_perf_pct[BUFFER_SIZE];
+  char ipstate_min_perf_pct[BUFFER_SIZE];
+  char ipstate_status[BUFFER_SIZE];
+  char msrsafe_whitelist_file[BUFFER_SIZE];
+  char msrsafe_batch_file[BUFFER_SIZE];
+  char msrsafe_cpu_file[BUFFER_SIZE];
+  char ipstate_dump[BUFFER_SIZE];
+  char cpufreq_dump[BUFFER_SIZE];
+  char msrsafe_dump[BUFFER_SIZE];
+  char msrsafe_wl_cache[BUFFER_SIZE];
+  char baseline_dir[BUFFER_SIZE];
+  char baseline_msrsafe[BUFFER_SIZE];
+  char baseline_cpufreq[BUFFER_SIZE];
+  char baseline_ipstate[BUFFER_SIZE];
+  char started[BUFFER_SIZE];
+  char msrsafe_reference[BUFFER_SIZE];
+  char rapl_snapshot[BUFFER_SIZE];
+  char uncore_dump[BUFFER_SIZE];
+  char baseline_uncore[BUFFER_SIZE];
+  char hwp_dump[BUFFER_SIZE];
+  char baseline_hwp[BUFFER_SIZE];
+  char baseline_stamp[BUFFER_SIZE];
+  char freq_table[BUFFER_SIZE];
+  char boot_id[BUFFER_SIZE];
+  char cgroup_cpuset[BUFFER_SIZE];
+  char cgroup_v1_cpuset[BUFFER_SIZE];
+  char job_cpuset[BUFFER_SIZE];
+  char job_msrsafe_dump[BUFFER_SIZE];
+  char job_uncore_dump[BUFFER_SIZE];
+  char job_cpufreq_dump[BUFFER_SIZE];
+  char topology_cache[BUFFER_SIZE];
+};
+
+extern struct pm_paths pm_paths;
+
 // Power manager
-#define PM_DRIVER                       "/sys/devices/system/cpu/cpu%ld/cpufreq/scaling_driver"     // Read
-#define PM_GOVERNOR                     "/sys/devices/system/cpu/cpu%ld/cpufreq/scaling_governor"   // Read/write
-#define PM_SCALING_MAX_FREQ             "/sys/devices/system/cpu/cpu%ld/cpufreq/scaling_max_freq"   // Read/write
-#define PM_SCALING_MIN_FREQ             "/sys/devices/system/cpu/cpu%ld/cpufreq/scaling_min_freq"   // Read/write
-#define PM_CPUINFO_MAX_FREQ             "/sys/devices/system/cpu/cpu%ld/cpufreq/cpuinfo_max_freq"   // Read
-#define PM_CPUINFO_MIN_FREQ             "/sys/devices/system/cpu/cpu%ld/cpufreq/cpuinfo_min_freq"   // Read
+#define PM_DRIVER                       pm_paths.driver                     // Read
+#define PM_GOVERNOR                     pm_paths.governor                   // Read/write
+#define PM_SCALING_MAX_FREQ             pm_paths.scaling_max_freq           // Read/write
+#define PM_SCALING_MIN_FREQ             pm_paths.scaling_min_freq           // Read/write
+#define PM_CPUINFO_MAX_FREQ             pm_paths.cpuinfo_max_freq           // Read
+#define PM_CPUINFO_MIN_FREQ             pm_paths.cpuinfo_min_freq           // Read
+
+// Topology
+#define PM_CPU_ONLINE                   pm_paths.cpu_online
+#define PM_TOPOLOGY_PACKAGE_ID          pm_paths.topology_package_id
+#define PM_TOPOLOGY_CORE_ID             pm_paths.topology_core_id
+#define PM_TOPOLOGY_DIE_ID              pm_paths.topology_die_id
+#define PM_CPUINFO                      pm_paths.cpuinfo
 
 // Only CPUFreq
-#define PM_CPUFREQ_SCALING_SETSPEED     "/sys/devices/system/cpu/cpu%ld/cpufreq/scaling_setspeed"   // Read/write
+#define PM_CPUFREQ_SCALING_SETSPEED     pm_paths.cpufreq_scaling_setspeed   // Read/write
+#define PM_CPUFREQ_POLICY_DIR           pm_paths.cpufreq_policy_dir         // Read
+#define PM_CPUFREQ_AFFECTED_CPUS        pm_paths.cpufreq_affected_cpus      // Read
 
 // Only Intel P-state
-#define PM_IPSTATE_NO_TURBO             "/sys/devices/system/cpu/intel_pstate/no_turbo"             // Read/write
-#define PM_IPSTATE_MAX_PERF_PCT         "/sys/devices/system/cpu/intel_pstate/max_perf_pct"         // Read/write
-#define PM_IPSTATE_MIN_PERF_PCT         "/sys/devices/system/cpu/intel_pstate/min_perf_pct"         // Read/write
+#define PM_IPSTATE_NO_TURBO             pm_paths.ipstate_no_turbo           // Read/write
+#define PM_IPSTATE_MAX_PERF_PCT         pm_paths.ipstate_max_perf_pct       // Read/write
+#define PM_IPSTATE_MIN_PERF_PCT         pm_paths.ipstate_min_perf_pct       // Read/write
+#define PM_IPSTATE_STATUS               pm_paths.ipstate_status             // Read
 
 // MSRSAFE
-#define MSRSAFE_WHITELIST_FILE          "/dev/cpu/msr_whitelist"
-#define MSRSAFE_BATCH_FILE              "/dev/cpu/msr_batch"
-#define MSRSAFE_CPU_FILE                "/dev/cpu/%ld/msr_safe"
+#define MSRSAFE_WHITELIST_FILE          pm_paths.msrsafe_whitelist_file
+#define MSRSAFE_BATCH_FILE              pm_paths.msrsafe_batch_file
+#define MSRSAFE_CPU_FILE                pm_paths.msrsafe_cpu_file
+
+// MSRSAFE batch interface (see msr_batch.h of the MSR_SAFE driver)
+struct msr_batch_op {
+  uint16_t cpu;                         // In: CPU to execute {rd/wr}msr instruction
+  uint16_t isrdmsr;                     // In: 0=wrmsr, non-zero=rdmsr
+  int32_t err;                          // Out: set if error occurred with this operation
+  uint32_t msr;                         // In: MSR Address to perform operation
+  uint64_t msrdata;                     // In/Out: Input/Result to/from operation
+  uint64_t wmask;                       // Out: Write mask applied to wrmsr
+};
+
+struct msr_batch_array {
+  uint32_t numops;                      // In: # of operations in operations array
+  struct msr_batch_op *ops;             // In: Array[numops] of operations
+};
+
+#define X86_IOC_MSR_BATCH               _IOWR('c', 0xA2, struct msr_batch_array)
+
+// Max number of operations submitted with a single ioctl
+#define MSRSAFE_BATCH_MAX_OPS           8192
+
+// Whitelist entry
+struct msr_wl_entry {
+  uint64_t addr;
+  uint64_t mask;
+};
+
+// Compiled whitelist: header followed by the entries sorted by address
+#define MSRSAFE_WL_CACHE_MAGIC          0x4c574d4d                  // "MMWL"
+#define MSRSAFE_WL_CACHE_VERSION        1
+
+struct msr_wl_cache_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t hash;                        // FNV-1a hash of the whitelist content
+  uint64_t nentries;
+};
+
+struct msr_whitelist {
+  struct msr_wl_entry *entries;
+  long nentries;
+  void *map;                            // Mapped cache, NULL if parsed
+  size_t size;
+};
 
 // Default power manager for CPUFREQ
 #define PM_CPUFREQ_DEFAULT_GOVERNOR     "performance"
 
 // Dump files
-#define PM_IPSTATE_DUMP                 "/tmp/pm_ipstate_dump"
-#define PM_CPUFREQ_DUMP                 "/tmp/pm_cpufreq_dump"
-#define MSRSAFE_DUMP                    "/tmp/msrsafe_dump"
+#define PM_IPSTATE_DUMP                 pm_paths.ipstate_dump
+#define PM_CPUFREQ_DUMP                 pm_paths.cpufreq_dump
+// The jobs of a shared node dump the registers of their cpus in their files
+#define MSRSAFE_DUMP                    (job_cpuset.shared ? job_cpuset.msrsafe_dump : pm_paths.msrsafe_dump)
+#define PM_UNCORE_DUMP                  (job_cpuset.shared ? job_cpuset.uncore_dump : pm_paths.uncore_dump)
+#define PM_HWP_DUMP                     pm_paths.hwp_dump
+
+// Files of a job on a shared node, formatted with the job id
+#define PM_CGROUP_CPUSET                pm_paths.cgroup_cpuset
+#define PM_CGROUP_V1_CPUSET             pm_paths.cgroup_v1_cpuset   // With the uid of the job
+#define PM_JOB_CPUSET                   pm_paths.job_cpuset
+#define MSRSAFE_JOB_DUMP                pm_paths.job_msrsafe_dump
+#define PM_UNCORE_JOB_DUMP              pm_paths.job_uncore_dump
+#define PM_CPUFREQ_JOB_DUMP             pm_paths.job_cpufreq_dump
+
+// Cache files
+#define MSRSAFE_WL_CACHE                pm_paths.msrsafe_wl_cache
+#define PM_FREQ_TABLE                   pm_paths.freq_table
+#define PM_TOPOLOGY_CACHE               pm_paths.topology_cache
+#define PM_BOOT_ID                      pm_paths.boot_id
+
+// Baseline of the node, in baseline mode the dump files point to it
+#define PM_BASELINE_DIR                 pm_paths.baseline_dir
+#define PM_BASELINE_STAMP               pm_paths.baseline_stamp
+#define PM_BASELINE_MSRSAFE             pm_paths.baseline_msrsafe
+#define PM_BASELINE_CPUFREQ             pm_paths.baseline_cpufreq
+#define PM_BASELINE_IPSTATE             pm_paths.baseline_ipstate
+#define PM_BASELINE_UNCORE              pm_paths.baseline_uncore
+#define PM_BASELINE_HWP                 pm_paths.baseline_hwp
+
+// Size of the boot id of the kernel, with the terminator
+#define BOOT_ID_SIZE 40
+
+// Node on which the baseline has been captured, the baseline is captured
+// again after a reboot (e.g. a BIOS update), a microcode update or a change
+// of the whitelist
+#define BASELINE_STAMP_MAGIC 0x54534c42                             // "BLST"
+#define BASELINE_STAMP_VERSION 1
+
+struct baseline_stamp {
+  uint32_t magic;
+  uint32_t version;
+  char boot_id[BOOT_ID_SIZE];
+  uint32_t family;
+  uint32_t model;
+  uint64_t microcode;
+  uint64_t whitelist_hash;              // FNV-1a hash of the compiled whitelist
+  uint64_t checksum;                    // FNV-1a hash of the fields above
+};
+
+// Marker of a job prolog run in baseline mode
+#define PM_STARTED                      pm_paths.started
+
+// MSR dump restored by the last epilog, reference of the drift check
+#define MSRSAFE_REFERENCE               pm_paths.msrsafe_reference
+
+// RAPL energy counters read by the prolog of a job
+#define PM_RAPL_SNAPSHOT                pm_paths.rapl_snapshot
+
+// Policies of the drift check
+#define DRIFT_OFF 0
+#define DRIFT_WARN 1                    // Report the drifted registers
+#define DRIFT_DRAIN 2                   // Report and fail the prolog
+
+// Max registers excluded from the drift check by the admin
+#define DRIFT_MAX_IGNORE 32
+
+// MSR dump binary format: header followed by the records in register x CPU order
+#define MSRSAFE_DUMP_MAGIC              0x444d534d                  // "MSMD"
+#define MSRSAFE_DUMP_VERSION            2                           // Masked values
+#define MSRSAFE_DUMP_VERSION_FULL       1                           // Whole registers
+
+struct msr_dump_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ncpus;                       // Online cpus when the dump has been taken
+  uint32_t nregs;                       // Dumped registers
+  uint64_t nrecords;
+  uint64_t checksum;                    // FNV-1a hash of the records
+};
+
+struct msr_dump_record {
+  uint32_t msr;
+  uint32_t cpu;
+  uint64_t value;                       // Writable bits of the register
+  uint64_t mask;                        // Whitelist write mask at dump time
+};
+
+struct msr_dump {
+  struct msr_dump_header *header;
+  struct msr_dump_record *records;
+  size_t size;
+};
 
 // MSR DVFS
 #define IA32_PERF_CTL                   0x199
@@ -88,6 +300,341 @@ Author: Daniele Cesarini, University of Bologna
 
 #define RESET 0
 #define SET 1
+#define DUMP 2                          // Only dump the configuration (baseline)
+
+// Kind of permission requests
+#define PERM_READ 0                     // Read for others
+#define PERM_READ_WRITE 1               // Read/write for others
+#define PERM_READ_NO_WRITE 2            // Read/write for others, reset only write
+#define PERM_JOB_READ 3                 // Read for the group of the job
+#define PERM_JOB_READ_WRITE 4           // Read/write for the user of the job
+
+// Minimum number of files handled by each permission worker
+#define PERM_MIN_FILES_PER_WORKER 64
+
+struct perm_req {
+  char *path;
+  int kind;
+  int ret;
+};
+
+struct perm_list {
+  struct perm_req *reqs;
+  long nreqs;
+  long size;
+  uid_t uid;                            // Owner of the PERM_JOB_* files at SET
+  gid_t gid;
+};
+
+// Kind of sysfs requests
+#define SYSFS_READ 0
+#define SYSFS_WRITE 1
+
+// Max length of a sysfs value (e.g. governor names and frequencies)
+#define SYSFS_VALUE_SIZE 128
+
+struct sysfs_req {
+  char *path;
+  char value[SYSFS_VALUE_SIZE];         // In: value to write, Out: first word read
+  int write;
+  int fd;
+  int err;                              // Out: 0 or negative errno
+};
+
+struct sysfs_batch {
+  struct sysfs_req *reqs;
+  long nreqs;
+  long size;
+};
+
+// RAPL energy registers, read once per package
+#define MSR_RAPL_POWER_UNIT 0x606
+#define MSR_PKG_ENERGY_STATUS 0x611
+#define MSR_PKG_POWER_INFO 0x614
+#define MSR_DRAM_ENERGY_STATUS 0x619
+#define MSR_PP0_ENERGY_STATUS 0x639
+
+#define RAPL_PKG 0
+#define RAPL_DRAM 1
+#define RAPL_PP0 2
+#define RAPL_NDOMAINS 3
+
+// RAPL snapshot: header followed by one sample for each package
+#define RAPL_SNAPSHOT_MAGIC 0x4c50524d                              // "MRPL"
+#define RAPL_SNAPSHOT_VERSION 2
+
+// Fixed DRAM energy unit of the Xeon server processors, 1/2^16 J
+#define RAPL_DRAM_SERVER_UNIT 16
+
+struct rapl_snapshot_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t npkgs;
+  uint32_t job_id;                      // Job of the prolog
+  int64_t time_ns;                      // CLOCK_MONOTONIC
+  uint64_t checksum;                    // FNV-1a hash of the samples
+};
+
+struct rapl_sample {
+  uint32_t pkg;
+  uint32_t cpu;                         // Cpu reading the registers of the package
+  uint32_t valid;                       // Bitmask of the domains read
+  uint32_t unit[RAPL_NDOMAINS];         // Energy status unit of each domain, 1/2^unit J
+  uint32_t tdp_w;                       // Thermal design power, 0 if unknown
+  uint64_t energy[RAPL_NDOMAINS];       // Raw 32-bit counters
+};
+
+// Uncore frequency of each package, in units of 100 MHz
+#define MSR_UNCORE_RATIO_LIMIT 0x620
+#define MSR_UNCORE_PERF_STATUS 0x621
+#define UNCORE_RATIO_MASK 0x7f7fUL      // Max ratio 6:0, min ratio 14:8
+
+// Frequency table of the node
+#define MSR_PLATFORM_INFO 0xCE
+#define MSR_TURBO_RATIO_LIMIT 0x1AD
+#define MSR_TURBO_RATIO_LIMIT1 0x1AE
+
+#define FREQ_BUS_KHZ 100000
+#define FREQ_MAX_BINS 16
+
+#define FREQ_TABLE_MAGIC 0x51524650                                 // "PFRQ"
+#define FREQ_TABLE_VERSION 1
+
+// Environment variable of the jobs with the frequency table
+#define FREQ_TABLE_ENV "PM_MSRSAFE_FREQ_TABLE"
+
+struct freq_table {
+  uint32_t magic;
+  uint32_t version;
+  char boot_id[BOOT_ID_SIZE];            // The table is built again after a reboot
+  uint32_t bus_khz;
+  uint8_t base_ratio;                   // Max non-turbo ratio
+  uint8_t efficiency_ratio;             // Max efficiency ratio
+  uint8_t min_ratio;                    // Min operating ratio
+  uint8_t nbins;
+  uint8_t turbo_ratio[FREQ_MAX_BINS];   // Max ratio of each turbo bin
+  uint8_t turbo_cores[FREQ_MAX_BINS];   // Max active cores of each turbo bin
+  uint64_t checksum;                    // FNV-1a hash of the fields above
+};
+
+// Hardware P-states
+#define IA32_PM_ENABLE 0x770
+#define IA32_HWP_CAPABILITIES 0x771
+#define IA32_HWP_REQUEST_PKG 0x772
+#define IA32_HWP_REQUEST 0x774
+#define HWP_REQUEST_MASK 0x7ffffffffffUL  // Min, max, desired, EPP, window and package control
+#define HWP_EPP_PERFORMANCE 0
+
+// Max cpu id accepted by the options of the job on the submission host
+#define JOB_MAX_CPUS 8192
+
+// Registers read by the in-job sampler
+#define MSR_IA32_MPERF 0xE7
+#define MSR_IA32_APERF 0xE8
+#define MSR_IA32_PERF_STATUS 0x198
+
+// Per-cpu and per-package counters of a sample
+#define SAMPLER_CPU_REGS 3              // APERF, MPERF, PERF_STATUS
+#define SAMPLER_PKG_REGS 3              // PKG and DRAM energy, UNCORE_PERF_STATUS
+
+// Max fraction of a cpu spent by the sampler, the period is doubled above it
+#define SAMPLER_MAX_OVERHEAD 0.01
+
+// Samples file: header followed by a ring buffer of fixed-size slots
+#define SAMPLER_MAGIC 0x504d5350                                    // "PSMP"
+#define SAMPLER_VERSION 2
+
+struct sampler_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ncpus;
+  uint32_t npkgs;
+  uint32_t nslots;
+  uint32_t slot_size;                   // Bytes of each slot
+  uint32_t energy_unit;                 // RAPL energy status unit, 1/2^unit J
+  uint32_t period_us;                   // Current sampling period
+  uint64_t head;                        // Written samples, the next one goes in head % nslots
+  uint64_t overhead_ns;                 // Time spent reading and storing the samples
+  uint64_t elapsed_ns;                  // Time of the last sample since begin_ns
+  uint64_t max_sample_ns;
+  int64_t begin_ns;                     // CLOCK_MONOTONIC
+};
+
+// The writer makes seq odd while the slot is updated (seqlock), data holds
+// the registers of each cpu followed by the energy counters of each package
+struct sampler_slot {
+  uint64_t seq;
+  int64_t time_ns;
+  uint64_t data[];
+};
+
+// Node power state, each group of fields is read once per prolog/epilog
+#define NODE_UNKNOWN -1
+#define NODE_MAX_GOVERNORS 8
+#define NODE_GOVERNOR_SIZE 32
+
+#define NODE_DRIVER 0x1                 // Power driver of cpu0
+#define NODE_CPUFREQ 0x2                // Governor, scaling max/min and setspeed frequencies
+#define NODE_CPUINFO 0x4                // Hardware max/min frequencies
+#define NODE_IPSTATE 0x8                // intel_pstate no_turbo and max/min_perf_pct
+#define NODE_POLICY 0x10                // cpufreq policy of each cpu
+
+// Node state dump: header followed by the per-cpu arrays
+#define NODE_STATE_MAGIC 0x4e53504d                                 // "MPSN"
+#define NODE_STATE_VERSION 2
+
+// Number of per-cpu arrays of the node state
+#define NODE_NARRAYS 7
+
+struct node_state_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ncpus;
+  uint32_t fields;
+  int32_t ngovernors;
+  int32_t no_turbo;
+  int32_t max_perf_pct;
+  int32_t min_perf_pct;
+  char governors[NODE_MAX_GOVERNORS][NODE_GOVERNOR_SIZE];
+  uint64_t checksum;                    // FNV-1a hash of the per-cpu arrays
+};
+
+// Structure of arrays with the numeric state of each cpu, frequencies in kHz
+struct node_state {
+  long ncpus;
+  int fields;                           // Groups of fields loaded
+  char driver[SYSFS_VALUE_SIZE];
+  int ngovernors;
+  char governors[NODE_MAX_GOVERNORS][NODE_GOVERNOR_SIZE];
+  int32_t *data;                        // Storage of the per-cpu arrays
+  int32_t *governor;                    // Index in governors
+  int32_t *scaling_max_freq;
+  int32_t *scaling_min_freq;
+  int32_t *cpuinfo_max_freq;
+  int32_t *cpuinfo_min_freq;
+  int32_t *scaling_setspeed;            // Only with the userspace governor
+  int32_t *policy;                      // First cpu of the cpufreq policy of each cpu
+  int32_t no_turbo;
+  int32_t max_perf_pct;
+  int32_t min_perf_pct;
+};
+
+// Scope of the MSRs
+#define SCOPE_THREAD 0
+#define SCOPE_CORE 1
+#define SCOPE_PACKAGE 2
+
+// Topology of the online cpus, the arrays are indexed by cpu id up to the
+// last online cpu
+struct cpu_topology {
+  long ncpus;                           // Last online cpu + 1
+  long nonline;
+  long npkgs;                           // 0 if the packages are not known
+  uint64_t *online;                     // Bitmap of the online cpus
+  uint32_t *cpus;                       // Sorted online cpus
+  int32_t *pkg_id;                      // Package of each cpu, -1 if offline
+  int32_t *core_id;                     // Core of each cpu in its package across the dies, -1 if offline
+  uint8_t *leader;                      // Bitmask of the scopes led by each cpu
+  void *data;                           // Storage of the arrays, in the cache layout
+  size_t size;
+  int map;                              // The storage is the mapped cache
+};
+
+// Topology cache, written by the slurm daemon: header followed by the arrays
+// of struct cpu_topology from online to leader
+#define TOPOLOGY_CACHE_MAGIC 0x504f544d                             // "MTOP"
+#define TOPOLOGY_CACHE_VERSION 2                                  // Cores numbered across the dies
+
+#define TOPOLOGY_WORDS(ncpus) (((ncpus) + 63) / 64)
+
+struct topology_cache_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ncpus;
+  uint32_t nonline;
+  uint32_t npkgs;
+  uint32_t reserved;
+  uint64_t online_hash;                 // FNV-1a hash of the online cpu list
+  uint64_t checksum;                    // FNV-1a hash of the arrays
+};
+
+// Processor of the node
+struct cpu_model {
+  int intel;                            // GenuineIntel
+  int family;
+  int model;
+  uint64_t microcode;                   // Revision of the microcode
+  int hwp;                              // Hardware P-states supported
+};
+
+// Cpus of a job on a shared node
+struct job_cpuset {
+  int shared;                           // The job does not own all the cpus of the node
+  uint32_t job_id;
+  long ncpus;                           // Cpus of the job
+  long npkgs;                           // Packages with all their cpus in the job
+  uint32_t *cpus;                       // Sorted cpus of the job
+  uint8_t *owned;                       // Bitmask of the scopes owned by each cpu
+  char file[BUFFER_SIZE];               // Cpus saved by the prolog for the epilog
+  char msrsafe_dump[BUFFER_SIZE];       // MSRs of the cpus of the job
+  char uncore_dump[BUFFER_SIZE];        // Uncore ratio limits of the packages of the job
+  char cpufreq_dump[BUFFER_SIZE];       // cpufreq limits before --cpu-freq-pm
+};
+
+extern struct job_cpuset job_cpuset;
+
+// MSR_SAFE file of a cpu kept open during a prolog/epilog (see msr_context.c)
+struct msr_fd {
+  int fd;                               // -1 if closed
+  int refs;                             // Users of the descriptor, it is not closed if > 0
+  int32_t prev;                         // LRU list of the open descriptors not in use
+  int32_t next;
+};
+
+// Plugin configuration (plugstack.conf arguments)
+struct pm_conf {
+  long nthreads;                        // MSR worker threads, 0 or 1 disable the parallel mode,
+                                        // 0 sizes the permission workers on the files
+  int delta_restore;                    // Restore only the values changed by the job
+  int msr_scope;                        // Access core/package MSRs once per domain
+  char report_dir[BUFFER_SIZE];         // Directory of the JSON reports, empty to disable
+  char root[BUFFER_SIZE];               // Prefix of all the paths, empty for '/'
+  int io_uring;                         // Access the sysfs files through io_uring
+  int cpufreq_policy;                   // Access the cpufreq files once per policy
+  int baseline;                         // Restore the baseline captured at slurmd start
+  int drift;                            // Check the MSRs against the reference at prolog
+  char energy_dir[BUFFER_SIZE];         // Directory of the energy reports, empty to disable
+  long sampler_rate;                    // Samples per second of the in-job sampler, 0 to disable
+  long sampler_slots;                   // Slots of the ring buffer
+  char sampler_dir[BUFFER_SIZE];        // Directory of the samples files
+  int shared;                           // Manage only the cpus of the jobs on shared nodes
+  long msr_fds;                         // MSR_SAFE files kept open at the same time
+  uint32_t drift_ignore[DRIFT_MAX_IGNORE];  // Registers not compared by the drift check
+  long ndrift_ignore;                   // Entries of drift_ignore
+};
+
+extern struct pm_conf pm_conf;
+
+// Instrumentation of prolog/epilog
+#define REPORT_MAX_PHASES 32
+
+struct pm_stats {
+  long nsyscalls;                       // Syscalls accessing sysfs, procfs and devfs files, counted where issued
+  long nmsr_ops;                        // MSR read/write operations
+};
+
+struct pm_phase {
+  const char *name;
+  struct timespec begin;
+  double elapsed_ms;
+  long nsyscalls;
+  long nmsr_ops;
+};
+
+extern struct pm_stats pm_stats;
+
+// Update a counter of pm_stats, the workers update them concurrently
+#define STAT_ADD(counter, n) __atomic_add_fetch(&pm_stats.counter, (n), __ATOMIC_RELAXED)
 
 #define FALSE 0
 #define TRUE 1
@@ -95,13 +642,53 @@ Author: Daniele Cesarini, University of Bologna
 // pm_msrsafe.c
 int slurm_spank_init(spank_t spank_ctx, int argc, char **argv);
 int slurm_spank_slurmd_init(spank_t spank_ctx, int argc, char **argv);
+int slurm_spank_user_init(spank_t spank_ctx, int argc, char **argv);
+int slurm_spank_task_exit(spank_t spank_ctx, int argc, char **argv);
+int slurm_spank_exit(spank_t spank_ctx, int argc, char **argv);
 int slurm_spank_job_prolog(spank_t spank_ctx, int argc, char **argv);
 int slurm_spank_job_epilog(spank_t spank_ctx, int argc, char **argv);
 
+// config.c
+int parse_plugin_args(int argc, char **argv);
+int init_paths();
+
+// baseline.c
+int baseline_enabled();
+int check_baseline_file(const char *file);
+int open_baseline_file(const char *file);
+int capture_baseline(int refresh);
+int mark_plugin_started();
+
+// drift.c
+long check_msr_drift();
+int refresh_drift_reference(const char *file);
+
+// rapl.c
+int rapl_snapshot();
+int rapl_account();
+
+// job_options.c
+int register_job_options(spank_t spank_ctx);
+int apply_job_options(spank_t spank_ctx);
+
+// sampler.c
+int start_sampler(const char *file);
+int stop_sampler();
+int print_samples(const char *file);
+
 // slurm.c
 int check_enable_plugin();
 int check_exclusive_node();
 int check_plugin_started();
+int check_enable_step(spank_t spank_ctx);
+int get_samples_file(spank_t spank_ctx, char *file);
+
+// cpuset.c
+int load_job_cpuset(int conf);
+void free_job_cpuset();
+long job_ncpus();
+long job_cpu(long i);
+int job_owns(long cpu, int scope);
 
 // msrsafe.c
 int read_msr(int fd, long cpu_id, uint64_t addr, uint64_t *value);
@@ -110,22 +697,115 @@ int read_msr_file(long cpu_id, uint64_t addr, uint64_t *value);
 int write_msr_file(long cpu_id, uint64_t addr, uint64_t value);
 int set_msrsafe(int conf);
 
+// msr_context.c
+int get_msr_fd(long cpu);
+void put_msr_fd(long cpu);
+int get_msr_batch_fd();
+void free_msr_context();
+
+// msr_batch.c
+long exec_msr_batch(struct msr_batch_op *ops, long nops);
+int group_msr_batch_by_cpu(struct msr_batch_op *ops, long nops);
+long merge_msr_batch(struct msr_batch_op *ops, long nops, long *nfailed);
+
+// whitelist.c
+int build_whitelist_cache();
+long get_whitelist(struct msr_whitelist *wl);
+void put_whitelist(struct msr_whitelist *wl);
+
+// topology.c
+struct cpu_model *get_cpu_model();
+int msr_scope_known();
+int msr_scope(uint64_t addr);
+int build_topology_cache();
+struct cpu_topology *get_topology();
+void free_topology();
+int cpu_is_online(long cpu);
+long get_nonline();
+long get_online_cpu(long i);
+int topology_is_leader(struct cpu_topology *topo, long cpu, int scope);
+long get_package_leaders(uint32_t **cpus, uint32_t **pkgs);
+
+// msr_dump.c
+int write_msr_dump(const char *file, struct msr_dump_record *records, long nrecords,
+  long ncpus, long nregs);
+int map_msr_dump(const char *file, struct msr_dump *dump);
+void unmap_msr_dump(struct msr_dump *dump);
+long load_msr_dump_text(const char *file, struct msr_batch_op **ops);
+int print_msr_dump(const char *file);
+int convert_msr_dump(const char *text_file, const char *bin_file);
+int dump_msr_ops(const char *file, struct msr_batch_op *ops, long nops, uint64_t mask,
+  long nregs);
+int restore_msr_dump(const char *file);
+
+// workers.c
+int exec_msr_parallel(struct msr_batch_op *ops, long nops, long nthreads);
+
 // intel_pstate.c
 int set_ipstate(int conf);
 
 // cpufreq.c
 int set_cpufreq(int conf);
+int pin_job_cpufreq(int32_t *freqs);
+int restore_job_cpufreq();
+
+// freq_table.c
+struct freq_table *get_freq_table(int build);
+int freq_max_ratio(struct freq_table *ft);
+int freq_to_ratio(struct freq_table *ft, long khz);
+int format_freq_table(struct freq_table *ft, char *str, size_t size);
+
+// hwp.c
+int hwp_enabled();
+int hack_hwp();
+int set_hwp(int conf);
+
+// uncore.c
+int set_uncore(int conf);
+int set_uncore_freq(long min_khz, long max_khz);
 
 // pm.c
 int set_pm(int conf);
 
+// report.c
+void report_begin(const char *hook);
+int phase_begin(const char *name);
+void phase_end(int index);
+int report_end(int ret);
+
+// permissions.c
+void init_perm_list(struct perm_list *list);
+int add_perm(struct perm_list *list, int kind, const char *file);
+void free_perm_list(struct perm_list *list);
+int apply_permissions(struct perm_list *list, int conf, const char *phase);
+
+// sysfs_io.c
+void init_sysfs_batch(struct sysfs_batch *batch);
+long add_sysfs_req(struct sysfs_batch *batch, int write, const char *file, const char *value);
+void free_sysfs_batch(struct sysfs_batch *batch);
+long exec_sysfs_batch(struct sysfs_batch *batch);
+
+// node_state.c
+struct node_state *get_node_state(int fields);
+void free_node_state();
+int set_node_governor(struct node_state *st, long cpu, const char *name);
+int is_policy_leader(struct node_state *st, long cpu);
+int job_owns_policy(struct node_state *st, long cpu);
+void sync_node_policies(struct node_state *st);
+int write_node_state(const char *file, struct node_state *st);
+int restore_node_state(const char *file, const char *driver);
+
 // common.c
 int str_to_bool(const char str[]);
-int set_read_permission(char *file, int conf);
-int set_write_permission(char *file, int conf);
-int set_read_write_permission(char *file, int conf);
-int set_read_no_write_permission(char file[], int conf);
+long read_fd(int fd, char *buf, size_t size);
+long read_file(const char *file, char *buf, size_t size);
+void read_boot_id(char *boot_id);
 int read_str_from_file(char *file, char *str);
 int write_str_to_file(char *file, char *str);
+int write_file_atomic(const char *file, const void *data, size_t size);
+int update_str_to_file(char *file, char *str);
+uint64_t hash_fnv1a(const void *data, size_t size);
+long get_ncpus();
+long parse_cpu_list(const char *str, uint8_t *cpus, long ncpus);
 
 #endif // _PM_MSRSAFE_H_
@@ -0,0 +1,243 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+
+#include "pm_msrsafe.h"
+
+// The configuration of the node is not restored by the jobs of a shared node
+int baseline_enabled()
+{
+  return pm_conf.baseline && !job_cpuset.shared;
+}
+
+// A baseline file is trusted only if it is a regular file, not a symlink,
+// owned by the slurm daemon and not writable by other users
+static int check_baseline_info(const char *file, struct stat *info)
+{
+  if(!S_ISREG(info->st_mode) || info->st_uid != getuid() ||
+     (info->st_mode & (S_IWGRP | S_IWOTH))){
+    slurm_info("The ownership or the permissions of the baseline file '%s' are wrong. "
+      "Hacking attempt! The plugin will not use this baseline file!\n", file);
+    return -2;
+  }
+
+  return 0;
+}
+
+int check_baseline_file(const char *file)
+{
+  struct stat info;
+
+  if(lstat(file, &info) < 0)
+    return -1;
+
+  return check_baseline_info(file, &info);
+}
+
+// Open a baseline file for reading without following symlinks, the checks
+// are done on the descriptor. Return the descriptor or a negative value
+int open_baseline_file(const char *file)
+{
+  struct stat info;
+  int fd;
+
+  fd = open(file, O_RDONLY | O_NOFOLLOW);
+  if(fd < 0){
+    if(errno == ELOOP)
+      check_baseline_file(file);
+    return -1;
+  }
+  if(fstat(fd, &info) < 0 || check_baseline_info(file, &info) < 0){
+    close(fd);
+    return -2;
+  }
+
+  return fd;
+}
+
+static int check_baseline_dir()
+{
+  struct stat info;
+
+  if(mkdir(PM_BASELINE_DIR, 0700) < 0 && errno != EEXIST){
+    slurm_info("Failed to create the baseline directory '%s'!\n", PM_BASELINE_DIR);
+    return -1;
+  }
+
+  if(stat(PM_BASELINE_DIR, &info) < 0 || !S_ISDIR(info.st_mode) ||
+     info.st_uid != getuid() || (info.st_mode & (S_IWGRP | S_IWOTH))){
+    slurm_info("The ownership or the permissions of the baseline directory '%s' are wrong!\n",
+      PM_BASELINE_DIR);
+    return -2;
+  }
+
+  return 0;
+}
+
+// Stamp of the current boot, processor microcode and whitelist
+static void get_baseline_stamp(struct baseline_stamp *stamp)
+{
+  struct cpu_model *model = get_cpu_model();
+  struct msr_whitelist whitelist;
+  long nwl;
+
+  memset(stamp, 0, sizeof(struct baseline_stamp));
+  stamp->magic = BASELINE_STAMP_MAGIC;
+  stamp->version = BASELINE_STAMP_VERSION;
+  read_boot_id(stamp->boot_id);
+  stamp->family = model->family;
+  stamp->model = model->model;
+  stamp->microcode = model->microcode;
+
+  // The nodes without MSR_SAFE have no whitelist
+  if(access(MSRSAFE_WHITELIST_FILE, F_OK) == 0 && (nwl = get_whitelist(&whitelist)) >= 0){
+    stamp->whitelist_hash = hash_fnv1a(whitelist.entries, nwl * sizeof(struct msr_wl_entry));
+    put_whitelist(&whitelist);
+  }
+
+  stamp->checksum = hash_fnv1a(stamp, offsetof(struct baseline_stamp, checksum));
+}
+
+static int write_baseline_stamp(struct baseline_stamp *stamp)
+{
+  FILE *fd_stamp;
+  int ret = 0;
+
+  fd_stamp = fopen(PM_BASELINE_STAMP, "w");
+  if(fd_stamp == NULL){
+    slurm_info("Failed to open '%s'!\n", PM_BASELINE_STAMP);
+    return -1;
+  }
+  if(fwrite(stamp, sizeof(struct baseline_stamp), 1, fd_stamp) != 1)
+    ret = -2;
+  if(fclose(fd_stamp) != 0)
+    ret = -2;
+  if(ret < 0)
+    slurm_info("Failed to write the baseline stamp '%s'!\n", PM_BASELINE_STAMP);
+
+  return ret;
+}
+
+// Check that the baseline has been captured in the current boot, with the
+// same microcode and whitelist
+static int check_baseline_stamp(struct baseline_stamp *current)
+{
+  struct baseline_stamp stamp;
+  FILE *fd_stamp;
+  int ret = 0;
+
+  if(check_baseline_file(PM_BASELINE_STAMP) < 0)
+    return -1;
+  fd_stamp = fopen(PM_BASELINE_STAMP, "r");
+  if(fd_stamp == NULL)
+    return -1;
+
+  if(fread(&stamp, sizeof(struct baseline_stamp), 1, fd_stamp) != 1 ||
+     stamp.magic != BASELINE_STAMP_MAGIC || stamp.version != BASELINE_STAMP_VERSION ||
+     stamp.checksum != hash_fnv1a(&stamp, offsetof(struct baseline_stamp, checksum)))
+    ret = -2;
+  else if(current->boot_id[0] == '\0' || strcmp(stamp.boot_id, current->boot_id) != 0)
+    ret = -3;
+  else if(stamp.family != current->family || stamp.model != current->model ||
+     stamp.microcode != current->microcode)
+    ret = -4;
+  else if(stamp.whitelist_hash != current->whitelist_hash)
+    ret = -5;
+  fclose(fd_stamp);
+
+  return ret;
+}
+
+// Capture the golden configuration of the node (MSRs, cpufreq or
+// intel_pstate) restored by the epilog of each job, an existing baseline is
+// kept across the restarts of slurmd unless refreshed by the admin or
+// captured in a previous boot, with another microcode or whitelist
+int capture_baseline(int refresh)
+{
+  struct baseline_stamp stamp;
+  int ret = 0, stale;
+
+  if(check_baseline_dir() < 0)
+    return -1;
+
+  // The MSR baseline is missing on the nodes without MSR_SAFE
+  get_baseline_stamp(&stamp);
+  if(!refresh && (check_baseline_file(PM_BASELINE_CPUFREQ) == 0 ||
+     check_baseline_file(PM_BASELINE_IPSTATE) == 0)){
+    stale = check_baseline_stamp(&stamp);
+    if(stale == 0){
+      slurm_info("Using the baseline of the node in '%s'!\n", PM_BASELINE_DIR);
+      return 0;
+    }
+    slurm_info("The baseline of the node in '%s' is stale (%s), capturing it again!\n",
+      PM_BASELINE_DIR, stale == -3 ? "reboot" : stale == -4 ? "microcode update" :
+      stale == -5 ? "whitelist change" : "no valid stamp");
+  }
+
+  report_begin("baseline");
+
+  // The dump files point to the baseline files
+  if(set_msrsafe(DUMP) < 0)
+    ret = -2;
+  if(set_pm(DUMP) < 0)
+    ret = -3;
+
+  // A partial baseline is captured again at the next start
+  if(ret == 0 && write_baseline_stamp(&stamp) < 0)
+    ret = -4;
+
+  report_end(ret);
+  free_node_state();
+
+  if(ret == 0)
+    slurm_info("Captured the baseline of the node in '%s'!\n", PM_BASELINE_DIR);
+
+  return ret;
+}
+
+// In baseline mode the dumps always exist, the epilog restores the node
+// only if the prolog left this marker
+int mark_plugin_started()
+{
+  char *job_id = getenv("SLURM_JOB_ID");
+
+  if(job_id == NULL)
+    job_id = "none";
+  if(write_file_atomic(PM_STARTED, job_id, strlen(job_id)) < 0){
+    slurm_info("Failed to write the marker file '%s'!\n", PM_STARTED);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,341 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+
+// Benchmark of the prolog/epilog on a fake sysfs/devfs tree, the plugin paths
+// are redirected to the tree with the 'root' argument
+
+#include "pm_msrsafe.h"
+
+#define BENCH_DEFAULT_NCPUS 64
+#define BENCH_DEFAULT_NPKGS 2
+#define BENCH_DEFAULT_NREGS 128
+#define BENCH_DEFAULT_POLICY_CPUS 1
+#define BENCH_DEFAULT_ITERATIONS 20
+
+// First whitelisted register, the following ones are contiguous
+#define BENCH_FIRST_MSR 0x600
+
+static int make_dir(const char *root, const char *path)
+{
+  char dir[BUFFER_SIZE];
+  char *ptr;
+
+  snprintf(dir, sizeof(dir), "%s%s", root, path);
+
+  for(ptr = dir + strlen(root) + 1; *ptr != '\0'; ptr++){
+    if(*ptr == '/'){
+      *ptr = '\0';
+      if(mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return -1;
+      *ptr = '/';
+    }
+  }
+  if(mkdir(dir, 0755) < 0 && errno != EEXIST)
+    return -1;
+
+  return 0;
+}
+
+static int make_file(const char *file, const char *str, off_t size)
+{
+  int fd, ret = 0;
+
+  fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0){
+    fprintf(stderr, "Failed to create '%s'!\n", file);
+    return -1;
+  }
+
+  if(str != NULL && write(fd, str, strlen(str)) != (ssize_t) strlen(str))
+    ret = -1;
+  // Sparse file standing in for the msr_safe device
+  if(size > 0 && ftruncate(fd, size) < 0)
+    ret = -1;
+
+  close(fd);
+
+  return ret;
+}
+
+static int make_cpu_file(const char *format, long cpu, const char *str)
+{
+  char file[BUFFER_SIZE];
+
+  snprintf(file, sizeof(file), format, cpu);
+  return make_file(file, str, 0);
+}
+
+// Create the fake tree, the paths are already prefixed with the root
+static int make_tree(const char *root, const char *driver, long ncpus,
+  long npkgs, long nregs, long policy_cpus)
+{
+  char path[BUFFER_SIZE];
+  char str[BUFFER_SIZE];
+  char *whitelist, *ptr;
+  long cpu, i, cpus_per_pkg;
+  size_t len;
+  int ret = 0;
+
+  cpus_per_pkg = (ncpus + npkgs - 1) / npkgs;
+
+  ret |= make_dir(root, "/tmp");
+  ret |= make_dir(root, "/var/lib");
+  ret |= make_dir(root, "/sys/devices/system/cpu/intel_pstate");
+  ret |= make_dir(root, "/dev/cpu");
+  ret |= make_dir(root, "/proc/sys/kernel/random");
+  ret |= make_file(PM_BOOT_ID, "00000000-0000-0000-0000-000000000000\n", 0);
+
+  // Xeon processor, the scopes of the MSRs are known
+  ret |= make_file(PM_CPUINFO, "processor\t: 0\nvendor_id\t: GenuineIntel\n"
+    "cpu family\t: 6\nmodel\t\t: 85\nmodel name\t: Fake Xeon\n\n", 0);
+
+  snprintf(str, sizeof(str), "0-%ld\n", ncpus - 1);
+  ret |= make_file(PM_CPU_ONLINE, str, 0);
+
+  for(cpu = 0; cpu < ncpus && ret == 0; cpu++){
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%ld/cpufreq", cpu);
+    ret |= make_dir(root, path);
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%ld/topology", cpu);
+    ret |= make_dir(root, path);
+    snprintf(path, sizeof(path), "/dev/cpu/%ld", cpu);
+    ret |= make_dir(root, path);
+
+    ret |= make_cpu_file(PM_DRIVER, cpu, driver);
+    ret |= make_cpu_file(PM_GOVERNOR, cpu, "powersave");
+    ret |= make_cpu_file(PM_SCALING_MAX_FREQ, cpu, "3000000");
+    ret |= make_cpu_file(PM_SCALING_MIN_FREQ, cpu, "1000000");
+    ret |= make_cpu_file(PM_CPUINFO_MAX_FREQ, cpu, "3000000");
+    ret |= make_cpu_file(PM_CPUINFO_MIN_FREQ, cpu, "1000000");
+    ret |= make_cpu_file(PM_CPUFREQ_SCALING_SETSPEED, cpu, "<unsupported>");
+
+    // Two hardware threads for each core
+    snprintf(str, sizeof(str), "%ld", cpu / cpus_per_pkg);
+    ret |= make_cpu_file(PM_TOPOLOGY_PACKAGE_ID, cpu, str);
+    snprintf(str, sizeof(str), "%ld", (cpu % cpus_per_pkg) / 2);
+    ret |= make_cpu_file(PM_TOPOLOGY_CORE_ID, cpu, str);
+    ret |= make_cpu_file(PM_TOPOLOGY_DIE_ID, cpu, "0");
+
+    snprintf(path, sizeof(path), MSRSAFE_CPU_FILE, cpu);
+    ret |= make_file(path, NULL, (BENCH_FIRST_MSR + nregs + 1) * sizeof(uint64_t));
+  }
+
+  // Consecutive cpus share a cpufreq policy
+  for(cpu = 0; cpu < ncpus && ret == 0; cpu += policy_cpus){
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpufreq/policy%ld", cpu);
+    ret |= make_dir(root, path);
+    for(i = cpu, len = 0; i < cpu + policy_cpus && i < ncpus && len < sizeof(str); i++)
+      len += snprintf(str + len, sizeof(str) - len, i == cpu ? "%ld" : " %ld", i);
+    ret |= make_cpu_file(PM_CPUFREQ_AFFECTED_CPUS, cpu, str);
+  }
+
+  ret |= make_file(PM_IPSTATE_NO_TURBO, "0", 0);
+  ret |= make_file(PM_IPSTATE_MAX_PERF_PCT, "100", 0);
+  ret |= make_file(PM_IPSTATE_MIN_PERF_PCT, "10", 0);
+  ret |= make_file(PM_IPSTATE_STATUS, "active", 0);
+  ret |= make_file(MSRSAFE_BATCH_FILE, NULL, 0);
+
+  // One line for each register, as in the msr_safe whitelist format
+  whitelist = malloc(nregs * 64 + 1);
+  if(whitelist == NULL)
+    return -1;
+  ptr = whitelist;
+  *ptr = '\0';
+  for(i = 0; i < nregs; i++)
+    ptr += sprintf(ptr, "0x%08lX 0xFFFFFFFFFFFFFFFF\n", BENCH_FIRST_MSR + i);
+  ret |= make_file(MSRSAFE_WHITELIST_FILE, whitelist, 0);
+  free(whitelist);
+
+  return ret;
+}
+
+static double elapsed_ms(struct timespec *begin, struct timespec *end)
+{
+  return (end->tv_sec - begin->tv_sec) * 1e3 +
+    (end->tv_nsec - begin->tv_nsec) / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+static void print_percentiles(const char *hook, double *samples, long nsamples)
+{
+  qsort(samples, nsamples, sizeof(double), cmp_double);
+
+  printf("%-8s p50 %9.3f ms  p90 %9.3f ms  p99 %9.3f ms  max %9.3f ms\n", hook,
+    samples[nsamples * 50 / 100], samples[nsamples * 90 / 100],
+    samples[nsamples * 99 / 100], samples[nsamples - 1]);
+}
+
+static void usage()
+{
+  printf("Usage: pm_msrsafe_bench [options] [key=value ...]\n");
+  printf("  '-n <ncpus>': number of fake CPUs (default %d)\n", BENCH_DEFAULT_NCPUS);
+  printf("  '-s <npkgs>': number of fake packages (default %d)\n", BENCH_DEFAULT_NPKGS);
+  printf("  '-w <nregs>': number of whitelisted MSRs (default %d)\n", BENCH_DEFAULT_NREGS);
+  printf("  '-P <ncpus>': number of cpus of each cpufreq policy (default %d)\n",
+    BENCH_DEFAULT_POLICY_CPUS);
+  printf("  '-i <iterations>': prolog/epilog iterations (default %d)\n", BENCH_DEFAULT_ITERATIONS);
+  printf("  '-d <dir>': root directory of the fake tree (default a new /tmp directory)\n");
+  printf("  '-D <driver>': power driver, intel_pstate or acpi-cpufreq (default intel_pstate)\n");
+  printf("  'key=value': plugin argument as in plugstack.conf\n");
+}
+
+int main(int argc, char **argv)
+{
+  long ncpus = BENCH_DEFAULT_NCPUS;
+  long npkgs = BENCH_DEFAULT_NPKGS;
+  long nregs = BENCH_DEFAULT_NREGS;
+  long policy_cpus = BENCH_DEFAULT_POLICY_CPUS;
+  long niters = BENCH_DEFAULT_ITERATIONS;
+  char root[BUFFER_SIZE] = "/tmp/pm_msrsafe_bench.XXXXXX";
+  char root_arg[BUFFER_SIZE];
+  char *driver = "intel_pstate";
+  char *dir = NULL;
+  char *args[argc + 1];
+  double *prolog, *epilog;
+  struct timespec begin, end;
+  int i, nargs = 0, stdout_fd, null_fd;
+  int c;
+
+  while((c = getopt(argc, argv, "n:s:w:P:i:d:D:h")) != -1){
+    switch(c){
+      case 'n':
+        ncpus = strtol(optarg, NULL, 10);
+        break;
+      case 's':
+        npkgs = strtol(optarg, NULL, 10);
+        break;
+      case 'w':
+        nregs = strtol(optarg, NULL, 10);
+        break;
+      case 'P':
+        policy_cpus = strtol(optarg, NULL, 10);
+        break;
+      case 'i':
+        niters = strtol(optarg, NULL, 10);
+        break;
+      case 'd':
+        dir = optarg;
+        break;
+      case 'D':
+        driver = optarg;
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if(ncpus <= 0 || npkgs <= 0 || npkgs > ncpus || nregs <= 0 || niters <= 0 ||
+     policy_cpus <= 0){
+    usage();
+    return 1;
+  }
+
+  if(dir != NULL){
+    snprintf(root, sizeof(root), "%s", dir);
+    if(make_dir("", root) < 0){
+      fprintf(stderr, "Failed to create '%s'!\n", root);
+      return 1;
+    }
+  }
+  else if(mkdtemp(root) == NULL){
+    fprintf(stderr, "Failed to create '%s'!\n", root);
+    return 1;
+  }
+
+  // Plugin arguments, the root directory first
+  snprintf(root_arg, sizeof(root_arg), "root=%s", root);
+  args[nargs++] = root_arg;
+  for(i = optind; i < argc; i++)
+    args[nargs++] = argv[i];
+
+  if(parse_plugin_args(nargs, args) < 0){
+    fprintf(stderr, "Invalid plugin arguments!\n");
+    return 1;
+  }
+
+  if(make_tree(root, driver, ncpus, npkgs, nregs, policy_cpus) < 0){
+    fprintf(stderr, "Failed to create the fake tree in '%s'!\n", root);
+    return 1;
+  }
+
+  prolog = malloc(niters * sizeof(double));
+  epilog = malloc(niters * sizeof(double));
+  if(prolog == NULL || epilog == NULL)
+    return 1;
+
+  // Silence the plugin messages during the measures
+  fflush(stdout);
+  stdout_fd = dup(STDOUT_FILENO);
+  null_fd = open("/dev/null", O_WRONLY);
+  if(stdout_fd < 0 || null_fd < 0)
+    return 1;
+  dup2(null_fd, STDOUT_FILENO);
+
+  slurm_spank_slurmd_init(NULL, nargs, args);
+
+  for(i = 0; i < niters; i++){
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    slurm_spank_job_prolog(NULL, nargs, args);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    prolog[i] = elapsed_ms(&begin, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    slurm_spank_job_epilog(NULL, nargs, args);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    epilog[i] = elapsed_ms(&begin, &end);
+  }
+
+  fflush(stdout);
+  dup2(stdout_fd, STDOUT_FILENO);
+  close(stdout_fd);
+  close(null_fd);
+
+  printf("Root '%s': %ld cpus, %ld packages, %ld MSRs, driver %s, %ld iterations\n",
+    root, ncpus, npkgs, nregs, driver, niters);
+  print_percentiles("prolog", prolog, niters);
+  print_percentiles("epilog", epilog, niters);
+
+  free(prolog);
+  free(epilog);
+
+  return 0;
+}
@@ -47,171 +47,225 @@ int str_to_bool(const char str[])
 }
 
 
-int set_read_permission(char file[], int conf)
+// Read a descriptor until EOF or until the buffer is full, the content is
+// terminated. Each syscall is counted, return the bytes read or -1
+long read_fd(int fd, char *buf, size_t size)
 {
-  struct stat info;
-  mode_t mode;
-  int ret = 0;
+  size_t total = 0;
+  ssize_t len;
+
+  do{
+    len = read(fd, buf + total, size - 1 - total);
+    STAT_ADD(nsyscalls, 1);
+    if(len > 0)
+      total += len;
+  }while(len > 0 && total < size - 1);
+  buf[total] = '\0';
+
+  return len < 0 ? -1 : (long) total;
+}
 
-  if(access(file, F_OK) != 0){
-    slurm_info("'%s' does not exist!\n", file);
-    ret = -1;
-  }
-  else{
-    if(stat(file, &info) < 0){
-      slurm_info("Failed to read the permissions of file '%s'!\n", file);
-      ret = -2;
-    }
-    else{
-      mode = info.st_mode;
-      if(conf == SET)
-        mode |= S_IROTH;
-      else if(conf == RESET)
-        mode &= ~(S_IROTH);
-      if(chmod(file, mode) != 0){
-        slurm_info("Failed to set the read permission of file '%s'!\n", file);
-        ret = -3;
-      }
-    }
-  }
+// Read the file until EOF or until the buffer is full, see read_fd()
+long read_file(const char *file, char *buf, size_t size)
+{
+  long ret;
+  int fd;
+
+  fd = open(file, O_RDONLY);
+  STAT_ADD(nsyscalls, 1);
+  if(fd < 0)
+    return -1;
+
+  ret = read_fd(fd, buf, size);
+
+  close(fd);
+  STAT_ADD(nsyscalls, 1);
 
   return ret;
 }
 
-int set_write_permission(char file[], int conf)
+// Boot id of the kernel, empty if not available
+void read_boot_id(char *boot_id)
 {
-  struct stat info;
-  mode_t mode;
-  int ret = 0;
-
-  if(access(file, F_OK) != 0){
-    slurm_info("'%s' does not exist!\n", file);
-    ret = -1;
-  }
-  else{
-    if(stat(file, &info) < 0){
-      slurm_info("Failed to read the permissions of file '%s'!\n", file);
-      ret = -2;
-    }
-    else{
-      mode = info.st_mode;
-      if(conf == SET)
-        mode |= S_IWOTH;
-      else if(conf == RESET)
-        mode &= ~(S_IWOTH);
-      if(chmod(file, mode) != 0){
-        slurm_info("Failed to set the write permission of file '%s'!\n", file);
-        ret = -3;
-      }
-    }
-  }
+  char data[BUFFER_SIZE];
 
-  return ret;
+  memset(boot_id, 0, BOOT_ID_SIZE);
+  if(read_str_from_file(PM_BOOT_ID, data) == 1)
+    snprintf(boot_id, BOOT_ID_SIZE, "%.*s", BOOT_ID_SIZE - 1, data);
 }
 
-int set_read_write_permission(char file[], int conf)
+// Read the first word of the file, return 1 or -1 if the file cannot be read
+// or it is empty as fscanf("%s")
+int read_str_from_file(char *file, char *str)
 {
-  struct stat info;
-  mode_t mode;
-  int ret = 0;
+  char buf[BUFFER_SIZE];
+  char *begin, *end;
 
-  if(access(file, F_OK) != 0){
-    slurm_info("'%s' does not exist!\n", file);
-    ret = -1;
-  }
-  else{
-    if(stat(file, &info) < 0){
-      slurm_info("Failed to read the permissions of file '%s'!\n", file);
-      ret = -2;
-    }
-    else{
-      mode = info.st_mode;
-      if(conf == SET){
-        mode |= S_IROTH;
-        mode |= S_IWOTH;
-      }
-      else if(conf == RESET){
-        mode &= ~(S_IROTH);
-        mode &= ~(S_IWOTH);
-      }
-      if(chmod(file, mode) != 0){
-        slurm_info("Failed to set the read/write permission of file '%s'!\n", file);
-        ret = -3;
-      }
-    }
+  if(read_file(file, buf, sizeof(buf)) < 0){
+    slurm_info("Failed to open '%s'!\n", file);
+    return -1;
   }
 
-  return ret;
+  for(begin = buf; isspace(*begin); begin++);
+  for(end = begin; *end != '\0' && !isspace(*end); end++);
+  if(end == begin)
+    return -1;
+  memcpy(str, begin, end - begin);
+  str[end - begin] = '\0';
+
+  return 1;
 }
 
-int set_read_no_write_permission(char file[], int conf)
+// Write the string to the file, the errors of sysfs files (e.g. EINVAL or
+// EBUSY) are reported by write() or close(). Return the bytes written or -1
+int write_str_to_file(char *file, char *str)
 {
-  struct stat info;
-  mode_t mode;
-  int ret = 0;
+  ssize_t len = strlen(str);
+  int fd, ret = 0;
+
+  fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  STAT_ADD(nsyscalls, 1);
+  if(fd < 0){
+    slurm_info("Failed to open '%s'!\n", file);
+    return -1;
+  }
 
-  if(access(file, F_OK) != 0){
-    slurm_info("'%s' does not exist!\n", file);
+  if(write(fd, str, len) != len)
+    ret = -1;
+  if(close(fd) != 0)
     ret = -1;
+  STAT_ADD(nsyscalls, 2);
+
+  return ret < 0 ? -1 : len;
+}
+
+// Create a file of the slurm daemon readable by the jobs: the data is written
+// in a temporary file with a unique name (mkstemp, O_EXCL), renamed over the
+// file. A symlink or a file pre-created by a user in /tmp is replaced and
+// never written through. Return 0 or a negative value
+int write_file_atomic(const char *file, const void *data, size_t size)
+{
+  char tmp_file[BUFFER_SIZE + 8];
+  int fd, ret = 0;
+
+  snprintf(tmp_file, sizeof(tmp_file), "%s.XXXXXX", file);
+  fd = mkstemp(tmp_file);
+  STAT_ADD(nsyscalls, 1);
+  if(fd < 0){
+    slurm_info("Failed to create a temporary file for '%s'!\n", file);
+    return -1;
   }
-  else{
-    if(stat(file, &info) < 0){
-      slurm_info("Failed to read the permissions of file '%s'!\n", file);
-      ret = -2;
-    }
-    else{
-      mode = info.st_mode;
-      if(conf == SET){
-        mode |= S_IROTH;
-        mode |= S_IWOTH;
-      }
-      else if(conf == RESET){
-        mode &= ~(S_IWOTH);
-      }
-      if(chmod(file, mode) != 0){
-        slurm_info("Failed to set the read/write permission of file '%s'!\n", file);
-        ret = -3;
-      }
-    }
+
+  if(fchmod(fd, 0644) < 0 || write(fd, data, size) != size)
+    ret = -2;
+  if(close(fd) != 0)
+    ret = -2;
+  if(ret == 0 && rename(tmp_file, file) < 0)
+    ret = -3;
+  STAT_ADD(nsyscalls, 4);
+  if(ret < 0){
+    slurm_info("Failed to write '%s'!\n", file);
+    remove(tmp_file);
   }
 
   return ret;
 }
 
-int read_str_from_file(char *file, char *str)
+// Write the string to the file only if it differs from the current content,
+// return TRUE if the file has been written
+int update_str_to_file(char *file, char *str)
 {
-  FILE *fd;
-  int ret = 0;
+  char current[BUFFER_SIZE];
 
-  // Open files
-  fd = fopen(file, "r");
-  if(fd == NULL){
-    slurm_info("Failed to open '%s'!\n", file);
+  if(read_str_from_file(file, current) == 1 && strcmp(current, str) == 0)
+    return FALSE;
+
+  if(write_str_to_file(file, str) < 0)
     return -1;
-  }
 
-  ret = fscanf(fd, "%s", str);
+  return TRUE;
+}
+
+// 64-bit FNV-1a hash
+uint64_t hash_fnv1a(const void *data, size_t size)
+{
+  const unsigned char *ptr = (const unsigned char *) data;
+  uint64_t hash = 0xcbf29ce484222325UL;
+  size_t i;
 
-  fclose(fd);
+  for(i = 0; i < size; i++){
+    hash ^= ptr[i];
+    hash *= 0x100000001b3UL;
+  }
 
-  return ret;
+  return hash;
 }
 
-int write_str_to_file(char *file, char *str)
+// Last online CPU + 1, the size of the arrays indexed by cpu id, read from the
+// online CPU list (e.g. '0-3,8-11') to follow the root directory set in
+// plugstack.conf. The number of online CPUs is get_nonline()
+long get_ncpus()
 {
-  FILE *fd = NULL;
-  int ret = 0;
-
-  // Open files
-  fd = fopen(file, "w");
-  if(fd == NULL){
-    slurm_info("Failed to open '%s'!\n", file);
-    return -1;
+  static long ncpus = 0;
+  char str[BUFFER_SIZE];
+  char *ptr, *eptr;
+  long cpu;
+
+  if(ncpus > 0)
+    return ncpus;
+
+  if(read_str_from_file(PM_CPU_ONLINE, str) == 1){
+    for(ptr = str; *ptr != '\0'; ptr = eptr){
+      cpu = strtol(ptr, &eptr, 10);
+      if(eptr == ptr)
+        break;
+      if(cpu + 1 > ncpus)
+        ncpus = cpu + 1;
+      if(*eptr == '-' || *eptr == ',')
+        eptr++;
+    }
   }
 
-  ret = fprintf(fd, "%s", str);
+  if(ncpus <= 0)
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-  fclose(fd);
+  return ncpus;
+}
 
-  return ret;
+// Mark the cpus of a list (e.g. '0-3,8,10-11'), return the number of cpus
+// or a negative value if the list is invalid or out of range
+long parse_cpu_list(const char *str, uint8_t *cpus, long ncpus)
+{
+  const char *ptr = str;
+  char *eptr;
+  long first, last, cpu, count = 0;
+
+  while(*ptr != '\0'){
+    first = strtol(ptr, &eptr, 10);
+    if(eptr == ptr || first < 0)
+      return -1;
+    last = first;
+    if(*eptr == '-'){
+      ptr = eptr + 1;
+      last = strtol(ptr, &eptr, 10);
+      if(eptr == ptr || last < first)
+        return -1;
+    }
+    if(last >= ncpus)
+      return -2;
+    for(cpu = first; cpu <= last; cpu++){
+      if(!cpus[cpu])
+        count++;
+      cpus[cpu] = TRUE;
+    }
+    if(*eptr == ',')
+      eptr++;
+    else if(*eptr != '\0' && *eptr != '\n')
+      return -1;
+    else
+      break;
+    ptr = eptr;
+  }
+
+  return count;
 }
@@ -0,0 +1,346 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+#include "pm_msrsafe.h"
+
+// Plugin configuration, see parse_plugin_args()
+struct pm_conf pm_conf = {
+  .nthreads = 0,
+  .delta_restore = FALSE,
+  .msr_scope = TRUE,
+  .report_dir = "",
+  .root = "",
+  .io_uring = TRUE,
+  .cpufreq_policy = TRUE,
+  .baseline = FALSE,
+  .drift = DRIFT_OFF,
+  .energy_dir = "",
+  .sampler_rate = 0,
+  .sampler_slots = 1024,
+  .sampler_dir = "/tmp",
+  .shared = FALSE,
+  .msr_fds = 256,
+};
+
+// Default paths, see init_paths()
+struct pm_paths pm_paths = {
+  .driver = "/sys/devices/system/cpu/cpu%ld/cpufreq/scaling_driver",
+  .governor = "/sys/devices/system/cpu/cpu%ld/cpufreq/scaling_governor",
+  .scaling_max_freq = "/sys/devices/system/cpu/cpu%ld/cpufreq/scaling_max_freq",
+  .scaling_min_freq = "/sys/devices/system/cpu/cpu%ld/cpufreq/scaling_min_freq",
+  .cpuinfo_max_freq = "/sys/devices/system/cpu/cpu%ld/cpufreq/cpuinfo_max_freq",
+  .cpuinfo_min_freq = "/sys/devices/system/cpu/cpu%ld/cpufreq/cpuinfo_min_freq",
+  .cpu_online = "/sys/devices/system/cpu/online",
+  .topology_package_id = "/sys/devices/system/cpu/cpu%ld/topology/physical_package_id",
+  .topology_core_id = "/sys/devices/system/cpu/cpu%ld/topology/core_id",
+  .topology_die_id = "/sys/devices/system/cpu/cpu%ld/topology/die_id",
+  .cpuinfo = "/proc/cpuinfo",
+  .cpufreq_scaling_setspeed = "/sys/devices/system/cpu/cpu%ld/cpufreq/scaling_setspeed",
+  .cpufreq_policy_dir = "/sys/devices/system/cpu/cpufreq",
+  .cpufreq_affected_cpus = "/sys/devices/system/cpu/cpufreq/policy%ld/affected_cpus",
+  .ipstate_no_turbo = "/sys/devices/system/cpu/intel_pstate/no_turbo",
+  .ipstate_max_perf_pct = "/sys/devices/system/cpu/intel_pstate/max_perf_pct",
+  .ipstate_min_perf_pct = "/sys/devices/system/cpu/intel_pstate/min_perf_pct",
+  .ipstate_status = "/sys/devices/system/cpu/intel_pstate/status",
+  .msrsafe_whitelist_file = "/dev/cpu/msr_whitelist",
+  .msrsafe_batch_file = "/dev/cpu/msr_batch",
+  .msrsafe_cpu_file = "/dev/cpu/%ld/msr_safe",
+  .ipstate_dump = "/tmp/pm_ipstate_dump",
+  .cpufreq_dump = "/tmp/pm_cpufreq_dump",
+  .msrsafe_dump = "/tmp/msrsafe_dump",
+  .msrsafe_wl_cache = "/tmp/msrsafe_whitelist_cache",
+  .baseline_dir = "/var/lib/pm_msrsafe",
+  .baseline_msrsafe = "/var/lib/pm_msrsafe/msrsafe_baseline",
+  .baseline_cpufreq = "/var/lib/pm_msrsafe/cpufreq_baseline",
+  .baseline_ipstate = "/var/lib/pm_msrsafe/ipstate_baseline",
+  .started = "/tmp/pm_msrsafe_started",
+  .msrsafe_reference = "/tmp/msrsafe_reference",
+  .rapl_snapshot = "/tmp/pm_rapl_snapshot.%u",
+  .uncore_dump = "/tmp/pm_uncore_dump",
+  .baseline_uncore = "/var/lib/pm_msrsafe/uncore_baseline",
+  .hwp_dump = "/tmp/pm_hwp_dump",
+  .baseline_hwp = "/var/lib/pm_msrsafe/hwp_baseline",
+  .baseline_stamp = "/var/lib/pm_msrsafe/baseline_stamp",
+  .freq_table = "/tmp/pm_freq_table",
+  .boot_id = "/proc/sys/kernel/random/boot_id",
+  .cgroup_cpuset = "/sys/fs/cgroup/system.slice/slurmstepd.scope/job_%u/cpuset.cpus.effective",
+  .cgroup_v1_cpuset = "/sys/fs/cgroup/cpuset/slurm/uid_%u/job_%u/cpuset.cpus",
+  .job_cpuset = "/tmp/pm_msrsafe_cpuset.%u",
+  .job_msrsafe_dump = "/tmp/msrsafe_dump.%u",
+  .job_uncore_dump = "/tmp/pm_uncore_dump.%u",
+  .job_cpufreq_dump = "/tmp/pm_cpufreq_dump.%u",
+  .topology_cache = "/tmp/pm_topology_cache",
+};
+
+static int parse_long(const char *key, const char *value, long *dst)
+{
+  char *eptr;
+  long data = strtol(value, &eptr, 10);
+
+  if(eptr == value || *eptr != '\0' || data < 0){
+    slurm_info("Invalid value '%s' for the argument '%s'!\n", value, key);
+    return -1;
+  }
+  *dst = data;
+
+  return 0;
+}
+
+// Parse a comma-separated list of MSR addresses, e.g. '0x1a0,0x1b0'
+static int parse_msr_list(const char *key, const char *value, uint32_t *msrs, long max,
+  long *nmsrs)
+{
+  const char *ptr = value;
+  char *eptr;
+  long n = 0;
+
+  while(*ptr != '\0'){
+    if(n == max){
+      slurm_info("Too many registers in '%s' for the argument '%s', max %ld!\n", value, key, max);
+      return -1;
+    }
+    msrs[n] = strtoul(ptr, &eptr, 16);
+    if(eptr == ptr || (*eptr != ',' && *eptr != '\0')){
+      slurm_info("Invalid value '%s' for the argument '%s'!\n", value, key);
+      return -1;
+    }
+    n++;
+    ptr = *eptr == ',' ? eptr + 1 : eptr;
+  }
+  *nmsrs = n;
+
+  return 0;
+}
+
+// Parse the plugstack.conf arguments as 'key=value' pairs
+int parse_plugin_args(int argc, char **argv)
+{
+  char arg[BUFFER_SIZE];
+  char *key, *value;
+  int i, ret = 0;
+
+  for(i = 0; i < argc; i++){
+    strncpy(arg, argv[i], sizeof(arg) - 1);
+    arg[sizeof(arg) - 1] = '\0';
+
+    key = arg;
+    value = strchr(arg, '=');
+    if(value == NULL){
+      slurm_info("Invalid argument '%s', expected 'key=value'!\n", argv[i]);
+      ret = -1;
+      continue;
+    }
+    *value++ = '\0';
+
+    if(strcmp(key, "threads") == 0){
+      if(parse_long(key, value, &pm_conf.nthreads) < 0)
+        ret = -2;
+    }
+    else if(strcmp(key, "msr_fds") == 0){
+      if(parse_long(key, value, &pm_conf.msr_fds) < 0)
+        ret = -2;
+    }
+    else if(strcmp(key, "delta") == 0)
+      pm_conf.delta_restore = str_to_bool(value);
+    else if(strcmp(key, "scope") == 0)
+      pm_conf.msr_scope = str_to_bool(value);
+    else if(strcmp(key, "io_uring") == 0)
+      pm_conf.io_uring = str_to_bool(value);
+    else if(strcmp(key, "policy") == 0)
+      pm_conf.cpufreq_policy = str_to_bool(value);
+    else if(strcmp(key, "baseline") == 0)
+      pm_conf.baseline = str_to_bool(value);
+    else if(strcmp(key, "shared") == 0)
+      pm_conf.shared = str_to_bool(value);
+    else if(strcmp(key, "drift") == 0){
+      if(strcmp(value, "off") == 0)
+        pm_conf.drift = DRIFT_OFF;
+      else if(strcmp(value, "warn") == 0)
+        pm_conf.drift = DRIFT_WARN;
+      else if(strcmp(value, "drain") == 0)
+        pm_conf.drift = DRIFT_DRAIN;
+      else{
+        slurm_info("Invalid value '%s' for the argument '%s'!\n", value, key);
+        ret = -2;
+      }
+    }
+    else if(strcmp(key, "drift_ignore") == 0){
+      if(parse_msr_list(key, value, pm_conf.drift_ignore, DRIFT_MAX_IGNORE,
+         &pm_conf.ndrift_ignore) < 0)
+        ret = -2;
+    }
+    else if(strcmp(key, "root") == 0){
+      // The paths are used as format strings and must fit in the buffers
+      if(strchr(value, '%') != NULL || strlen(value) >= BUFFER_SIZE / 2){
+        slurm_info("Invalid value '%s' for the argument '%s'!\n", value, key);
+        ret = -2;
+        continue;
+      }
+      strcpy(pm_conf.root, value);
+    }
+    else if(strcmp(key, "report_dir") == 0){
+      strncpy(pm_conf.report_dir, value, sizeof(pm_conf.report_dir) - 1);
+      pm_conf.report_dir[sizeof(pm_conf.report_dir) - 1] = '\0';
+    }
+    else if(strcmp(key, "sampler_rate") == 0){
+      if(parse_long(key, value, &pm_conf.sampler_rate) < 0)
+        ret = -2;
+    }
+    else if(strcmp(key, "sampler_slots") == 0){
+      if(parse_long(key, value, &pm_conf.sampler_slots) < 0)
+        ret = -2;
+    }
+    else if(strcmp(key, "sampler_dir") == 0){
+      strncpy(pm_conf.sampler_dir, value, sizeof(pm_conf.sampler_dir) - 1);
+      pm_conf.sampler_dir[sizeof(pm_conf.sampler_dir) - 1] = '\0';
+    }
+    else if(strcmp(key, "energy_dir") == 0){
+      strncpy(pm_conf.energy_dir, value, sizeof(pm_conf.energy_dir) - 1);
+      pm_conf.energy_dir[sizeof(pm_conf.energy_dir) - 1] = '\0';
+    }
+    else{
+      slurm_info("Unknown argument '%s'!\n", key);
+      ret = -3;
+    }
+  }
+
+  if(init_paths() < 0)
+    ret = -4;
+
+  return ret;
+}
+
+static int prefix_path(char *path, const char *root)
+{
+  size_t root_len = strlen(root);
+  size_t path_len = strlen(path);
+
+  if(root_len + path_len >= BUFFER_SIZE){
+    slurm_info("The path '%s%s' is too long!\n", root, path);
+    return -1;
+  }
+  memmove(path + root_len, path, path_len + 1);
+  memcpy(path, root, root_len);
+
+  return 0;
+}
+
+// Prefix all the paths with the root directory
+static int prefix_paths(const char *root)
+{
+  int ret = 0;
+
+  ret |= prefix_path(pm_paths.driver, root);
+  ret |= prefix_path(pm_paths.governor, root);
+  ret |= prefix_path(pm_paths.scaling_max_freq, root);
+  ret |= prefix_path(pm_paths.scaling_min_freq, root);
+  ret |= prefix_path(pm_paths.cpuinfo_max_freq, root);
+  ret |= prefix_path(pm_paths.cpuinfo_min_freq, root);
+  ret |= prefix_path(pm_paths.cpu_online, root);
+  ret |= prefix_path(pm_paths.topology_package_id, root);
+  ret |= prefix_path(pm_paths.topology_core_id, root);
+  ret |= prefix_path(pm_paths.topology_die_id, root);
+  ret |= prefix_path(pm_paths.cpuinfo, root);
+  ret |= prefix_path(pm_paths.cpufreq_scaling_setspeed, root);
+  ret |= prefix_path(pm_paths.cpufreq_policy_dir, root);
+  ret |= prefix_path(pm_paths.cpufreq_affected_cpus, root);
+  ret |= prefix_path(pm_paths.ipstate_no_turbo, root);
+  ret |= prefix_path(pm_paths.ipstate_max_perf_pct, root);
+  ret |= prefix_path(pm_paths.ipstate_min_perf_pct, root);
+  ret |= prefix_path(pm_paths.ipstate_status, root);
+  ret |= prefix_path(pm_paths.msrsafe_whitelist_file, root);
+  ret |= prefix_path(pm_paths.msrsafe_batch_file, root);
+  ret |= prefix_path(pm_paths.msrsafe_cpu_file, root);
+  ret |= prefix_path(pm_paths.ipstate_dump, root);
+  ret |= prefix_path(pm_paths.cpufreq_dump, root);
+  ret |= prefix_path(pm_paths.msrsafe_dump, root);
+  ret |= prefix_path(pm_paths.msrsafe_wl_cache, root);
+  ret |= prefix_path(pm_paths.baseline_dir, root);
+  ret |= prefix_path(pm_paths.baseline_msrsafe, root);
+  ret |= prefix_path(pm_paths.baseline_cpufreq, root);
+  ret |= prefix_path(pm_paths.baseline_ipstate, root);
+  ret |= prefix_path(pm_paths.started, root);
+  ret |= prefix_path(pm_paths.msrsafe_reference, root);
+  ret |= prefix_path(pm_paths.rapl_snapshot, root);
+  ret |= prefix_path(pm_paths.uncore_dump, root);
+  ret |= prefix_path(pm_paths.baseline_uncore, root);
+  ret |= prefix_path(pm_paths.hwp_dump, root);
+  ret |= prefix_path(pm_paths.baseline_hwp, root);
+  ret |= prefix_path(pm_paths.baseline_stamp, root);
+  ret |= prefix_path(pm_paths.freq_table, root);
+  ret |= prefix_path(pm_paths.boot_id, root);
+  ret |= prefix_path(pm_paths.cgroup_cpuset, root);
+  ret |= prefix_path(pm_paths.cgroup_v1_cpuset, root);
+  ret |= prefix_path(pm_paths.job_cpuset, root);
+  ret |= prefix_path(pm_paths.job_msrsafe_dump, root);
+  ret |= prefix_path(pm_paths.job_uncore_dump, root);
+  ret |= prefix_path(pm_paths.job_cpufreq_dump, root);
+  ret |= prefix_path(pm_paths.topology_cache, root);
+
+  return ret;
+}
+
+// Prefix the default paths with the root directory and select the dump
+// files, applied once per process
+int init_paths()
+{
+  static int initialized = FALSE;
+  char root[BUFFER_SIZE];
+  size_t len;
+  int ret = 0;
+
+  if(initialized)
+    return 0;
+  initialized = TRUE;
+
+  // Strip the trailing slashes, the default paths are absolute
+  strcpy(root, pm_conf.root);
+  len = strlen(root);
+  while(len > 0 && root[len - 1] == '/')
+    root[--len] = '\0';
+
+  if(root[0] != '\0')
+    ret = prefix_paths(root);
+
+  // The baseline replaces the dumps of each job
+  if(pm_conf.baseline){
+    strcpy(pm_paths.msrsafe_dump, pm_paths.baseline_msrsafe);
+    strcpy(pm_paths.cpufreq_dump, pm_paths.baseline_cpufreq);
+    strcpy(pm_paths.ipstate_dump, pm_paths.baseline_ipstate);
+    strcpy(pm_paths.uncore_dump, pm_paths.baseline_uncore);
+    strcpy(pm_paths.hwp_dump, pm_paths.baseline_hwp);
+  }
+
+  return ret;
+}
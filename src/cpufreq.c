@@ -37,204 +37,247 @@ Author: Daniele Cesarini, University of Bologna
 int set_permissions_cpufreq(int conf)
 {
   char file[BUFFER_SIZE];
+  struct perm_list list;
+  struct node_state *st;
   int ret = 0;
 
-  long i, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
-  for(i = 0; i < ncpus; i++){
+  // The cpus of a policy share the same files
+  st = get_node_state(NODE_POLICY);
+  if(st == NULL)
+    return -3;
+
+  init_perm_list(&list);
+
+  long i;
+  for(i = 0; i < st->ncpus; i++){
+    if(!cpu_is_online(i) || !is_policy_leader(st, i))
+      continue;
+
     // Set read/write permission to the governor selection for each cpu
     sprintf(file, PM_GOVERNOR, i);
-    if(set_read_no_write_permission(file, conf) < 0){
-      slurm_info("Failed to configure permissions to file '%s'!\n", file);
-      ret = -1;
-    }
+    ret |= add_perm(&list, PERM_READ_NO_WRITE, file);
 
     // Set read/write permission to the scaling max frequency for each cpu
     sprintf(file, PM_SCALING_MAX_FREQ, i);
-    if(set_read_no_write_permission(file, conf) < 0){
-      slurm_info("Failed to configure permissions to file '%s'!\n", file);
-      ret = -2;
-    }
+    ret |= add_perm(&list, PERM_READ_NO_WRITE, file);
 
     // Set read/write permission to the scaling min frequency for each cpu
     sprintf(file, PM_SCALING_MIN_FREQ, i);
-    if(set_read_no_write_permission(file, conf) < 0){
-      slurm_info("Failed to configure permissions to file '%s'!\n", file);
-      ret = -3;
-    }
+    ret |= add_perm(&list, PERM_READ_NO_WRITE, file);
 
     // Set read/write permission to the scaling set speed for each cpu
     sprintf(file, PM_CPUFREQ_SCALING_SETSPEED, i);
-    if(set_read_no_write_permission(file, conf) < 0){
-      slurm_info("Failed to configure permissions to file '%s'!\n", file);
-      ret = -4;
-    }
+    ret |= add_perm(&list, PERM_READ_NO_WRITE, file);
   }
 
+  if(ret < 0){
+    slurm_info("Failed to allocate the list of cpufreq files!\n");
+    ret = -1;
+  }
+  else if(apply_permissions(&list, conf, "cpufreq") < 0)
+    ret = -2;
+
+  free_perm_list(&list);
+
   return ret;
 }
 
 int dump_cpufreq()
 {
-  char governor[BUFFER_SIZE], governor_file[BUFFER_SIZE];
-  char scaling_max_freq[BUFFER_SIZE], scaling_max_freq_file[BUFFER_SIZE];
-  char scaling_min_freq[BUFFER_SIZE], scaling_min_freq_file[BUFFER_SIZE];
-  char scaling_setspeed[BUFFER_SIZE], scaling_setspeed_file[BUFFER_SIZE];
-  unsigned long i, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
-  FILE *fd_dump;
+  struct node_state *st;
+  long i;
   int ret = 0;
 
-  // Open the dump files
-  fd_dump = fopen(PM_CPUFREQ_DUMP, "w");
-  if(fd_dump < 0){
-    slurm_info("Failed to open the cpufreq dump file '%s'!\n", PM_CPUFREQ_DUMP);
+  // Governor, scaling max/min and setspeed frequencies of all cpus
+  st = get_node_state(NODE_CPUFREQ);
+  if(st == NULL)
     return -1;
+
+  for(i = 0; i < st->ncpus; i++){
+    if(!cpu_is_online(i))
+      continue;
+    if(st->governor[i] == NODE_UNKNOWN || st->scaling_max_freq[i] == NODE_UNKNOWN ||
+       st->scaling_min_freq[i] == NODE_UNKNOWN){
+      slurm_info("Failed to read the cpufreq configuration of cpu '%ld'!\n", i);
+      ret = -2;
+    }
   }
 
-  // Print labels
-  if(fprintf(fd_dump, "# file # value\n") < 0){
-    slurm_info("Failed to write labels to the dump file '%s'!\n", PM_CPUFREQ_DUMP);
-    ret = -2;
+  // Dump cpufreq configuration to the dump file
+  if(write_node_state(PM_CPUFREQ_DUMP, st) < 0){
+    slurm_info("Failed to write the cpufreq configurations to file '%s'!\n",
+      PM_CPUFREQ_DUMP);
+    ret = -3;
   }
 
-  for(i = 0; i < ncpus; i++){
-    // Read the current governor for each cpu
-    sprintf(governor_file, PM_GOVERNOR, i);
-    if(read_str_from_file(governor_file, governor) < 0){
-      slurm_info("Failed to read the current governor of cpufreq from file '%s'!\n",
-        governor_file);
-      ret = -2;
-    }
+  return ret;
+}
 
-    // Read the scaling max frequency for each cpu
-    sprintf(scaling_max_freq_file, PM_SCALING_MAX_FREQ, i);
-    if(read_str_from_file(scaling_max_freq_file, scaling_max_freq) < 0){
-      slurm_info("Failed to read the max frequency of cpufreq from file '%s'!\n",
-        scaling_max_freq_file);
-      ret = -3;
-    }
+int restore_cpufreq()
+{
+  return restore_node_state(PM_CPUFREQ_DUMP, "cpufreq");
+}
 
-    // Read the scaling min frequency for each cpu
-    sprintf(scaling_min_freq_file, PM_SCALING_MIN_FREQ, i);
-    if(read_str_from_file(scaling_min_freq_file, scaling_min_freq) < 0){
-      slurm_info("Failed to read the min frequency of cpufreq from file '%s'!\n",
-        scaling_min_freq_file);
-      ret = -4;
-    }
+int change_governors()
+{
+  struct sysfs_batch batch;
+  struct node_state *st;
+  char file[BUFFER_SIZE];
+  long i;
+  int ret = 0;
 
-    // Read the scaling setspeed for each cpu
-    if(strncmp(governor, "userspace", strlen("userspace")) == 0){
-      sprintf(scaling_setspeed_file, PM_CPUFREQ_SCALING_SETSPEED, i);
-      if(read_str_from_file(scaling_setspeed_file, scaling_setspeed) < 0){
-        slurm_info("Failed to read the speed step of cpufreq from file '%s'!\n",
-          scaling_setspeed_file);
-        ret = -4;
-      }
+  st = get_node_state(NODE_CPUFREQ);
+  if(st == NULL)
+    return -1;
 
-      // Dump cpufreq configuration to the dump file for each cpu
-      if(fprintf(fd_dump, "%s %s\n%s %s\n%s %s\n%s %s\n",
-        governor_file, governor,
-        scaling_max_freq_file, scaling_max_freq,
-        scaling_min_freq_file, scaling_min_freq,
-        scaling_setspeed_file, scaling_setspeed) < 0){
-        slurm_info("Failed to write the cpufreq configurations to file '%s'!\n",
-          PM_CPUFREQ_DUMP);
-        ret = -5;
-      }
+  init_sysfs_batch(&batch);
+
+  for(i = 0; i < st->ncpus; i++){
+    if(!cpu_is_online(i) || !is_policy_leader(st, i))
+      continue;
+
+    // Set the default governor PM_DEFAULT_CPUFREQ_GOVERNOR (pm_spank.h)
+    sprintf(file, PM_GOVERNOR, i);
+    if(add_sysfs_req(&batch, SYSFS_WRITE, file, PM_CPUFREQ_DEFAULT_GOVERNOR) < 0){
+      slurm_info("Failed to allocate the cpufreq write requests!\n");
+      free_sysfs_batch(&batch);
+      return -1;
     }
-    else{
-      // Dump cpufreq configuration to the dump file for each cpu
-      if(fprintf(fd_dump, "%s %s\n%s %s\n%s %s\n",
-        governor_file, governor,
-        scaling_max_freq_file, scaling_max_freq,
-        scaling_min_freq_file, scaling_min_freq) < 0){
-        slurm_info("Failed to write the cpufreq file '%s'!\n", PM_CPUFREQ_DUMP);
-        ret = -6;
-      }
+  }
+
+  exec_sysfs_batch(&batch);
+  for(i = 0; i < batch.nreqs; i++){
+    if(batch.reqs[i].err != 0){
+      slurm_info("Failed to configure the '%s' governor of file '%s'!\n",
+        PM_CPUFREQ_DEFAULT_GOVERNOR, batch.reqs[i].path);
+      ret = -2;
     }
   }
 
-  // Close dump file
-  fclose(fd_dump);
+  // Keep the state in sync with the applied governors
+  for(i = 0; i < st->ncpus && ret == 0; i++)
+    if(cpu_is_online(i))
+      set_node_governor(st, i, PM_CPUFREQ_DEFAULT_GOVERNOR);
+
+  free_sysfs_batch(&batch);
 
   return ret;
 }
 
-int restore_cpufreq()
+// Pin the limits of the cpufreq policies of a shared job to the frequency of
+// their first cpu, 0 for the policies not pinned. The limits are dumped for
+// the epilog. The limit moving towards the frequency is written first, so
+// that scaling_min_freq never exceeds scaling_max_freq
+int pin_job_cpufreq(int32_t *freqs)
 {
-  FILE *fd_dump;
-  char file[BUFFER_SIZE], value[BUFFER_SIZE];
-  int ret = 0;
+  struct sysfs_batch first, second;
+  struct node_state *st;
+  char file[BUFFER_SIZE];
+  char str[SYSFS_VALUE_SIZE];
+  long i;
+  int raise, ret = 0;
 
-  // Open files
-  fd_dump = fopen(PM_CPUFREQ_DUMP, "r");
-  if(fd_dump == NULL){
-    slurm_info("Failed to open the cpufreq dump file '%s'!\n", PM_CPUFREQ_DUMP);
+  st = get_node_state(NODE_CPUFREQ);
+  if(st == NULL)
     return -1;
+
+  if(write_node_state(job_cpuset.cpufreq_dump, st) < 0)
+    return -2;
+
+  init_sysfs_batch(&first);
+  init_sysfs_batch(&second);
+
+  for(i = 0; i < st->ncpus; i++){
+    if(freqs[i] == 0 || !is_policy_leader(st, i))
+      continue;
+    sprintf(str, "%d", freqs[i]);
+    raise = st->scaling_max_freq[i] != NODE_UNKNOWN && freqs[i] > st->scaling_max_freq[i];
+    sprintf(file, PM_SCALING_MAX_FREQ, i);
+    ret |= add_sysfs_req(raise ? &first : &second, SYSFS_WRITE, file, str) < 0;
+    sprintf(file, PM_SCALING_MIN_FREQ, i);
+    ret |= add_sysfs_req(raise ? &second : &first, SYSFS_WRITE, file, str) < 0;
   }
 
-  // Restore cpufreq driver
-  if(fscanf(fd_dump, "# file # value\n") == EOF){
-    slurm_info("The restore file '%s' is empy!\n", PM_CPUFREQ_DUMP);
-    ret = -2;
+  if(ret != 0){
+    slurm_info("Failed to allocate the cpufreq write requests!\n");
+    ret = -3;
   }
-  while(fscanf(fd_dump, "%s %s\n", file, value) != EOF) {
-    if(write_str_to_file(file, value) < 0){
-      slurm_info("Failed to restore the cpufreq driver '%s' with value '%s'!\n",
-        PM_IPSTATE_DUMP, value);
-      ret = -3;
+  else{
+    exec_sysfs_batch(&first);
+    exec_sysfs_batch(&second);
+    for(i = 0; i < first.nreqs + second.nreqs; i++){
+      struct sysfs_req *req = i < first.nreqs ? &first.reqs[i] : &second.reqs[i - first.nreqs];
+
+      if(req->err != 0){
+        slurm_info("Failed to pin the cpufreq limit '%s' to '%s'!\n", req->path, req->value);
+        ret = -4;
+      }
     }
   }
 
-  // Close file
-  fclose(fd_dump);
+  free_sysfs_batch(&first);
+  free_sysfs_batch(&second);
 
   return ret;
 }
 
-int change_governors()
+// Restore the cpufreq policies pinned by a shared job
+int restore_job_cpufreq()
 {
-  char file[BUFFER_SIZE];
-  int ret = 0;
-
-  long i, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
-  for(i = 0; i < ncpus; i++){
-    // Set the default governor PM_DEFAULT_CPUFREQ_GOVERNOR (pm_spank.h)
-    sprintf(file, PM_GOVERNOR, i);
-    if(write_str_to_file(file, PM_CPUFREQ_DEFAULT_GOVERNOR) < 0){
-      slurm_info("Failed to configure the '%s' governor of file '%s'!\n",
-        PM_CPUFREQ_DEFAULT_GOVERNOR, file);
-      ret = -2;
-    }
-  }
+  if(access(job_cpuset.cpufreq_dump, F_OK) < 0)
+    return 0;
+  if(check_baseline_file(job_cpuset.cpufreq_dump) < 0)
+    return -1;
 
-  return ret;
+  return restore_node_state(job_cpuset.cpufreq_dump, "cpufreq");
 }
 
 int set_cpufreq(int conf)
 {
-  int ret = 0;
+  int phase, ret = 0;
 
+  if(conf == DUMP){
+    phase = phase_begin("dump_cpufreq");
+    if(dump_cpufreq() < 0){
+      slurm_info("Failed to dump the cpufreq configurations!\n");
+      ret = -2;
+    }
+    phase_end(phase);
+    return ret;
+  }
+
+  phase = phase_begin("set_permissions_cpufreq");
   if(set_permissions_cpufreq(conf) < 0){
     slurm_info("Failed to set permission to cpufreq driver!\n");
     ret = -1;
   }
+  phase_end(phase);
 
   if(conf == SET){
-    if(dump_cpufreq() < 0){
-      slurm_info("Failed to dump the cpufreq configurations!\n");
-      ret = -2;
+    // The baseline replaces the dump of each job
+    if(!baseline_enabled() || check_baseline_file(PM_CPUFREQ_DUMP) < 0){
+      phase = phase_begin("dump_cpufreq");
+      if(dump_cpufreq() < 0){
+        slurm_info("Failed to dump the cpufreq configurations!\n");
+        ret = -2;
+      }
+      phase_end(phase);
     }
 
+    phase = phase_begin("change_governors");
     if(change_governors() < 0){
       slurm_info("Failed to change the cpufreq governor!\n");
       ret = -3;
     }
+    phase_end(phase);
   }
   else if(conf == RESET){
+    phase = phase_begin("restore_cpufreq");
     if(restore_cpufreq() < 0){
       slurm_info("Failed to restore the cpufreq configurations!\n");
       ret = -4;
     }
+    phase_end(phase);
   }
 
   return ret;
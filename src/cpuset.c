@@ -0,0 +1,349 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+
+#include "pm_msrsafe.h"
+
+// Cpus of the job, see load_job_cpuset()
+struct job_cpuset job_cpuset = {
+  .shared = FALSE,
+};
+
+// Parse the comma-separated hexadecimal masks of SLURM_CPU_BIND_LIST,
+// e.g. '0x0F,0xF0', return the number of cpus
+static long parse_cpu_masks(const char *str, uint8_t *cpus, long ncpus)
+{
+  const char *begin, *end;
+  long cpu, count = 0;
+  int digit, bit;
+
+  while(*str != '\0'){
+    if(strncasecmp(str, "0x", 2) == 0)
+      str += 2;
+    begin = str;
+    for(end = begin; isxdigit(*end); end++);
+    if(end == begin || (*end != ',' && *end != '\0'))
+      return -1;
+
+    // The last digit holds the first 4 cpus
+    for(str = end - 1, cpu = 0; str >= begin; str--, cpu += 4){
+      digit = isdigit(*str) ? *str - '0' : tolower(*str) - 'a' + 10;
+      for(bit = 0; bit < 4; bit++){
+        if(!(digit & (1 << bit)))
+          continue;
+        if(cpu + bit >= ncpus)
+          return -2;
+        if(!cpus[cpu + bit])
+          count++;
+        cpus[cpu + bit] = TRUE;
+      }
+    }
+
+    str = *end == ',' ? end + 1 : end;
+  }
+
+  return count;
+}
+
+// Format the cpus as a list of ranges, e.g. '0-3,8-11'
+static int format_cpu_list(uint8_t *cpus, long ncpus, char *str, size_t size)
+{
+  long i, first;
+  size_t len = 0;
+  int n;
+
+  str[0] = '\0';
+  for(i = 0; i < ncpus; i++){
+    if(!cpus[i])
+      continue;
+    for(first = i; i + 1 < ncpus && cpus[i + 1]; i++);
+    if(first == i)
+      n = snprintf(str + len, size - len, "%s%ld", len > 0 ? "," : "", first);
+    else
+      n = snprintf(str + len, size - len, "%s%ld-%ld", len > 0 ? "," : "", first, i);
+    if(n < 0 || len + n >= size)
+      return -1;
+    len += n;
+  }
+
+  return 0;
+}
+
+// Read the cpus of the job from its cgroup (v2 or v1) or from the cpu binding
+// of slurm. The cgroup of the job exists at prolog only with
+// PrologFlags=Contain and the cgroup task plugin constraining the cores
+static long read_job_cpus(uint8_t *cpus, long ncpus)
+{
+  char file[BUFFER_SIZE], file_v1[BUFFER_SIZE];
+  char list[BUFFER_SIZE];
+  char *env_masks, *env_uid;
+
+  snprintf(file, sizeof(file), PM_CGROUP_CPUSET, job_cpuset.job_id);
+  if(access(file, R_OK) == 0 && read_str_from_file(file, list) == 1)
+    return parse_cpu_list(list, cpus, ncpus);
+
+  file_v1[0] = '\0';
+  env_uid = getenv("SLURM_JOB_UID");
+  if(env_uid != NULL){
+    snprintf(file_v1, sizeof(file_v1), PM_CGROUP_V1_CPUSET,
+      (unsigned int) strtoul(env_uid, NULL, 10), job_cpuset.job_id);
+    if(access(file_v1, R_OK) == 0 && read_str_from_file(file_v1, list) == 1)
+      return parse_cpu_list(list, cpus, ncpus);
+  }
+
+  env_masks = getenv("SLURM_CPU_BIND_LIST");
+  if(env_masks != NULL)
+    return parse_cpu_masks(env_masks, cpus, ncpus);
+
+  slurm_info("Neither the cgroup '%s', the cgroup '%s' nor the environment variable '$%s' "
+    "are available, check PrologFlags=Contain and the cgroup plugins of slurm!\n",
+    file, file_v1[0] != '\0' ? file_v1 : "v1", "SLURM_CPU_BIND_LIST");
+
+  return -1;
+}
+
+// Mark the scopes owned by each cpu of the job, a core or a package is owned
+// only if all its cpus belong to the job
+static int load_owned_scopes(uint8_t *cpus, long ncpus)
+{
+  struct cpu_topology *topo;
+  long i, k, ndomains, max_core = 0;
+  long *total, *owned;
+  long core, pkg;
+
+  job_cpuset.owned = calloc(ncpus, sizeof(uint8_t));
+  if(job_cpuset.owned == NULL)
+    return -1;
+
+  for(i = 0; i < ncpus; i++)
+    if(cpus[i])
+      job_cpuset.owned[i] = 1 << SCOPE_THREAD;
+
+  // Without topology only the registers of each thread are accessed
+  topo = get_topology();
+  if(topo == NULL){
+    slurm_info("Failed to read the cpu topology, the core and package registers are not accessed!\n");
+    return 0;
+  }
+
+  for(k = 0; k < topo->nonline; k++)
+    if(topo->core_id[topo->cpus[k]] > max_core)
+      max_core = topo->core_id[topo->cpus[k]];
+
+  // Cpus of each core followed by the cpus of each package
+  ndomains = topo->npkgs * (max_core + 1) + topo->npkgs;
+  total = calloc(ndomains, sizeof(long));
+  owned = calloc(ndomains, sizeof(long));
+  if(total == NULL || owned == NULL){
+    free(total);
+    free(owned);
+    return -1;
+  }
+
+  for(k = 0; k < topo->nonline; k++){
+    i = topo->cpus[k];
+    core = topo->pkg_id[i] * (max_core + 1) + topo->core_id[i];
+    pkg = topo->npkgs * (max_core + 1) + topo->pkg_id[i];
+    total[core]++;
+    total[pkg]++;
+    if(cpus[i]){
+      owned[core]++;
+      owned[pkg]++;
+    }
+  }
+
+  for(k = 0; k < topo->nonline; k++){
+    i = topo->cpus[k];
+    if(!cpus[i])
+      continue;
+    core = topo->pkg_id[i] * (max_core + 1) + topo->core_id[i];
+    pkg = topo->npkgs * (max_core + 1) + topo->pkg_id[i];
+    if(owned[core] == total[core])
+      job_cpuset.owned[i] |= 1 << SCOPE_CORE;
+    if(owned[pkg] == total[pkg]){
+      job_cpuset.owned[i] |= 1 << SCOPE_PACKAGE;
+      job_cpuset.npkgs += topology_is_leader(topo, i, SCOPE_PACKAGE);
+    }
+  }
+
+  free(total);
+  free(owned);
+
+  return 0;
+}
+
+// Save the cpus of the job for the epilog, the file is created by the slurm
+// daemon and checked at epilog like the dumps
+static int write_job_cpuset(uint8_t *cpus, long ncpus)
+{
+  char list[BUFFER_SIZE];
+
+  if(format_cpu_list(cpus, ncpus, list, sizeof(list)) < 0)
+    return -1;
+
+  if(write_file_atomic(job_cpuset.file, list, strlen(list)) < 0)
+    return -2;
+
+  return 0;
+}
+
+static long read_job_cpuset(uint8_t *cpus, long ncpus)
+{
+  char list[BUFFER_SIZE];
+  long len;
+  int fd;
+
+  fd = open_baseline_file(job_cpuset.file);
+  if(fd == -1 && errno == ENOENT)
+    return 0;
+  if(fd < 0){
+    slurm_info("The plugin will not restore the node using the cpuset file of the job!\n");
+    remove(job_cpuset.file);
+    return -1;
+  }
+  len = read_fd(fd, list, sizeof(list));
+  close(fd);
+  if(len <= 0)
+    return -2;
+
+  return parse_cpu_list(list, cpus, ncpus);
+}
+
+// Load the cpus of the job on a shared node: at prolog (SET) from the cgroup of
+// the job, at epilog (RESET) from the file saved by the prolog. The job is
+// shared if it does not own all the cpus of the node, then the plugin accesses
+// only its cpus and the dumps are saved in per-job files
+int load_job_cpuset(int conf)
+{
+  long i, n, ncpus = get_ncpus();
+  char *env_job_id;
+  uint8_t *cpus;
+
+  free_job_cpuset();
+
+  env_job_id = getenv("SLURM_JOB_ID");
+  if(env_job_id == NULL){
+    slurm_info("Failed to read the environment variable '$%s'!\n", "SLURM_JOB_ID");
+    return -1;
+  }
+  job_cpuset.job_id = strtoul(env_job_id, NULL, 10);
+  snprintf(job_cpuset.file, sizeof(job_cpuset.file), PM_JOB_CPUSET, job_cpuset.job_id);
+
+  cpus = calloc(ncpus, sizeof(uint8_t));
+  if(cpus == NULL)
+    return -2;
+
+  if(conf == SET)
+    n = read_job_cpus(cpus, ncpus);
+  else
+    n = read_job_cpuset(cpus, ncpus);
+
+  // The prolog did not save the cpus, the job has the whole node
+  if(conf == RESET && n == 0){
+    free(cpus);
+    return 0;
+  }
+
+  // Only the online cpus are accessed
+  for(i = 0; i < ncpus && n > 0; i++){
+    if(cpus[i] && !cpu_is_online(i)){
+      cpus[i] = FALSE;
+      n--;
+    }
+  }
+  if(n <= 0){
+    slurm_info("Failed to read the cpus of the job '%u'!\n", job_cpuset.job_id);
+    free(cpus);
+    return -3;
+  }
+  if(n == get_nonline()){
+    free(cpus);
+    return 0;
+  }
+
+  job_cpuset.ncpus = n;
+  job_cpuset.cpus = malloc(n * sizeof(uint32_t));
+  if(job_cpuset.cpus == NULL || load_owned_scopes(cpus, ncpus) < 0 ||
+     (conf == SET && write_job_cpuset(cpus, ncpus) < 0)){
+    slurm_info("Failed to save the cpus of the job '%u'!\n", job_cpuset.job_id);
+    free(cpus);
+    free_job_cpuset();
+    return -4;
+  }
+  for(i = 0, n = 0; i < ncpus; i++)
+    if(cpus[i])
+      job_cpuset.cpus[n++] = i;
+  free(cpus);
+  job_cpuset.shared = TRUE;
+
+  // The registers of the cpus of a shared job are dumped in files of the job,
+  // see MSRSAFE_DUMP and baseline_enabled()
+  snprintf(job_cpuset.msrsafe_dump, BUFFER_SIZE, MSRSAFE_JOB_DUMP, job_cpuset.job_id);
+  snprintf(job_cpuset.uncore_dump, BUFFER_SIZE, PM_UNCORE_JOB_DUMP, job_cpuset.job_id);
+  snprintf(job_cpuset.cpufreq_dump, BUFFER_SIZE, PM_CPUFREQ_JOB_DUMP, job_cpuset.job_id);
+
+  slurm_info("Shared node: %ld cpus and %ld packages of the job '%u'!\n",
+    job_cpuset.ncpus, job_cpuset.npkgs, job_cpuset.job_id);
+
+  return 0;
+}
+
+void free_job_cpuset()
+{
+  free(job_cpuset.cpus);
+  free(job_cpuset.owned);
+  memset(&job_cpuset, 0, sizeof(struct job_cpuset));
+}
+
+// Number of cpus accessed by the plugin, all the online cpus on exclusive nodes
+long job_ncpus()
+{
+  return job_cpuset.shared ? job_cpuset.ncpus : get_nonline();
+}
+
+// The i-th cpu accessed by the plugin
+long job_cpu(long i)
+{
+  return job_cpuset.shared ? job_cpuset.cpus[i] : get_online_cpu(i);
+}
+
+// Check if the job owns all the cpus of the scope of the cpu, the online
+// cpus on exclusive nodes
+int job_owns(long cpu, int scope)
+{
+  if(!job_cpuset.shared)
+    return cpu_is_online(cpu);
+
+  return (job_cpuset.owned[cpu] & (1 << scope)) != 0;
+}
@@ -0,0 +1,298 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+
+#include "pm_msrsafe.h"
+
+// Max number of lines of the drift report
+#define DRIFT_MAX_LINES 16
+
+// Reference of the drift check: the baseline or the dump restored by the
+// last epilog
+static const char *drift_reference()
+{
+  return pm_conf.baseline ? pm_paths.msrsafe_dump : MSRSAFE_REFERENCE;
+}
+
+// Registers rewritten by the kernel after the epilog, owned by the cpufreq
+// drivers (intel_pstate and acpi-cpufreq) and by the HWP of intel_pstate
+static const uint32_t drift_skipped[] = {
+  IA32_PERF_CTL,
+  IA32_HWP_REQUEST_PKG,
+  IA32_HWP_REQUEST,
+};
+
+static int drift_ignored(uint32_t msr)
+{
+  long i;
+
+  for(i = 0; i < sizeof(drift_skipped) / sizeof(drift_skipped[0]); i++)
+    if(drift_skipped[i] == msr)
+      return TRUE;
+  for(i = 0; i < pm_conf.ndrift_ignore; i++)
+    if(pm_conf.drift_ignore[i] == msr)
+      return TRUE;
+
+  return FALSE;
+}
+
+// On shared nodes only the registers of the cpus and of the domains owned by
+// the job are compared, the other ones are written by the other jobs
+static int drift_owned(const struct msr_dump_record *rec)
+{
+  if(!job_cpuset.shared)
+    return TRUE;
+
+  return rec->cpu < get_ncpus() && job_owns(rec->cpu, msr_scope(rec->msr));
+}
+
+// Print a register with the cpus that share the same drifted bits as
+// ranges (e.g. '0-15,32')
+static void print_drift(uint32_t msr, uint64_t bits, struct msr_dump_record **recs, long nrecs)
+{
+  char cpus[BUFFER_SIZE];
+  size_t len = 0;
+  long i, first;
+
+  for(i = 0; i < nrecs && len < sizeof(cpus); i = first){
+    first = i + 1;
+    while(first < nrecs && recs[first]->cpu == recs[first - 1]->cpu + 1)
+      first++;
+    if(first - 1 == i)
+      len += snprintf(cpus + len, sizeof(cpus) - len, "%s%u", len ? "," : "", recs[i]->cpu);
+    else
+      len += snprintf(cpus + len, sizeof(cpus) - len, "%s%u-%u", len ? "," : "",
+        recs[i]->cpu, recs[first - 1]->cpu);
+  }
+
+  slurm_info("MSR drift: register '0x%x' bits '0x%016" PRIx64 "' on cpus %s!\n",
+    msr, bits, cpus);
+}
+
+// Read all the registers of the reference, except the ignored ones, and
+// compare them under the write masks, return the number of drifted registers
+// or a negative value on error
+long check_msr_drift()
+{
+  struct msr_dump_record *rec, **recs;
+  struct msr_batch_op *ops;
+  struct msr_dump dump;
+  const char *reference = drift_reference();
+  uint64_t *bits, group_bits, pattern;
+  long i, j, k, nrecords, nrecs, nops = 0, ndrifts = 0, npairs = 0, nlines = 0;
+  long *index;
+  int lock;
+
+  // The epilogs of the shared jobs refresh the reference under the lock
+  lock = open(reference, O_RDONLY | O_NOFOLLOW);
+  if(lock < 0 && errno == ENOENT){
+#ifdef SLURM_SPANK_DEBUG
+    slurm_info("The drift reference '%s' does not exist!\n", reference);
+#endif // SLURM_SPANK_DEBUG
+    return 0;
+  }
+  if(lock < 0 || flock(lock, LOCK_SH) < 0 ||
+     check_baseline_file(reference) < 0 || map_msr_dump(reference, &dump) < 0){
+    slurm_info("Failed to read the drift reference '%s'!\n", reference);
+    if(lock >= 0)
+      close(lock);
+    return -1;
+  }
+  nrecords = dump.header->nrecords;
+
+  ops = malloc(nrecords * sizeof(struct msr_batch_op));
+  bits = malloc(nrecords * sizeof(uint64_t));
+  recs = malloc(nrecords * sizeof(struct msr_dump_record *));
+  index = malloc(nrecords * sizeof(long));
+  if(ops == NULL || bits == NULL || recs == NULL || index == NULL){
+    slurm_info("Failed to allocate the MSR batch operations!\n");
+    free(ops);
+    free(bits);
+    free(recs);
+    free(index);
+    unmap_msr_dump(&dump);
+    close(lock);
+    return -2;
+  }
+
+  // Bulk read of all the registers in the reference
+  for(i = 0; i < nrecords; i++){
+    bits[i] = 0;
+    if(drift_ignored(dump.records[i].msr) || !drift_owned(&dump.records[i]))
+      continue;
+    index[nops] = i;
+    ops[nops].cpu = dump.records[i].cpu;
+    ops[nops].isrdmsr = TRUE;
+    ops[nops].err = 0;
+    ops[nops].msr = dump.records[i].msr;
+    ops[nops].msrdata = 0;
+    ops[nops].wmask = 0;
+    nops++;
+  }
+  exec_msr_batch(ops, nops);
+
+  // Only the writable bits can drift
+  for(k = 0; k < nops; k++){
+    i = index[k];
+    rec = &dump.records[i];
+    bits[i] = ops[k].err == 0 ? (ops[k].msrdata ^ rec->value) & rec->mask : 0;
+    if(bits[i] != 0)
+      npairs++;
+  }
+
+  // The records are in register x cpu order, report each register with the
+  // cpus grouped by drifted bits
+  for(i = 0; i < nrecords; i = j){
+    for(j = i; j < nrecords && dump.records[j].msr == dump.records[i].msr; j++);
+
+    group_bits = 0;
+    for(k = i; k < j; k++)
+      group_bits |= bits[k];
+    if(group_bits == 0)
+      continue;
+    ndrifts++;
+
+    // One line for each distinct pattern of drifted bits
+    while(group_bits != 0){
+      pattern = 0;
+      nrecs = 0;
+      for(k = i; k < j; k++){
+        if(bits[k] == 0)
+          continue;
+        if(nrecs == 0)
+          pattern = bits[k];
+        if(bits[k] == pattern){
+          recs[nrecs++] = &dump.records[k];
+          bits[k] = 0;
+        }
+      }
+      if(nlines++ < DRIFT_MAX_LINES)
+        print_drift(dump.records[i].msr, pattern, recs, nrecs);
+      group_bits = 0;
+      for(k = i; k < j; k++)
+        group_bits |= bits[k];
+    }
+  }
+
+  if(ndrifts > 0){
+    if(nlines > DRIFT_MAX_LINES)
+      slurm_info("MSR drift: %ld more lines not shown!\n", nlines - DRIFT_MAX_LINES);
+    slurm_info("MSR drift: %ld registers differ from the reference '%s' (%ld register/cpu pairs)!\n",
+      ndrifts, reference, npairs);
+  }
+
+  free(ops);
+  free(bits);
+  free(recs);
+  free(index);
+  unmap_msr_dump(&dump);
+  close(lock);
+
+  return ndrifts;
+}
+
+// Copy the registers restored by the epilog of a shared job in the reference
+// of the drift check, the other records are kept. The records of both dumps
+// are in register x cpu order
+int refresh_drift_reference(const char *file)
+{
+  struct msr_dump reference, job_dump;
+  struct msr_dump_record *records;
+  struct msr_dump_header header;
+  long i, j, k, nrecords, nupdates = 0;
+  int fd, ret = 0;
+
+  // The baseline is never changed
+  if(pm_conf.baseline || access(MSRSAFE_REFERENCE, F_OK) < 0)
+    return 0;
+
+  fd = open(MSRSAFE_REFERENCE, O_RDWR | O_NOFOLLOW);
+  if(fd < 0 || flock(fd, LOCK_EX) < 0 || check_baseline_file(MSRSAFE_REFERENCE) < 0 ||
+     map_msr_dump(MSRSAFE_REFERENCE, &reference) < 0){
+    slurm_info("Failed to read the drift reference '%s'!\n", MSRSAFE_REFERENCE);
+    if(fd >= 0)
+      close(fd);
+    return -1;
+  }
+  if(map_msr_dump(file, &job_dump) < 0){
+    unmap_msr_dump(&reference);
+    close(fd);
+    return -2;
+  }
+
+  nrecords = reference.header->nrecords;
+  records = malloc(nrecords * sizeof(struct msr_dump_record));
+  if(records == NULL){
+    unmap_msr_dump(&job_dump);
+    unmap_msr_dump(&reference);
+    close(fd);
+    return -3;
+  }
+  memcpy(records, reference.records, nrecords * sizeof(struct msr_dump_record));
+  header = *reference.header;
+
+  // The search of each record of the job starts after the last match
+  for(i = 0, j = 0; i < job_dump.header->nrecords && nrecords > 0; i++){
+    for(k = 0; k < nrecords; k++, j = (j + 1) % nrecords)
+      if(records[j].msr == job_dump.records[i].msr && records[j].cpu == job_dump.records[i].cpu)
+        break;
+    if(k == nrecords)
+      continue;
+    records[j].value = job_dump.records[i].value;
+    records[j].mask = job_dump.records[i].mask;
+    nupdates++;
+  }
+
+  // The records are rewritten in place, the prologs read the reference under
+  // the lock
+  if(nupdates > 0){
+    header.checksum = hash_fnv1a(records, nrecords * sizeof(struct msr_dump_record));
+    if(pwrite(fd, records, nrecords * sizeof(struct msr_dump_record), sizeof(header)) !=
+       nrecords * sizeof(struct msr_dump_record) ||
+       pwrite(fd, &header, sizeof(header), 0) != sizeof(header)){
+      slurm_info("Failed to write the drift reference '%s'!\n", MSRSAFE_REFERENCE);
+      ret = -4;
+    }
+  }
+#ifdef SLURM_SPANK_DEBUG
+  slurm_info("Refreshed %ld records of the drift reference '%s'!\n", nupdates, MSRSAFE_REFERENCE);
+#endif // SLURM_SPANK_DEBUG
+
+  free(records);
+  unmap_msr_dump(&job_dump);
+  unmap_msr_dump(&reference);
+  close(fd);
+
+  return ret;
+}
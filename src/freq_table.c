@@ -0,0 +1,190 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+
+#include "pm_msrsafe.h"
+
+// Table of the node, loaded once per process
+static struct freq_table freq_table;
+static int freq_table_loaded = FALSE;
+
+static uint64_t hash_freq_table(struct freq_table *ft)
+{
+  return hash_fnv1a(ft, offsetof(struct freq_table, checksum));
+}
+
+// Decode the ratios of the node from the registers of the first online cpu
+static int decode_freq_table(struct freq_table *ft)
+{
+  uint64_t platform, turbo, turbo1;
+  uint8_t bytes[2 * FREQ_MAX_BINS];
+  long cpu = get_online_cpu(0);
+  int i, has_turbo1, cores = TRUE;
+
+  if(read_msr_file(cpu, MSR_PLATFORM_INFO, &platform) < 0){
+    slurm_info("Failed to read MSR_PLATFORM_INFO!\n");
+    return -1;
+  }
+
+  ft->bus_khz = FREQ_BUS_KHZ;
+  ft->base_ratio = (platform >> 8) & 0xff;
+  ft->efficiency_ratio = (platform >> 40) & 0xff;
+  ft->min_ratio = (platform >> 48) & 0xff;
+  // The minimum operating ratio is not reported by all the processors
+  if(ft->min_ratio == 0)
+    ft->min_ratio = ft->efficiency_ratio;
+
+  // Without turbo the max ratio is the base one
+  ft->nbins = 0;
+  if(read_msr_file(cpu, MSR_TURBO_RATIO_LIMIT, &turbo) < 0)
+    return 0;
+  has_turbo1 = read_msr_file(cpu, MSR_TURBO_RATIO_LIMIT1, &turbo1) == 0;
+
+  memset(bytes, 0, sizeof(bytes));
+  memcpy(bytes, &turbo, sizeof(uint64_t));
+  if(has_turbo1)
+    memcpy(bytes + sizeof(uint64_t), &turbo1, sizeof(uint64_t));
+
+  // Since Skylake-SP MSR_TURBO_RATIO_LIMIT1 holds the increasing number of
+  // active cores of each bin, before it holds the ratios of 9-16 active cores
+  if(has_turbo1){
+    for(i = 0; i < 8; i++)
+      if(bytes[8 + i] == 0 || (i > 0 && bytes[8 + i] <= bytes[8 + i - 1]))
+        cores = FALSE;
+  }
+  else
+    cores = FALSE;
+
+  for(i = 0; i < (cores ? 8 : FREQ_MAX_BINS) && bytes[i] != 0; i++){
+    ft->turbo_ratio[i] = bytes[i];
+    ft->turbo_cores[i] = cores ? bytes[8 + i] : i + 1;
+    ft->nbins++;
+  }
+
+  return 0;
+}
+
+// Write the table in binary format, readable by the jobs
+static int write_freq_table(struct freq_table *ft)
+{
+  if(write_file_atomic(PM_FREQ_TABLE, ft, sizeof(struct freq_table)) < 0){
+    slurm_info("Failed to write the frequency table '%s'!\n", PM_FREQ_TABLE);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int load_freq_table(struct freq_table *ft, const char *boot_id)
+{
+  int fd, ret = 0;
+
+  fd = open_baseline_file(PM_FREQ_TABLE);
+  if(fd < 0)
+    return -1;
+
+  if(read(fd, ft, sizeof(struct freq_table)) != sizeof(struct freq_table) ||
+     ft->magic != FREQ_TABLE_MAGIC || ft->version != FREQ_TABLE_VERSION ||
+     ft->checksum != hash_freq_table(ft))
+    ret = -2;
+  // Built in a previous boot, e.g. before a BIOS update
+  else if(boot_id[0] == '\0' || strcmp(ft->boot_id, boot_id) != 0)
+    ret = -3;
+  close(fd);
+
+  return ret;
+}
+
+// Return the frequency table of the node, built from the registers and
+// cached in PM_FREQ_TABLE once per boot if build is set, NULL if not available
+struct freq_table *get_freq_table(int build)
+{
+  struct freq_table *ft = &freq_table;
+  char boot_id[BOOT_ID_SIZE];
+
+  if(freq_table_loaded)
+    return ft;
+
+  read_boot_id(boot_id);
+  if(load_freq_table(ft, boot_id) == 0){
+    freq_table_loaded = TRUE;
+    return ft;
+  }
+  if(!build)
+    return NULL;
+
+  memset(ft, 0, sizeof(struct freq_table));
+  if(decode_freq_table(ft) < 0)
+    return NULL;
+  ft->magic = FREQ_TABLE_MAGIC;
+  ft->version = FREQ_TABLE_VERSION;
+  memcpy(ft->boot_id, boot_id, BOOT_ID_SIZE);
+  ft->checksum = hash_freq_table(ft);
+  freq_table_loaded = TRUE;
+
+  write_freq_table(ft);
+
+  return ft;
+}
+
+// Highest ratio of the node, with a single active core
+int freq_max_ratio(struct freq_table *ft)
+{
+  return ft->nbins > 0 ? ft->turbo_ratio[0] : ft->base_ratio;
+}
+
+// Nearest ratio of a frequency in kHz
+int freq_to_ratio(struct freq_table *ft, long khz)
+{
+  long bus_khz = ft != NULL ? ft->bus_khz : FREQ_BUS_KHZ;
+
+  return (khz + bus_khz / 2) / bus_khz;
+}
+
+// Format the table for the jobs, e.g. 'bus=100000 min=800000 efficiency=1000000
+// base=2100000 turbo=2:3700000,4:3600000' (active cores:kHz), frequencies in kHz
+int format_freq_table(struct freq_table *ft, char *str, size_t size)
+{
+  size_t len;
+  int i;
+
+  len = snprintf(str, size, "bus=%u min=%u efficiency=%u base=%u turbo=", ft->bus_khz,
+    ft->min_ratio * ft->bus_khz, ft->efficiency_ratio * ft->bus_khz,
+    ft->base_ratio * ft->bus_khz);
+  for(i = 0; i < ft->nbins && len < size; i++)
+    len += snprintf(str + len, size - len, "%s%u:%u", i > 0 ? "," : "", ft->turbo_cores[i],
+      ft->turbo_ratio[i] * ft->bus_khz);
+
+  return len < size ? 0 : -1;
+}
@@ -0,0 +1,171 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+
+#include "pm_msrsafe.h"
+
+// Check if the hardware P-states are enabled, IA32_PM_ENABLE is package
+// scoped and enabled on all the packages by intel_pstate. Without access to
+// the register, intel_pstate enables them on the processors with the 'hwp'
+// flag unless it is off
+int hwp_enabled()
+{
+  static int enabled = -1;
+  char status[BUFFER_SIZE];
+  uint64_t value;
+
+  if(enabled >= 0)
+    return enabled;
+
+  if(read_msr_file(get_online_cpu(0), IA32_PM_ENABLE, &value) == 0){
+    enabled = value & 0x1;
+    return enabled;
+  }
+
+  if(read_str_from_file(PM_IPSTATE_STATUS, status) == 1){
+    enabled = get_cpu_model()->hwp && strcmp(status, "off") != 0;
+    slurm_info("Failed to read IA32_PM_ENABLE, HWP is %s according to '%s' and the processor flags!\n",
+      enabled ? "enabled" : "disabled", PM_IPSTATE_STATUS);
+  }
+  else{
+    enabled = FALSE;
+    slurm_info("Failed to detect the hardware P-states, HWP is assumed disabled!\n");
+  }
+
+  return enabled;
+}
+
+// Read a register of each online cpu with one batch
+static struct msr_batch_op *read_hwp(uint32_t msr, long ncpus)
+{
+  struct msr_batch_op *ops;
+  long i;
+
+  ops = calloc(ncpus, sizeof(struct msr_batch_op));
+  if(ops == NULL)
+    return NULL;
+  for(i = 0; i < ncpus; i++){
+    ops[i].cpu = get_online_cpu(i);
+    ops[i].isrdmsr = TRUE;
+    ops[i].msr = msr;
+  }
+  exec_msr_batch(ops, ncpus);
+
+  return ops;
+}
+
+static int dump_hwp()
+{
+  struct msr_batch_op *ops;
+  long ncpus = get_nonline();
+  int ret;
+
+  ops = read_hwp(IA32_HWP_REQUEST, ncpus);
+  if(ops == NULL){
+    slurm_info("Failed to allocate the MSR batch operations!\n");
+    return -1;
+  }
+  ret = dump_msr_ops(PM_HWP_DUMP, ops, ncpus, HWP_REQUEST_MASK, 1);
+  free(ops);
+
+  return ret;
+}
+
+// Pin the minimum, maximum and desired performance of each cpu to its
+// highest performance level and the energy/performance preference to
+// performance, intel_pstate is not involved
+int hack_hwp()
+{
+  struct msr_batch_op *ops;
+  long i, nops = 0, ncpus = get_nonline();
+  uint64_t highest;
+  int ret = 0;
+
+  ops = read_hwp(IA32_HWP_CAPABILITIES, ncpus);
+  if(ops == NULL){
+    slurm_info("Failed to allocate the MSR batch operations!\n");
+    return -1;
+  }
+
+  for(i = 0; i < ncpus; i++){
+    if(ops[i].err != 0){
+      slurm_info("Failed to read the HWP capabilities of cpu '%u'!\n", ops[i].cpu);
+      ret = -2;
+      continue;
+    }
+    highest = ops[i].msrdata & 0xff;
+    ops[nops].cpu = ops[i].cpu;
+    ops[nops].isrdmsr = FALSE;
+    ops[nops].msr = IA32_HWP_REQUEST;
+    ops[nops].msrdata = highest | (highest << 8) | (highest << 16) | (HWP_EPP_PERFORMANCE << 24);
+    nops++;
+  }
+
+  if(exec_msr_batch(ops, nops) > 0){
+    for(i = 0; i < nops; i++){
+      if(ops[i].err != 0){
+        slurm_info("Failed to set the HWP request of cpu '%u'!\n", ops[i].cpu);
+        ret = -3;
+      }
+    }
+  }
+
+  free(ops);
+
+  return ret;
+}
+
+int set_hwp(int conf)
+{
+  int phase, ret = 0;
+
+  if(conf == SET || conf == DUMP){
+    phase = phase_begin("dump_hwp");
+    if(dump_hwp() < 0){
+      slurm_info("Failed to dump the HWP requests!\n");
+      ret = -1;
+    }
+    phase_end(phase);
+  }
+  else if(conf == RESET){
+    phase = phase_begin("restore_hwp");
+    if(restore_msr_dump(PM_HWP_DUMP) < 0){
+      slurm_info("Failed to restore the HWP requests!\n");
+      ret = -2;
+    }
+    phase_end(phase);
+  }
+
+  return ret;
+}
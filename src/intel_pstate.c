@@ -37,264 +37,263 @@ Author: Daniele Cesarini, University of Bologna
 static int set_permissions_ipstate(int conf)
 {
   char file[BUFFER_SIZE];
+  struct perm_list list;
+  struct node_state *st;
   int ret = 0;
 
-  long i, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
-  for(i = 0; i < ncpus; i++){
+  // The cpus of a policy share the same files
+  st = get_node_state(NODE_POLICY);
+  if(st == NULL)
+    return -3;
+
+  init_perm_list(&list);
+
+  long i;
+  for(i = 0; i < st->ncpus; i++){
+    if(!cpu_is_online(i) || !is_policy_leader(st, i))
+      continue;
+
     // Set read/write permission to the governor selection for each cpu
     sprintf(file, PM_GOVERNOR, i);
-    if(set_read_no_write_permission(file, conf) < 0){
-      slurm_info("Failed to configure permissions to file '%s'!\n", file);
-      ret = -1;
-    }
+    ret |= add_perm(&list, PERM_READ_NO_WRITE, file);
 
     // Set read/write permission to the scaling max frequency for each cpu
     sprintf(file, PM_SCALING_MAX_FREQ, i);
-    if(set_read_no_write_permission(file, conf) < 0){
-      slurm_info("Failed to configure permissions to file '%s'!\n", file);
-      ret = -2;
-    }
+    ret |= add_perm(&list, PERM_READ_NO_WRITE, file);
 
     // Set read/write permission to the scaling min frequency for each cpu
     sprintf(file, PM_SCALING_MIN_FREQ, i);
-    if(set_read_no_write_permission(file, conf) < 0){
-      slurm_info("Failed to configure permissions to file '%s'!\n", file);
-      ret = -3;
-    }
+    ret |= add_perm(&list, PERM_READ_NO_WRITE, file);
   }
 
   // Set read permission to Intel P-state no_turbo file
-  if(set_read_no_write_permission(PM_IPSTATE_NO_TURBO, conf) < 0){
-    slurm_info("Failed to configure permissions to file '%s'!\n",
-      PM_IPSTATE_NO_TURBO);
-    ret = -4;
-  }
+  ret |= add_perm(&list, PERM_READ_NO_WRITE, PM_IPSTATE_NO_TURBO);
 
   // Set read/write permission to Intel P-state max performance file
-  if(set_read_no_write_permission(PM_IPSTATE_MAX_PERF_PCT, conf) < 0){
-    slurm_info("Failed to configure permissions to file '%s'!\n",
-      PM_IPSTATE_MAX_PERF_PCT);
-    ret = -5;
-  }
+  ret |= add_perm(&list, PERM_READ_NO_WRITE, PM_IPSTATE_MAX_PERF_PCT);
 
   // Set read/write permission to Intel P-state min performance file
-  if(set_read_no_write_permission(PM_IPSTATE_MIN_PERF_PCT, conf) < 0){
-    slurm_info("Failed to configure permissions to file '%s'!\n",
-      PM_IPSTATE_MIN_PERF_PCT);
-    ret = -6;
+  ret |= add_perm(&list, PERM_READ_NO_WRITE, PM_IPSTATE_MIN_PERF_PCT);
+
+  if(ret < 0){
+    slurm_info("Failed to allocate the list of intel_pstate files!\n");
+    ret = -1;
   }
+  else if(apply_permissions(&list, conf, "intel_pstate") < 0)
+    ret = -2;
+
+  free_perm_list(&list);
 
   return ret;
 }
 
 static int dump_ipstate()
 {
-  char governor[BUFFER_SIZE], governor_file[BUFFER_SIZE];
-  char scaling_max_freq[BUFFER_SIZE], scaling_max_freq_file[BUFFER_SIZE];
-  char scaling_min_freq[BUFFER_SIZE], scaling_min_freq_file[BUFFER_SIZE];
-  char no_turbo[BUFFER_SIZE];
-  char max_perf_pct[BUFFER_SIZE], min_perf_pct[BUFFER_SIZE];
-  unsigned long i, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
-  FILE *fd_dump;
+  struct node_state *st;
+  long i;
   int ret = 0;
 
-  // Open the dump files
-  fd_dump = fopen(PM_IPSTATE_DUMP, "w");
-  if(fd_dump < 0){
-    slurm_info("Failed to open the intel_pstate dump file '%s'!\n", PM_IPSTATE_DUMP);
+  // Governor, frequencies of all cpus and common intel_pstate configuration
+  st = get_node_state(NODE_CPUFREQ | NODE_CPUINFO | NODE_IPSTATE);
+  if(st == NULL)
     return -1;
-  }
 
-  // Print labels
-  if(fprintf(fd_dump, "# file # value\n") < 0){
-    slurm_info("Failed to write labels to file '%s'!\n", PM_IPSTATE_DUMP);
-    fclose(fd_dump);
-    return -2;
-  }
-
-  for(i = 0; i < ncpus; i++){
-    // Read the current governor for each cpu
-    sprintf(governor_file, PM_GOVERNOR, i);
-    if(read_str_from_file(governor_file, governor) < 0){
-      slurm_info("Failed to read the current governor of intel_pstate from file '%s'!\n",
-        governor_file);
+  for(i = 0; i < st->ncpus; i++){
+    if(!cpu_is_online(i))
+      continue;
+    if(st->governor[i] == NODE_UNKNOWN || st->scaling_max_freq[i] == NODE_UNKNOWN ||
+       st->scaling_min_freq[i] == NODE_UNKNOWN){
+      slurm_info("Failed to read the intel_pstate configuration of cpu '%ld'!\n", i);
       ret = -2;
     }
-
-    // Read the scaling max frequency for each cpu
-    sprintf(scaling_max_freq_file, PM_SCALING_MAX_FREQ, i);
-    if(read_str_from_file(scaling_max_freq_file, scaling_max_freq) < 0){
-      slurm_info("Failed to read the max frequency of intel_pstate from file '%s'!\n",
-        scaling_max_freq_file);
-      ret = -3;
-    }
-
-    // Read the scaling min frequency for each cpu
-    sprintf(scaling_min_freq_file, PM_SCALING_MIN_FREQ, i);
-    if(read_str_from_file(scaling_min_freq_file, scaling_min_freq) < 0){
-      slurm_info("Failed to read the min frequency of intel_pstate from file '%s'!\n",
-        scaling_min_freq_file);
-      ret = -4;
-    }
-
-    // Dump intel_pstate configuration to the dump file for each cpu
-    if(fprintf(fd_dump, "%s %s\n%s %s\n%s %s\n",
-      governor_file, governor,
-      scaling_max_freq_file, scaling_max_freq,
-      scaling_min_freq_file, scaling_min_freq) < 0){
-      slurm_info("Failed to write the cpufreq configurations to file '%s'!\n",
-        PM_IPSTATE_DUMP);
-      ret = -5;
-    }
   }
-
-  // Read the 'no turbo' configuration
-  if(read_str_from_file(PM_IPSTATE_NO_TURBO, no_turbo) < 0){
-    slurm_info("Failed to read the turbo configuration of intel_pstate from file '%s'!\n",
-      PM_IPSTATE_NO_TURBO);
-    ret = -6;
+  if(st->no_turbo == NODE_UNKNOWN || st->max_perf_pct == NODE_UNKNOWN ||
+     st->min_perf_pct == NODE_UNKNOWN){
+    slurm_info("Failed to read the general intel_pstate configurations!\n");
+    ret = -3;
   }
 
-  // Read the max_perf_pct
-  if(read_str_from_file(PM_IPSTATE_MAX_PERF_PCT, max_perf_pct) < 0){
-    slurm_info("Failed to read the maximum performance configuration"
-      " of intel_pstate from file '%s'!\n", PM_IPSTATE_MAX_PERF_PCT);
-    ret = -7;
-  }
-
-  // Read the min_perf_pct
-  if(read_str_from_file(PM_IPSTATE_MIN_PERF_PCT, min_perf_pct) < 0){
-    slurm_info("Failed to read the the minimum performance configuration"
-      " of intel_pstate from file '%s'!\n", PM_IPSTATE_MIN_PERF_PCT);
-    ret = -8;
-  }
-
-  // Dump common intel_pstate configuration
-  if(fprintf(fd_dump, "%s %s\n%s %s\n%s %s\n",
-    PM_IPSTATE_NO_TURBO, no_turbo,
-    PM_IPSTATE_MAX_PERF_PCT, max_perf_pct,
-    PM_IPSTATE_MIN_PERF_PCT, min_perf_pct) < 0){
-    slurm_info("Failed to write the general intel_pstate configurations to file '%s'!\n",
+  // Dump intel_pstate configuration to the dump file
+  if(write_node_state(PM_IPSTATE_DUMP, st) < 0){
+    slurm_info("Failed to write the intel_pstate configurations to file '%s'!\n",
       PM_IPSTATE_DUMP);
-    ret = -9;
+    ret = -4;
   }
 
-  // Close dump file
-  fclose(fd_dump);
-
   return ret;
 }
 
 static int restore_ipstate()
 {
-  FILE *fd_dump;
-  char file[BUFFER_SIZE], value[BUFFER_SIZE];
-  int ret = 0;
-
-  // Open files
-  fd_dump = fopen(PM_IPSTATE_DUMP, "r");
-  if(fd_dump == NULL){
-    slurm_info("Failed to open the intel_pstate dump file '%s'!\n", PM_IPSTATE_DUMP);
-    return -1;
-  }
-
-  // Restore intel_pstate driver
-  if(fscanf(fd_dump, "# file # value\n") == EOF){
-    ret = -2;
-    slurm_info("The restore file '%s' is empy!\n", PM_IPSTATE_DUMP);
-  }
-  while(fscanf(fd_dump, "%s %s\n", file, value) != EOF) {
-    if(write_str_to_file(file, value) < 0){
-      ret = -3;
-      slurm_info("Failed to restore the intel_pstate driver '%s' with value '%s'!\n",
-        PM_IPSTATE_DUMP, value);
-    }
-  }
-
-  // Close file
-  fclose(fd_dump);
-
-  return ret;
+  return restore_node_state(PM_IPSTATE_DUMP, "intel_pstate");
 }
 
 static int hack_ipstate()
 {
+  struct sysfs_batch batch;
+  struct node_state *st;
   char file[BUFFER_SIZE];
-  char data[BUFFER_SIZE];
+  char data[SYSFS_VALUE_SIZE];
+  struct freq_table *ft;
+  struct msr_batch_op *ops;
+  long i, nops = 0;
   int ret = 0;
 
+  st = get_node_state(NODE_CPUFREQ | NODE_CPUINFO | NODE_IPSTATE);
+  if(st == NULL)
+    return -7;
+
+  ops = malloc(st->ncpus * sizeof(struct msr_batch_op));
+  if(ops == NULL){
+    slurm_info("Failed to allocate the MSR batch operations!\n");
+    return -6;
+  }
+
+  ft = get_freq_table(TRUE);
+
   // Disable no_turbo logic of Intel P-state driver
-  if(write_str_to_file(PM_IPSTATE_NO_TURBO, "1") < 0){
-    slurm_info("Failed to hack the intel_pstate turbo logic to the file '%s'!\n",
-      PM_IPSTATE_NO_TURBO);
+  init_sysfs_batch(&batch);
+  if(add_sysfs_req(&batch, SYSFS_WRITE, PM_IPSTATE_NO_TURBO, "1") < 0)
     ret = -1;
-  }
 
-  long i, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
-  for(i = 0; i < ncpus; i++){
-    // Read the minimum frequency for each cpu
-    sprintf(file, PM_CPUINFO_MIN_FREQ, i);
-    if(read_str_from_file(file, data) < 0){
-      slurm_info("Failed to read the minimum frequency of cpu '%ld' to file '%s'!\n",
-        i, file);
-      ret = -2;
-    }
+  for(i = 0; i < st->ncpus; i++){
+    if(!cpu_is_online(i))
+      continue;
 
-    // Set the minimum frequency for each cpu
-    sprintf(file, PM_SCALING_MAX_FREQ, i);
-    if(write_str_to_file(file, data) < 0){
-      slurm_info("Failed to apply the minimum frequency of cpu '%ld' to file '%s'!\n",
-        i, file);
-      ret = -3;
+    // Set the minimum frequency for each cpufreq policy
+    if(is_policy_leader(st, i)){
+      if(st->cpuinfo_min_freq[i] == NODE_UNKNOWN){
+        slurm_info("Failed to read the minimum frequency of cpu '%ld'!\n", i);
+        ret = -2;
+      }
+      else{
+        sprintf(file, PM_SCALING_MAX_FREQ, i);
+        sprintf(data, "%d", st->cpuinfo_min_freq[i]);
+        if(add_sysfs_req(&batch, SYSFS_WRITE, file, data) < 0)
+          ret = -3;
+      }
     }
 
-    // Read the maximum frequency for each cpu
-    sprintf(file, PM_CPUINFO_MAX_FREQ, i);
-    if(read_str_from_file(file, data) < 0){
+    // Set the maximum frequency of each cpu through IA32_PERF_CTL, the
+    // highest turbo ratio of the node if known
+    if(ft != NULL){
+      ops[nops].cpu = i;
+      ops[nops].isrdmsr = FALSE;
+      ops[nops].msr = IA32_PERF_CTL;
+      ops[nops].msrdata = freq_max_ratio(ft) << 8;
+      nops++;
+    }
+    else if(st->cpuinfo_max_freq[i] == NODE_UNKNOWN){
       slurm_info("Failed to read the maximum frequency of cpu '%ld'!\n", i);
       ret = -4;
     }
     else{
-      char *eptr;
-      long freq = strtol(data, &eptr, 10);
-      int pstate = (int) (freq / 100000);
-      uint64_t reg = pstate << 8;
-      if(write_msr_file(i, IA32_PERF_CTL, reg) < 0){
-        slurm_info("Failed to set maximum frequency '%ld' of cpu '%ld'!\n", freq, i);
+      int pstate = freq_to_ratio(NULL, st->cpuinfo_max_freq[i]);
+      ops[nops].cpu = i;
+      ops[nops].isrdmsr = FALSE;
+      ops[nops].msr = IA32_PERF_CTL;
+      ops[nops].msrdata = pstate << 8;
+      nops++;
+    }
+  }
+
+  exec_sysfs_batch(&batch);
+  for(i = 0; i < batch.nreqs; i++){
+    if(batch.reqs[i].err != 0){
+      slurm_info("Failed to hack the intel_pstate configuration of the file '%s'!\n",
+        batch.reqs[i].path);
+      ret = -3;
+    }
+  }
+  free_sysfs_batch(&batch);
+
+  // Keep the state in sync with the applied configuration
+  st->no_turbo = 1;
+  for(i = 0; i < st->ncpus; i++)
+    st->scaling_max_freq[i] = st->cpuinfo_min_freq[i];
+
+  // Set the maximum frequency of all cpus
+  if(exec_msr_batch(ops, nops) > 0){
+    for(i = 0; i < nops; i++){
+      if(ops[i].err != 0){
+        slurm_info("Failed to set maximum ratio '%lu' of cpu '%u'!\n",
+          ops[i].msrdata >> 8, ops[i].cpu);
         ret = -5;
       }
     }
   }
 
+  free(ops);
+
   return ret;
 }
 
 int set_ipstate(int conf)
 {
-  int ret = 0;
+  int phase, ret = 0;
 
+  if(conf == DUMP){
+    phase = phase_begin("dump_ipstate");
+    if(dump_ipstate() < 0){
+      slurm_info("Failed to dump the intel_pstate driver configurations!\n");
+      ret = -2;
+    }
+    phase_end(phase);
+    if(hwp_enabled() && set_hwp(conf) < 0)
+      ret = -5;
+    return ret;
+  }
+
+  phase = phase_begin("set_permissions_ipstate");
   if(set_permissions_ipstate(conf) < 0){
     slurm_info("Failed to set permissions to intel_pstate driver!\n");
     ret = -1;
   }
+  phase_end(phase);
 
   if(conf == SET){
-    if(dump_ipstate() < 0){
-      slurm_info("Failed to dump the intel_pstate driver configurations!\n");
-      ret = -2;
+    // The baseline replaces the dump of each job
+    if(!baseline_enabled() || check_baseline_file(PM_IPSTATE_DUMP) < 0){
+      phase = phase_begin("dump_ipstate");
+      if(dump_ipstate() < 0){
+        slurm_info("Failed to dump the intel_pstate driver configurations!\n");
+        ret = -2;
+      }
+      phase_end(phase);
+      if(hwp_enabled() && set_hwp(conf) < 0)
+        ret = -5;
     }
 
-    // Hack intel_pstate to allow frequency variation
-    if(hack_ipstate() < 0){
-      slurm_info("Failed to hack intel_pstate driver!\n");
-      ret = -3;
+    // The hardware ignores IA32_PERF_CTL when HWP is enabled
+    if(hwp_enabled()){
+      phase = phase_begin("hack_hwp");
+      if(hack_hwp() < 0){
+        slurm_info("Failed to set the HWP requests!\n");
+        ret = -3;
+      }
+      phase_end(phase);
+    }
+    else{
+      // Hack intel_pstate to allow frequency variation
+      phase = phase_begin("hack_ipstate");
+      if(hack_ipstate() < 0){
+        slurm_info("Failed to hack intel_pstate driver!\n");
+        ret = -3;
+      }
+      phase_end(phase);
     }
   }
   else if(conf == RESET){
+    phase = phase_begin("restore_ipstate");
     if(restore_ipstate() < 0){
       slurm_info("Failed to restore the intel_pstate driver configurations!\n");
       ret = -4;
     }
+    phase_end(phase);
+
+    // After intel_pstate, which updates the HWP requests with its limits
+    if(set_hwp(conf) < 0)
+      ret = -5;
   }
 
   return ret;
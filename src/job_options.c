@@ -0,0 +1,363 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+
+#include "pm_msrsafe.h"
+
+static int check_cpu_freq_option(int val, const char *optarg, int remote);
+static int check_uncore_freq_option(int val, const char *optarg, int remote);
+
+// Options of the job, e.g. 'srun --cpu-freq-pm=0-15:2000000 ...'
+static struct spank_option pm_options[] = {
+  { "cpu-freq-pm", "cpulist:kHz[,...]",
+    "Core frequency of the listed cpus of each node set at prolog through "
+    "IA32_PERF_CTL, or IA32_HWP_REQUEST when HWP is enabled, only the cpufreq "
+    "policies owned by the job on shared nodes "
+    "(e.g. 0-15:2000000,16-31:1200000 or all:2000000)",
+    1, 0, check_cpu_freq_option },
+  { "uncore-freq-pm", "[min_kHz:]max_kHz",
+    "Uncore frequency range of all the packages of each node set at prolog, "
+    "only the packages owned by the job on shared nodes "
+    "(e.g. 1200000:2400000, or 2000000 to pin it)",
+    1, 1, check_uncore_freq_option },
+  SPANK_OPTIONS_TABLE_END
+};
+
+#define OPTION_CPU_FREQ 0
+#define OPTION_UNCORE_FREQ 1
+
+// Parse '<cpulist>:<kHz>[,<cpulist>:<kHz>...]' in the frequency of each cpu,
+// 0 for the cpus not listed. 'all' are the cpus of the job on shared nodes
+static int parse_cpu_freq(const char *str, int32_t *freqs, long ncpus)
+{
+  char buf[BUFFER_SIZE], *ptr, *colon, *eptr;
+  uint8_t *cpus;
+  long i, khz;
+  int ret = 0;
+
+  if(strlen(str) >= sizeof(buf))
+    return -1;
+  strcpy(buf, str);
+
+  cpus = malloc(ncpus);
+  if(cpus == NULL)
+    return -3;
+  memset(freqs, 0, ncpus * sizeof(int32_t));
+
+  for(ptr = buf; *ptr != '\0' && ret == 0; ptr = eptr){
+    colon = strchr(ptr, ':');
+    if(colon == NULL){
+      ret = -1;
+      break;
+    }
+    *colon = '\0';
+    khz = strtol(colon + 1, &eptr, 10);
+    if(eptr == colon + 1 || khz <= 0 || khz > INT32_MAX || (*eptr != ',' && *eptr != '\0')){
+      ret = -1;
+      break;
+    }
+    if(*eptr == ',')
+      eptr++;
+
+    memset(cpus, FALSE, ncpus);
+    if(strcmp(ptr, "all") == 0){
+      for(i = 0; i < ncpus; i++)
+        cpus[i] = job_owns(i, SCOPE_THREAD);
+    }
+    else if(parse_cpu_list(ptr, cpus, ncpus) <= 0)
+      ret = -2;
+    for(i = 0; i < ncpus; i++)
+      if(cpus[i])
+        freqs[i] = khz;
+  }
+
+  free(cpus);
+
+  return ret;
+}
+
+// Check the syntax of the option when the job is submitted
+static int check_cpu_freq_option(int val, const char *optarg, int remote)
+{
+  int32_t *freqs;
+  int ret;
+
+  if(optarg == NULL)
+    return -1;
+
+  freqs = malloc(JOB_MAX_CPUS * sizeof(int32_t));
+  if(freqs == NULL)
+    return -1;
+  ret = parse_cpu_freq(optarg, freqs, JOB_MAX_CPUS);
+  free(freqs);
+
+  if(ret < 0){
+    slurm_error("Invalid value '%s' of --cpu-freq-pm, expected cpulist:kHz[,...]!", optarg);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Parse '[min_kHz:]max_kHz', a single value pins the frequency
+static int parse_uncore_freq(const char *str, long *min_khz, long *max_khz)
+{
+  char *eptr;
+
+  *max_khz = *min_khz = strtol(str, &eptr, 10);
+  if(eptr == str)
+    return -1;
+  if(*eptr == ':'){
+    str = eptr + 1;
+    *max_khz = strtol(str, &eptr, 10);
+    if(eptr == str)
+      return -1;
+  }
+
+  return (*eptr == '\0' && *min_khz > 0 && *min_khz <= *max_khz) ? 0 : -1;
+}
+
+static int check_uncore_freq_option(int val, const char *optarg, int remote)
+{
+  long min_khz, max_khz;
+
+  if(optarg == NULL || parse_uncore_freq(optarg, &min_khz, &max_khz) < 0){
+    slurm_error("Invalid value '%s' of --uncore-freq-pm, expected [min_kHz:]max_kHz!",
+      optarg != NULL ? optarg : "");
+    return -1;
+  }
+
+  return 0;
+}
+
+int register_job_options(spank_t spank_ctx)
+{
+  struct spank_option *opt;
+  int ret = 0;
+
+  for(opt = pm_options; opt->name != NULL; opt++){
+    if(spank_option_register(spank_ctx, opt) != ESPANK_SUCCESS){
+      slurm_info("Failed to register the option '--%s'!\n", opt->name);
+      ret = -1;
+    }
+  }
+
+  return ret;
+}
+
+// Value of an option of the job, NULL if not set. The test executable reads
+// it from the environment, e.g. SPANK_CPU_FREQ_PM for --cpu-freq-pm
+static char *get_job_option(spank_t spank_ctx, struct spank_option *opt)
+{
+#ifdef SLURM_SPANK_TEST
+  char env[BUFFER_SIZE];
+  long i;
+
+  snprintf(env, sizeof(env), "SPANK_%s", opt->name);
+  for(i = 0; env[i] != '\0'; i++)
+    env[i] = env[i] == '-' ? '_' : toupper(env[i]);
+
+  return getenv(env);
+#else
+  char *optarg = NULL;
+
+  if(spank_option_getopt(spank_ctx, opt, &optarg) != ESPANK_SUCCESS)
+    return NULL;
+
+  return optarg;
+#endif // SLURM_SPANK_TEST
+}
+
+// Write the ratio of the requested frequency in IA32_PERF_CTL of the listed
+// cpus with one batch. The hardware ignores IA32_PERF_CTL when HWP is enabled,
+// then the minimum, maximum and desired performance of IA32_HWP_REQUEST are
+// pinned to the ratio with the performance preference. The power manager of a
+// shared node is not configured, the cpufreq governor would overwrite the
+// ratios: the scaling limits of the policies of the job are pinned to the
+// frequency, the policies shared with other jobs are refused
+static int set_cpu_freq(const char *str)
+{
+  struct freq_table *ft;
+  struct node_state *st = NULL, *pst = NULL;
+  struct msr_batch_op *ops;
+  int32_t *freqs, *pins = NULL;
+  long i, leader, nops = 0, nout = 0, nforeign = 0, nunpinned = 0, min_khz, max_khz;
+  long ncpus = get_ncpus();
+  int hwp = hwp_enabled(), ret = 0;
+  uint64_t ratio;
+
+  // The range of each cpu only without the ratios of the processor
+  ft = get_freq_table(TRUE);
+  if(ft == NULL){
+    st = get_node_state(NODE_CPUINFO);
+    if(st == NULL)
+      return -1;
+  }
+
+  if(job_cpuset.shared){
+    pst = get_node_state(NODE_CPUFREQ);
+    pins = calloc(ncpus, sizeof(int32_t));
+    if(pst == NULL || pins == NULL){
+      slurm_info("Failed to read the cpufreq policies of the node!\n");
+      free(pins);
+      return -1;
+    }
+  }
+
+  freqs = malloc(ncpus * sizeof(int32_t));
+  ops = malloc(ncpus * sizeof(struct msr_batch_op));
+  if(freqs == NULL || ops == NULL){
+    slurm_info("Failed to allocate the MSR batch operations!\n");
+    free(freqs);
+    free(ops);
+    free(pins);
+    return -2;
+  }
+
+  if(parse_cpu_freq(str, freqs, ncpus) < 0){
+    slurm_info("Invalid value '%s' of --cpu-freq-pm for the %ld cpus of the node!\n",
+      str, ncpus);
+    free(freqs);
+    free(ops);
+    free(pins);
+    return -3;
+  }
+
+  for(i = 0; i < ncpus; i++){
+    if(freqs[i] == 0)
+      continue;
+    // Only the cpus of the job on shared nodes
+    if(!job_owns(i, SCOPE_THREAD)){
+      if(nforeign++ == 0)
+        slurm_info("The cpu '%ld' does not belong to the job!\n", i);
+      ret = -6;
+      continue;
+    }
+    // Only the frequencies supported by the node, from the ratios of the
+    // processor if known
+    min_khz = ft != NULL ? ft->min_ratio * ft->bus_khz : st->cpuinfo_min_freq[i];
+    max_khz = ft != NULL ? freq_max_ratio(ft) * ft->bus_khz : st->cpuinfo_max_freq[i];
+    if((min_khz != NODE_UNKNOWN && freqs[i] < min_khz) ||
+       (max_khz != NODE_UNKNOWN && freqs[i] > max_khz)){
+      if(nout++ == 0)
+        slurm_info("The frequency '%d' is out of the range of cpu '%ld'!\n", freqs[i], i);
+      ret = -4;
+      continue;
+    }
+    // The whole policy of the cpu is pinned to the same frequency
+    if(pst != NULL){
+      leader = pst->policy[i] == NODE_UNKNOWN ? i : pst->policy[i];
+      if(!job_owns_policy(pst, i) || freqs[leader] != freqs[i]){
+        if(nunpinned++ == 0)
+          slurm_info("The cpufreq policy of cpu '%ld' is shared with other jobs or cpus "
+            "with a different frequency, the frequency cannot be pinned!\n", i);
+        ret = -7;
+        continue;
+      }
+      pins[leader] = freqs[i];
+    }
+    ratio = freq_to_ratio(ft, freqs[i]);
+    ops[nops].cpu = i;
+    ops[nops].isrdmsr = FALSE;
+    if(hwp){
+      ops[nops].msr = IA32_HWP_REQUEST;
+      ops[nops].msrdata = ratio | (ratio << 8) | (ratio << 16) | (HWP_EPP_PERFORMANCE << 24);
+    }
+    else{
+      ops[nops].msr = IA32_PERF_CTL;
+      ops[nops].msrdata = ratio << 8;
+    }
+    nops++;
+  }
+
+  if(nout > 1)
+    slurm_info("The frequency of %ld cpus is out of range, they are not set!\n", nout);
+  if(nforeign > 1)
+    slurm_info("%ld cpus do not belong to the job, they are not set!\n", nforeign);
+  if(nunpinned > 1)
+    slurm_info("The frequency of %ld cpus cannot be pinned, they are not set!\n", nunpinned);
+
+  // The limits first, the governor would overwrite the ratios
+  if(pins != NULL && nops > 0 && pin_job_cpufreq(pins) < 0)
+    ret = -8;
+
+  if(exec_msr_batch(ops, nops) > 0){
+    for(i = 0; i < nops; i++){
+      if(ops[i].err != 0){
+        slurm_info("Failed to set the ratio '%lu' of cpu '%u'!\n",
+          hwp ? ops[i].msrdata & 0xff : ops[i].msrdata >> 8, ops[i].cpu);
+        ret = -5;
+      }
+    }
+  }
+
+  free(freqs);
+  free(ops);
+  free(pins);
+
+  return ret;
+}
+
+// Apply the options of the job at prolog, after the power manager and the
+// dump of the registers
+int apply_job_options(spank_t spank_ctx)
+{
+  char *value;
+  int phase, ret = 0;
+
+  value = get_job_option(spank_ctx, &pm_options[OPTION_CPU_FREQ]);
+  if(value != NULL){
+    phase = phase_begin("set_cpu_freq");
+    if(set_cpu_freq(value) < 0){
+      slurm_info("Failed to set the frequency of the cpus requested by the job!\n");
+      ret = -1;
+    }
+    phase_end(phase);
+  }
+
+  value = get_job_option(spank_ctx, &pm_options[OPTION_UNCORE_FREQ]);
+  if(value != NULL){
+    long min_khz, max_khz;
+
+    phase = phase_begin("set_uncore_freq");
+    if(parse_uncore_freq(value, &min_khz, &max_khz) < 0 ||
+       set_uncore_freq(min_khz, max_khz) < 0){
+      slurm_info("Failed to set the uncore frequency requested by the job!\n");
+      ret = -2;
+    }
+    phase_end(phase);
+  }
+
+  return ret;
+}
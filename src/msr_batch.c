@@ -0,0 +1,241 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+#include "pm_msrsafe.h"
+
+// Execute the operations one by one through the per-cpu MSR_SAFE files. The
+// operations are visited grouped by cpu, keeping their order for each cpu, so
+// that each file is acquired once even when the cpus exceed the open files
+static void exec_msr_serial(struct msr_batch_op *ops, long nops)
+{
+  long i, j, cpu, max_cpu = 0, *offset, *index;
+  int fd;
+
+  for(i = 0; i < nops; i++)
+    if(ops[i].cpu > max_cpu)
+      max_cpu = ops[i].cpu;
+
+  offset = calloc(max_cpu + 2, sizeof(long));
+  index = malloc(nops * sizeof(long));
+  if(offset == NULL || index == NULL){
+    free(offset);
+    free(index);
+    for(i = 0; i < nops; i++)
+      ops[i].err = -ENOMEM;
+    return;
+  }
+
+  for(i = 0; i < nops; i++)
+    offset[ops[i].cpu + 1]++;
+  for(cpu = 0; cpu <= max_cpu; cpu++)
+    offset[cpu + 1] += offset[cpu];
+  for(i = 0; i < nops; i++)
+    index[offset[ops[i].cpu]++] = i;
+  // offset[cpu] is now the end of the operations of cpu
+  for(cpu = max_cpu; cpu > 0; cpu--)
+    offset[cpu] = offset[cpu - 1];
+  offset[0] = 0;
+
+  for(cpu = 0; cpu <= max_cpu; cpu++){
+    if(offset[cpu] == offset[cpu + 1])
+      continue;
+
+    fd = get_msr_fd(cpu);
+    for(i = offset[cpu]; i < offset[cpu + 1]; i++){
+      j = index[i];
+      if(fd < 0){
+        ops[j].err = fd;
+        continue;
+      }
+
+      STAT_ADD(nsyscalls, 1);
+      if(ops[j].isrdmsr){
+        if(read_msr(fd, cpu, ops[j].msr, &ops[j].msrdata) < 0)
+          ops[j].err = -EIO;
+      }
+      else{
+        if(write_msr(fd, cpu, ops[j].msr, ops[j].msrdata) < 0)
+          ops[j].err = -EIO;
+      }
+    }
+    if(fd >= 0)
+      put_msr_fd(cpu);
+  }
+
+  free(offset);
+  free(index);
+}
+
+// Submit the operations to the batch device in chunks, return the number of
+// operations executed by the driver
+static long submit_msr_batch(int fd, struct msr_batch_op *ops, long nops)
+{
+  struct msr_batch_array batch;
+  long i, done = 0;
+
+  while(done < nops){
+    batch.ops = &ops[done];
+    batch.numops = (nops - done) < MSRSAFE_BATCH_MAX_OPS ?
+      (nops - done) : MSRSAFE_BATCH_MAX_OPS;
+
+    STAT_ADD(nsyscalls, 1);
+    if(ioctl(fd, X86_IOC_MSR_BATCH, &batch) < 0){
+      // EIO is returned when some rdmsr/wrmsr faulted: the whole chunk has been
+      // executed and the failed operations are marked in the err field.
+      // Any other error aborts the chunk before the execution.
+      if(errno != EIO){
+#ifdef SLURM_SPANK_DEBUG
+        slurm_info("Failed to submit %u operations to '%s'!\n",
+          batch.numops, MSRSAFE_BATCH_FILE);
+#endif // SLURM_SPANK_DEBUG
+        for(i = 0; i < batch.numops; i++)
+          batch.ops[i].err = 0;
+        break;
+      }
+    }
+    done += batch.numops;
+  }
+
+  return done;
+}
+
+// Execute the MSR operations with the pinned workers if the parallel mode is
+// enabled, otherwise through the batch device of MSR_SAFE falling back to the
+// per-cpu files if the batch device is not usable. The result of each
+// operation is reported in its err field, return the number of failed operations
+long exec_msr_batch(struct msr_batch_op *ops, long nops)
+{
+  long i, done = 0, nerr = 0;
+  int fd = -1;
+
+  for(i = 0; i < nops; i++)
+    ops[i].err = 0;
+  STAT_ADD(nmsr_ops, nops);
+
+  if(pm_conf.nthreads > 1 && nops > 0 &&
+     exec_msr_parallel(ops, nops, pm_conf.nthreads) == 0)
+    done = nops;
+  else
+    fd = get_msr_batch_fd();
+  if(fd >= 0)
+    done = submit_msr_batch(fd, ops, nops);
+
+  if(done < nops)
+    exec_msr_serial(&ops[done], nops - done);
+
+  for(i = 0; i < nops; i++)
+    if(ops[i].err != 0)
+      nerr++;
+
+  return nerr;
+}
+
+// Group the operations by cpu keeping their order for each cpu
+int group_msr_batch_by_cpu(struct msr_batch_op *ops, long nops)
+{
+  struct msr_batch_op *sorted;
+  long i, max_cpu = 0, *offset;
+
+  for(i = 0; i < nops; i++)
+    if(ops[i].cpu > max_cpu)
+      max_cpu = ops[i].cpu;
+
+  sorted = malloc(nops * sizeof(struct msr_batch_op));
+  offset = calloc(max_cpu + 2, sizeof(long));
+  if(sorted == NULL || offset == NULL){
+    free(sorted);
+    free(offset);
+    return -1;
+  }
+
+  // Counting sort
+  for(i = 0; i < nops; i++)
+    offset[ops[i].cpu + 1]++;
+  for(i = 1; i <= max_cpu + 1; i++)
+    offset[i] += offset[i - 1];
+  for(i = 0; i < nops; i++)
+    sorted[offset[ops[i].cpu]++] = ops[i];
+
+  memcpy(ops, sorted, nops * sizeof(struct msr_batch_op));
+  free(sorted);
+  free(offset);
+
+  return 0;
+}
+
+// Merge the bits to write into the current value of the registers and drop the
+// write operations that would not change them, return the number of remaining
+// operations. The write mask of each operation is stored in wmask, nfailed
+// counts the registers that cannot be read.
+long merge_msr_batch(struct msr_batch_op *ops, long nops, long *nfailed)
+{
+  struct msr_batch_op *current;
+  uint64_t value;
+  long i, n = 0;
+
+  *nfailed = 0;
+  current = malloc(nops * sizeof(struct msr_batch_op));
+  if(current == NULL)
+    return -1;
+
+  // Read the current values
+  memcpy(current, ops, nops * sizeof(struct msr_batch_op));
+  for(i = 0; i < nops; i++)
+    current[i].isrdmsr = TRUE;
+  exec_msr_batch(current, nops);
+
+  for(i = 0; i < nops; i++){
+    if(current[i].err != 0){
+      // Without the current value only whole registers can be written
+      if(ops[i].wmask != ~0UL){
+        slurm_info("Failed to read on cpu %u the MSR address 0x%x!\n",
+          ops[i].cpu, ops[i].msr);
+        (*nfailed)++;
+        continue;
+      }
+      ops[n++] = ops[i];
+      continue;
+    }
+    value = (current[i].msrdata & ~ops[i].wmask) | (ops[i].msrdata & ops[i].wmask);
+    if(value != current[i].msrdata){
+      ops[n] = ops[i];
+      ops[n].msrdata = value;
+      n++;
+    }
+  }
+
+  free(current);
+
+  return n;
+}
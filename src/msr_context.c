@@ -0,0 +1,225 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+
+#include "pm_msrsafe.h"
+
+// Descriptors of the MSR_SAFE files of each cpu, opened when first needed and
+// kept open until the end of the prolog/epilog. At most budget descriptors
+// are open, the least recently used one not in use is closed to open a new one
+static struct msr_fd *msr_fds = NULL;
+static long msr_ncpus = 0;
+static long msr_nopen = 0;
+static long msr_budget = 0;
+static int32_t lru_head = -1;           // Most recently used
+static int32_t lru_tail = -1;           // Next to be closed
+static int batch_fd = -1;
+static int batch_err = 0;               // Negative errno if the batch device cannot be opened
+static pthread_mutex_t msr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lru_remove(long cpu)
+{
+  struct msr_fd *e = &msr_fds[cpu];
+
+  if(e->prev >= 0)
+    msr_fds[e->prev].next = e->next;
+  else
+    lru_head = e->next;
+  if(e->next >= 0)
+    msr_fds[e->next].prev = e->prev;
+  else
+    lru_tail = e->prev;
+  e->prev = e->next = -1;
+}
+
+static void lru_push(long cpu)
+{
+  struct msr_fd *e = &msr_fds[cpu];
+
+  e->prev = -1;
+  e->next = lru_head;
+  if(lru_head >= 0)
+    msr_fds[lru_head].prev = cpu;
+  else
+    lru_tail = cpu;
+  lru_head = cpu;
+}
+
+static int alloc_msr_fds()
+{
+  struct rlimit limit;
+  long i;
+
+  msr_ncpus = get_ncpus();
+  msr_fds = malloc(msr_ncpus * sizeof(struct msr_fd));
+  if(msr_fds == NULL)
+    return -1;
+  for(i = 0; i < msr_ncpus; i++){
+    msr_fds[i].fd = -1;
+    msr_fds[i].refs = 0;
+    msr_fds[i].prev = msr_fds[i].next = -1;
+  }
+
+  // Leave half of the descriptors of the process to the rest of the plugin
+  msr_budget = pm_conf.msr_fds;
+  if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+     msr_budget > limit.rlim_cur / 2)
+    msr_budget = limit.rlim_cur / 2;
+  if(msr_budget < 1)
+    msr_budget = 1;
+
+  return 0;
+}
+
+// Get the descriptor of the MSR_SAFE file of a cpu, it is not closed until
+// put_msr_fd(), return a negative errno on failure
+int get_msr_fd(long cpu)
+{
+  char file[BUFFER_SIZE];
+  long evict;
+  int fd;
+
+  pthread_mutex_lock(&msr_lock);
+
+  if(msr_fds == NULL && alloc_msr_fds() < 0){
+    pthread_mutex_unlock(&msr_lock);
+    return -ENOMEM;
+  }
+  if(cpu < 0 || cpu >= msr_ncpus){
+    pthread_mutex_unlock(&msr_lock);
+    return -ENXIO;
+  }
+
+  if(msr_fds[cpu].fd >= 0){
+    if(msr_fds[cpu].refs++ == 0)
+      lru_remove(cpu);
+    fd = msr_fds[cpu].fd;
+    pthread_mutex_unlock(&msr_lock);
+    return fd;
+  }
+
+  // The budget is exceeded only if all the descriptors are in use
+  if(msr_nopen >= msr_budget && lru_tail >= 0){
+    evict = lru_tail;
+    lru_remove(evict);
+    close(msr_fds[evict].fd);
+    msr_fds[evict].fd = -1;
+    msr_nopen--;
+    STAT_ADD(nsyscalls, 1);
+  }
+
+  // Users allowed only to read the registers, e.g. the sampler
+  sprintf(file, MSRSAFE_CPU_FILE, cpu);
+  fd = open(file, O_RDWR);
+  if(fd < 0 && errno == EACCES){
+    STAT_ADD(nsyscalls, 1);
+    fd = open(file, O_RDONLY);
+  }
+  STAT_ADD(nsyscalls, 1);
+  if(fd < 0){
+    fd = -errno;
+#ifdef SLURM_SPANK_DEBUG
+    slurm_info("Failed to open '%s'!\n", file);
+#endif // SLURM_SPANK_DEBUG
+    pthread_mutex_unlock(&msr_lock);
+    return fd;
+  }
+
+  msr_fds[cpu].fd = fd;
+  msr_fds[cpu].refs = 1;
+  msr_nopen++;
+
+  pthread_mutex_unlock(&msr_lock);
+
+  return fd;
+}
+
+// Release the descriptor of a cpu, it can be closed to open other files
+void put_msr_fd(long cpu)
+{
+  pthread_mutex_lock(&msr_lock);
+  if(msr_fds != NULL && cpu >= 0 && cpu < msr_ncpus && msr_fds[cpu].refs > 0 &&
+     --msr_fds[cpu].refs == 0)
+    lru_push(cpu);
+  pthread_mutex_unlock(&msr_lock);
+}
+
+// Get the descriptor of the batch device, opened once per prolog/epilog,
+// return a negative errno if the device is not usable
+int get_msr_batch_fd()
+{
+  int fd;
+
+  pthread_mutex_lock(&msr_lock);
+  if(batch_fd < 0 && batch_err == 0){
+    batch_fd = open(MSRSAFE_BATCH_FILE, O_RDWR);
+    STAT_ADD(nsyscalls, 1);
+    if(batch_fd < 0){
+      batch_err = -errno;
+#ifdef SLURM_SPANK_DEBUG
+      slurm_info("Failed to open '%s'!\n", MSRSAFE_BATCH_FILE);
+#endif // SLURM_SPANK_DEBUG
+    }
+  }
+  fd = batch_fd >= 0 ? batch_fd : batch_err;
+  pthread_mutex_unlock(&msr_lock);
+
+  return fd;
+}
+
+// Close all the descriptors at the end of a prolog/epilog
+void free_msr_context()
+{
+  long i;
+
+  pthread_mutex_lock(&msr_lock);
+  for(i = 0; i < msr_ncpus; i++){
+    if(msr_fds[i].fd >= 0){
+      close(msr_fds[i].fd);
+      STAT_ADD(nsyscalls, 1);
+    }
+  }
+  free(msr_fds);
+  msr_fds = NULL;
+  msr_ncpus = msr_nopen = msr_budget = 0;
+  lru_head = lru_tail = -1;
+
+  if(batch_fd >= 0){
+    close(batch_fd);
+    STAT_ADD(nsyscalls, 1);
+  }
+  batch_fd = -1;
+  batch_err = 0;
+  pthread_mutex_unlock(&msr_lock);
+}
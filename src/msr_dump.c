@@ -0,0 +1,382 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+#include "pm_msrsafe.h"
+
+// Write the MSR dump in binary format
+int write_msr_dump(const char *file, struct msr_dump_record *records, long nrecords,
+  long ncpus, long nregs)
+{
+  struct msr_dump_header header;
+  FILE *fd_dump;
+  int ret = 0;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = MSRSAFE_DUMP_MAGIC;
+  header.version = MSRSAFE_DUMP_VERSION;
+  header.ncpus = ncpus;
+  header.nregs = nregs;
+  header.nrecords = nrecords;
+  header.checksum = hash_fnv1a(records, nrecords * sizeof(struct msr_dump_record));
+
+  fd_dump = fopen(file, "w");
+  if(fd_dump == NULL){
+    slurm_info("Failed to open '%s'!\n", file);
+    return -1;
+  }
+
+  if(fwrite(&header, sizeof(header), 1, fd_dump) != 1){
+    slurm_info("Failed to write the header to file '%s'!\n", file);
+    ret = -2;
+  }
+  else if(fwrite(records, sizeof(struct msr_dump_record), nrecords, fd_dump) != nrecords){
+    slurm_info("Failed to write the MSR records to file '%s'!\n", file);
+    ret = -3;
+  }
+
+  if(fclose(fd_dump) != 0 && ret == 0){
+    slurm_info("Failed to write '%s'!\n", file);
+    ret = -4;
+  }
+
+  return ret;
+}
+
+// Map a MSR dump in binary format, return -2 if the file is not a binary dump
+int map_msr_dump(const char *file, struct msr_dump *dump)
+{
+  struct msr_dump_header *header;
+  struct stat info;
+  void *addr;
+  int fd;
+
+  fd = open(file, O_RDONLY);
+  if(fd < 0){
+    slurm_info("Failed to open the MSR dump file '%s'!\n", file);
+    return -1;
+  }
+  if(fstat(fd, &info) < 0 || info.st_size < sizeof(struct msr_dump_header)){
+    close(fd);
+    return -2;
+  }
+
+  addr = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(addr == MAP_FAILED){
+    slurm_info("Failed to map the MSR dump file '%s'!\n", file);
+    return -1;
+  }
+
+  header = (struct msr_dump_header *) addr;
+  if(header->magic != MSRSAFE_DUMP_MAGIC){
+    munmap(addr, info.st_size);
+    return -2;
+  }
+  // The records of version 1 have the same layout, their values are masked on use
+  if(header->version != MSRSAFE_DUMP_VERSION &&
+     header->version != MSRSAFE_DUMP_VERSION_FULL){
+    slurm_info("Unsupported version %u of the MSR dump file '%s'!\n",
+      header->version, file);
+    munmap(addr, info.st_size);
+    return -3;
+  }
+  if(info.st_size != sizeof(struct msr_dump_header) +
+     header->nrecords * sizeof(struct msr_dump_record) ||
+     header->checksum != hash_fnv1a((char *) addr + sizeof(struct msr_dump_header),
+     header->nrecords * sizeof(struct msr_dump_record))){
+    slurm_info("The MSR dump file '%s' is corrupted!\n", file);
+    munmap(addr, info.st_size);
+    return -4;
+  }
+
+  dump->header = header;
+  dump->records = (struct msr_dump_record *) (header + 1);
+  dump->size = info.st_size;
+
+  return 0;
+}
+
+void unmap_msr_dump(struct msr_dump *dump)
+{
+  munmap(dump->header, dump->size);
+}
+
+// Load a MSR dump in text format as write operations, return the number of operations
+long load_msr_dump_text(const char *file, struct msr_batch_op **ops)
+{
+  struct msr_batch_op *entries;
+  char *buf, *ptr, *eptr;
+  long nops = 0, size;
+  struct stat info;
+  FILE *fd_dump;
+  int corrupted;
+
+  // Read the whole dump
+  fd_dump = fopen(file, "r");
+  if(fd_dump == NULL){
+    slurm_info("Failed to open the MSR dump file '%s'!\n", file);
+    return -1;
+  }
+  if(fstat(fileno(fd_dump), &info) < 0){
+    slurm_info("Failed to read the size of the MSR dump file '%s'!\n", file);
+    fclose(fd_dump);
+    return -2;
+  }
+  size = info.st_size;
+  buf = malloc(size + 1);
+  if(buf == NULL){
+    fclose(fd_dump);
+    return -3;
+  }
+  if(fread(buf, 1, size, fd_dump) != size){
+    slurm_info("Failed to read the MSR dump file '%s'!\n", file);
+    free(buf);
+    fclose(fd_dump);
+    return -4;
+  }
+  buf[size] = '\0';
+  fclose(fd_dump);
+
+  // Each line is at least 6 bytes long
+  entries = malloc((size / 6 + 1) * sizeof(struct msr_batch_op));
+  if(entries == NULL){
+    free(buf);
+    return -3;
+  }
+
+  // Parse '<cpu> <msr> <value>' lines
+  ptr = buf;
+  while(*ptr != '\0'){
+    if(*ptr == '#'){
+      eptr = strchr(ptr, '\n');
+      ptr = (eptr == NULL) ? ptr + strlen(ptr) : eptr + 1;
+      continue;
+    }
+
+    entries[nops].cpu = strtoul(ptr, &eptr, 10);
+    if(eptr == ptr)
+      break;
+    ptr = eptr;
+    entries[nops].msr = strtoul(ptr, &eptr, 16);
+    if(eptr == ptr)
+      break;
+    ptr = eptr;
+    entries[nops].msrdata = strtoul(ptr, &eptr, 10);
+    if(eptr == ptr)
+      break;
+    ptr = eptr;
+    entries[nops].isrdmsr = FALSE;
+    nops++;
+
+    while(*ptr == '\n' || *ptr == ' ')
+      ptr++;
+  }
+  corrupted = (*ptr != '\0');
+
+  free(buf);
+
+  if(corrupted){
+    slurm_info("The MSR dump file '%s' is corrupted at entry %ld!\n", file, nops);
+    free(entries);
+    return -5;
+  }
+
+  *ops = entries;
+  return nops;
+}
+
+// Print a MSR dump in text format
+int print_msr_dump(const char *file)
+{
+  struct msr_dump dump;
+  uint64_t i;
+
+  if(map_msr_dump(file, &dump) < 0){
+    printf("'%s' is not a valid MSR dump file!\n", file);
+    return -1;
+  }
+
+  printf("# Version %u, %u CPUs, %u registers, %lu records, checksum 0x%016lx\n",
+    dump.header->version, dump.header->ncpus, dump.header->nregs,
+    dump.header->nrecords, dump.header->checksum);
+  printf("# CPU_ID # MSR # Value # Mask\n");
+  for(i = 0; i < dump.header->nrecords; i++)
+    printf("%u 0x%x %lu 0x%016lx\n", dump.records[i].cpu, dump.records[i].msr,
+      dump.records[i].value, dump.records[i].mask);
+
+  unmap_msr_dump(&dump);
+
+  return 0;
+}
+
+static int cmp_msr_addr(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return (x > y) - (x < y);
+}
+
+// Convert a MSR dump from text to binary format
+int convert_msr_dump(const char *text_file, const char *bin_file)
+{
+  struct msr_dump_record *records;
+  struct msr_batch_op *ops;
+  long i, nops, nregs = 0, max_cpu = -1;
+  uint32_t *addrs;
+  int ret;
+
+  nops = load_msr_dump_text(text_file, &ops);
+  if(nops < 0)
+    return -1;
+
+  records = malloc(nops * sizeof(struct msr_dump_record));
+  addrs = malloc(nops * sizeof(uint32_t));
+  if((records == NULL || addrs == NULL) && nops > 0){
+    free(records);
+    free(addrs);
+    free(ops);
+    return -2;
+  }
+
+  for(i = 0; i < nops; i++){
+    records[i].msr = ops[i].msr;
+    records[i].cpu = ops[i].cpu;
+    records[i].value = ops[i].msrdata;
+    // Text dumps saved the whole register
+    records[i].mask = ~0UL;
+    addrs[i] = ops[i].msr;
+    if(ops[i].cpu > max_cpu)
+      max_cpu = ops[i].cpu;
+  }
+
+  // Count the registers
+  qsort(addrs, nops, sizeof(uint32_t), cmp_msr_addr);
+  for(i = 0; i < nops; i++)
+    if(i == 0 || addrs[i] != addrs[i - 1])
+      nregs++;
+
+  ret = write_msr_dump(bin_file, records, nops, max_cpu + 1, nregs);
+
+  free(records);
+  free(addrs);
+  free(ops);
+
+  return ret < 0 ? -3 : 0;
+}
+
+// Dump the registers read by the operations, keeping only the bits of mask
+int dump_msr_ops(const char *file, struct msr_batch_op *ops, long nops, uint64_t mask,
+  long nregs)
+{
+  struct msr_dump_record *records;
+  long i, nrecords = 0;
+  int ret = 0;
+
+  records = malloc(nops * sizeof(struct msr_dump_record));
+  if(records == NULL && nops > 0)
+    return -1;
+
+  for(i = 0; i < nops; i++){
+    if(ops[i].err != 0){
+      slurm_info("Failed to read on cpu %u the MSR address 0x%x!\n", ops[i].cpu, ops[i].msr);
+      ret = -2;
+      continue;
+    }
+    records[nrecords].msr = ops[i].msr;
+    records[nrecords].cpu = ops[i].cpu;
+    records[nrecords].mask = mask;
+    records[nrecords].value = ops[i].msrdata & mask;
+    nrecords++;
+  }
+
+  if(write_msr_dump(file, records, nrecords, get_ncpus(), nregs) < 0){
+    slurm_info("Failed to write the MSR dump file '%s'!\n", file);
+    ret = -3;
+  }
+
+  free(records);
+
+  return ret;
+}
+
+// Restore a binary MSR dump read-modify-write, a missing dump is skipped
+int restore_msr_dump(const char *file)
+{
+  struct msr_batch_op *ops;
+  struct msr_dump dump;
+  long i, nops, nfailed;
+  int ret = 0;
+
+  if(access(file, F_OK) < 0)
+    return 0;
+  if(check_baseline_file(file) < 0 || map_msr_dump(file, &dump) < 0){
+    slurm_info("Failed to load the MSR dump file '%s'!\n", file);
+    return -1;
+  }
+
+  nops = dump.header->nrecords;
+  ops = calloc(nops, sizeof(struct msr_batch_op));
+  if(ops == NULL && nops > 0){
+    unmap_msr_dump(&dump);
+    return -2;
+  }
+  for(i = 0; i < nops; i++){
+    ops[i].cpu = dump.records[i].cpu;
+    ops[i].isrdmsr = FALSE;
+    ops[i].msr = dump.records[i].msr;
+    ops[i].msrdata = dump.records[i].value;
+    ops[i].wmask = dump.records[i].mask;
+  }
+  unmap_msr_dump(&dump);
+
+  nops = merge_msr_batch(ops, nops, &nfailed);
+  if(nops < 0){
+    free(ops);
+    return -2;
+  }
+  if(nfailed > 0)
+    ret = -3;
+  if(exec_msr_batch(ops, nops) > 0){
+    for(i = 0; i < nops; i++){
+      if(ops[i].err != 0){
+        slurm_info("Failed to restore the MSR '%x' with value '%lu' on cpu '%u' (%s)!\n",
+          ops[i].msr, ops[i].msrdata, ops[i].cpu, strerror(-ops[i].err));
+        ret = -4;
+      }
+    }
+  }
+
+  free(ops);
+
+  return ret;
+}
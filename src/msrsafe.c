@@ -63,38 +63,18 @@ int write_msr(int fd, long cpu_id, uint64_t addr, uint64_t value)
     return 0;
 }
 
+// Access a single MSR through the descriptors kept open by msr_context.c
 int read_msr_file(long cpu_id, uint64_t addr, uint64_t *value)
 {
-  uint64_t data;
   int fd;
-  char file[BUFFER_SIZE];
-  int ret = 0;
+  int ret;
 
-  // Open files
-  sprintf(file, MSRSAFE_CPU_FILE, cpu_id);
-  fd = open(file, O_RDONLY);
-  if(fd < 0){
-#ifdef SLURM_SPANK_DEBUG
-    slurm_info("Failed to open '%s'!\n", file);
-#endif // SLURM_SPANK_DEBUG
+  fd = get_msr_fd(cpu_id);
+  if(fd < 0)
     return -1;
-  }
 
-  // Read MSR
-  if(pread(fd, &data, sizeof(data), addr) != sizeof(data)){
-#ifdef SLURM_SPANK_DEBUG
-    slurm_info("Failed to read the MSR register '0x%lx' on cpu '%ld'!\n",
-      addr, cpu_id);
-#endif // SLURM_SPANK_DEBUG
-    ret = -1;
-  }
-  else{
-    *value = data;
-    ret = 0;
-  }
-
-  // Close file
-  close(fd);
+  ret = read_msr(fd, cpu_id, addr, value);
+  put_msr_fd(cpu_id);
 
   return ret;
 }
@@ -102,32 +82,14 @@ int read_msr_file(long cpu_id, uint64_t addr, uint64_t *value)
 int write_msr_file(long cpu_id, uint64_t addr, uint64_t value)
 {
   int fd;
-  char file[BUFFER_SIZE];
-  int ret = 0;
+  int ret;
 
-  // Open files
-  sprintf(file, MSRSAFE_CPU_FILE, cpu_id);
-  fd = open(file, O_WRONLY);
-  if(fd < 0){
-#ifdef SLURM_SPANK_DEBUG
-    slurm_info("Failed to open '%s'!\n", file);
-#endif // SLURM_SPANK_DEBUG
+  fd = get_msr_fd(cpu_id);
+  if(fd < 0)
     return -1;
-  }
-
-  // Write MSR
-  if(pwrite(fd, &value, sizeof(uint64_t), addr) != sizeof(uint64_t)){
-#ifdef SLURM_SPANK_DEBUG
-    slurm_info("Failed to write data '%lu' to the MSR register '0x%lx' on cpu '%ld'!\n",
-      value, addr, cpu_id);
-#endif // SLURM_SPANK_DEBUG
-    ret = -1;
-  }
-  else
-    ret = 0;
 
-  // Close file
-  close(fd);
+  ret = write_msr(fd, cpu_id, addr, value);
+  put_msr_fd(cpu_id);
 
   return ret;
 }
@@ -150,9 +112,9 @@ static int check_msrsafe()
     ret = -2;
   }
 
-  long i, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  long i, ncpus = job_ncpus();
   for(i = 0; i < ncpus; i++){
-    sprintf(file, MSRSAFE_CPU_FILE, i);
+    sprintf(file, MSRSAFE_CPU_FILE, job_cpu(i));
     if(access(file, F_OK) != 0){
 #ifdef SLURM_SPANK_DEBUG
       slurm_info("'%s' does not exist!\n", file);
@@ -164,202 +126,332 @@ static int check_msrsafe()
   return ret;
 }
 
+// The whitelist is the same for all the cpus: on a shared node a writable
+// core or package register of a cpu of the job also changes the cpus of the
+// other jobs. Check that the job owns the whole core or package of each
+// writable register, every register may be shared on unknown processors
+static int check_shared_whitelist()
+{
+  static const char *scope_names[] = { "thread", "core", "package" };
+  struct msr_whitelist whitelist;
+  struct msr_wl_entry *wl;
+  long j, k, cpu, nwl, ncpus = job_ncpus();
+  int scope;
+
+  nwl = get_whitelist(&whitelist);
+  if(nwl < 0){
+    slurm_info("Failed to read the whitelist '%s'!\n", MSRSAFE_WHITELIST_FILE);
+    return -1;
+  }
+  wl = whitelist.entries;
+
+  for(j = 0; j < nwl; j++){
+    if(wl[j].mask == 0)
+      continue;
+    scope = msr_scope_known() ? msr_scope(wl[j].addr) : SCOPE_PACKAGE;
+    for(k = 0; k < ncpus; k++){
+      cpu = job_cpu(k);
+      if(!job_owns(cpu, scope)){
+        slurm_info("The writable MSR '0x%lx' is shared by the %s of cpu '%ld' with other jobs!\n",
+          wl[j].addr, scope_names[scope], cpu);
+        put_whitelist(&whitelist);
+        return -2;
+      }
+    }
+  }
+
+  put_whitelist(&whitelist);
+
+  return 0;
+}
+
+// The user and the group of the job from the environment of the prolog
+static int read_job_owner(uid_t *uid, gid_t *gid)
+{
+  const char *env_uid = getenv("SLURM_JOB_UID");
+  const char *env_gid = getenv("SLURM_JOB_GID");
+
+  if(env_uid == NULL || env_gid == NULL){
+    slurm_info("Failed to read the environment variables '$%s' and '$%s'!\n",
+      "SLURM_JOB_UID", "SLURM_JOB_GID");
+    return -1;
+  }
+  *uid = strtoul(env_uid, NULL, 10);
+  *gid = strtoul(env_gid, NULL, 10);
+
+  return 0;
+}
+
 static int set_permissions_msrsafe(int conf)
 {
   char msrsave_cpu[BUFFER_SIZE];
-  int ret = 0;
-
-  // Check and set permission to sysfs MSR_WHITELIST
-  if(set_read_permission(MSRSAFE_WHITELIST_FILE, conf) < 0){
-    slurm_info("Failed to set permissions to '%s'!\n", MSRSAFE_WHITELIST_FILE);
-    ret = -1;
+  struct perm_list list;
+  int kind = PERM_READ_WRITE, ret = 0;
+
+  init_perm_list(&list);
+
+  // The MSR_SAFE files of the cpus of a shared job are given to its user, or
+  // to its group when they are read-only, and not opened to the other users
+  // of the node
+  if(job_cpuset.shared){
+    kind = PERM_JOB_READ_WRITE;
+    if(conf == SET && read_job_owner(&list.uid, &list.gid) < 0){
+      slurm_info("The MSR_SAFE files of the cpus of the job are not opened!\n");
+      return -3;
+    }
   }
 
-  // Check and set permission to sysfs MSR_SAFE_BATCH
-  if(set_read_write_permission(MSRSAFE_BATCH_FILE, conf) < 0){
-    slurm_info("Failed to set permissions to '%s'!\n", MSRSAFE_WHITELIST_FILE);
-    ret = -2;
+  // Check and set permission to sysfs MSR_WHITELIST
+  ret |= add_perm(&list, PERM_READ, MSRSAFE_WHITELIST_FILE);
+
+  // Check and set permission to sysfs MSR_SAFE_BATCH, a batch accesses any cpu
+  // and it is not opened to the jobs of a shared node
+  if(!job_cpuset.shared)
+    ret |= add_perm(&list, PERM_READ_WRITE, MSRSAFE_BATCH_FILE);
+
+  // The jobs of a shared node write the MSRs only if the registers do not
+  // change the cpus of other jobs, the epilog resets both the permissions
+  if(job_cpuset.shared && conf == SET && check_shared_whitelist() < 0){
+    slurm_info("The MSR_SAFE files of the cpus of the job are read-only!\n");
+    kind = PERM_JOB_READ;
   }
 
   // Check and set permission to MSR_SAFE sysfs files for CPUs
-  long i, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  long i, ncpus = job_ncpus();
   for(i = 0; i < ncpus; i++){
-    sprintf(msrsave_cpu, MSRSAFE_CPU_FILE, i);
-    if(set_read_write_permission(msrsave_cpu, conf) < 0){
-      slurm_info("Failed to set permissions to '%s'!\n", msrsave_cpu);
-      ret = -3;
-    }
+    sprintf(msrsave_cpu, MSRSAFE_CPU_FILE, job_cpu(i));
+    ret |= add_perm(&list, kind, msrsave_cpu);
+  }
+
+  if(ret < 0){
+    slurm_info("Failed to allocate the list of MSR_SAFE files!\n");
+    ret = -1;
   }
+  else if(apply_permissions(&list, conf, "MSR_SAFE") < 0)
+    ret = -2;
+
+  free_perm_list(&list);
 
   return ret;
 }
 
 static int dump_msrsafe()
 {
-  char *addr_str, *mask_str;
-  char line[BUFFER_SIZE];
-  char msrsave_cpu[BUFFER_SIZE];
-  unsigned long i, j, addr, mask, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
-  FILE *fd_wl, *fd_dump;
-  int fd_msr[ncpus];
-  uint64_t value;
-  int ret = 0;
-
-  // Open files
-  fd_wl = fopen(MSRSAFE_WHITELIST_FILE, "r");
-  if(fd_wl == NULL){
-    slurm_info("Failed to open '%s'!\n", MSRSAFE_WHITELIST_FILE);
+  unsigned long i, j, k, nops = 0, nrecords = 0, nregs = 0;
+  unsigned long ncpus = get_ncpus(), njob = job_ncpus();
+  struct msr_dump_record *records;
+  struct msr_whitelist whitelist;
+  struct cpu_topology *topo;
+  struct msr_wl_entry *wl;
+  struct msr_batch_op *ops;
+  long nwl;
+  int scope, ret = 0;
+
+  // Read the writable registers
+  nwl = get_whitelist(&whitelist);
+  if(nwl < 0){
+    slurm_info("Failed to read the whitelist '%s'!\n", MSRSAFE_WHITELIST_FILE);
     return -1;
   }
-
-  fd_dump = fopen(MSRSAFE_DUMP, "w");
-  if(fd_dump == NULL){
-    slurm_info("Failed to open '%s'!\n", MSRSAFE_DUMP);
-    fclose(fd_wl);
-    return -2;
+  wl = whitelist.entries;
+
+  // Read the topology to access core and package registers once per domain
+  topo = get_topology();
+  if(topo == NULL)
+    slurm_info("Failed to read the cpu topology, all the registers are dumped for each cpu!\n");
+
+  // Prepare a read operation for each writable register of each cpu of the job
+  ops = malloc(nwl * njob * sizeof(struct msr_batch_op));
+  records = malloc(nwl * njob * sizeof(struct msr_dump_record));
+  if(ops == NULL || records == NULL){
+    slurm_info("Failed to allocate the MSR batch operations!\n");
+    free(ops);
+    free(records);
+    put_whitelist(&whitelist);
+    return -3;
   }
-
-  for(i = 0; i < ncpus; i++){
-    sprintf(msrsave_cpu, MSRSAFE_CPU_FILE, i);
-    fd_msr[i] = open(msrsave_cpu, O_RDONLY);
-    if(fd_msr[i] < 0){
-      slurm_info("Failed to open '%s'!\n", msrsave_cpu);
-      for(j = 0; j < i; j++)
-        close(fd_msr[i]);
-      fclose(fd_dump);
-      fclose(fd_wl);
-      return -3;
+  for(j = 0; j < nwl; j++){
+    if(wl[j].mask > 0){
+      scope = msr_scope(wl[j].addr);
+      for(k = 0; k < njob; k++){
+        i = job_cpu(k);
+        // On shared nodes only the cores and packages owned by the job
+        if(!topology_is_leader(topo, i, scope) || !job_owns(i, scope))
+          continue;
+        ops[nops].cpu = i;
+        ops[nops].isrdmsr = TRUE;
+        ops[nops].msr = wl[j].addr;
+        ops[nops].msrdata = 0;
+        records[nops].msr = wl[j].addr;
+        records[nops].cpu = i;
+        records[nops].mask = wl[j].mask;
+        nops++;
+      }
+      nregs++;
     }
   }
 
-  // Print labels
-  if(fprintf(fd_dump, "# CPU_ID # MSR # Value\n") < 0){
-    slurm_info("Failed to write label to file '%s'!\n", MSRSAFE_DUMP);
-    for(i = 0; i < ncpus; i++)
-      close(fd_msr[i]);
-    fclose(fd_dump);
-    fclose(fd_wl);
-    return -4;
+  // Read MSR writable registers
+  exec_msr_batch(ops, nops);
+
+  for(i = 0; i < nops; i++){
+    if(ops[i].err == 0){
+      records[nrecords] = records[i];
+      // Only the writable bits are restored
+      records[nrecords].value = ops[i].msrdata & records[i].mask;
+      nrecords++;
+    }
+    else{
+      slurm_info("Failed to read on cpu %u the MSR address 0x%x!\n",
+          ops[i].cpu, ops[i].msr);
+      ret = -6;
+    }
   }
 
   // Dump MSR writable registers
-  while(fgets(line, sizeof(line), fd_wl)) {
-    if(line[0] == '#')
-      continue;
-
-    addr_str = strtok(line, " ");
-    addr = strtoul(addr_str, NULL, 16);
-
-    mask_str = strtok(NULL, " ");
-    mask_str = strtok(mask_str, "\n");
-    mask = strtoul(mask_str, NULL, 16);
-
-    if(mask > 0){
-      for(i = 0; i < ncpus; i++){
-        if(read_msr(fd_msr[i], i,  addr, &value) == 0){
-          if(fprintf(fd_dump, "%lu %s %lu\n", i, addr_str, value) < 0){
-            sprintf(msrsave_cpu, MSRSAFE_CPU_FILE, i);
-            slurm_info("Failed to write '%lu %s %lu' to file '%s'!\n",
-              i, addr_str, value, msrsave_cpu);
-            ret = -5;
-          }
-        }
-        else{
-          slurm_info("Failed to read on cpu %lu the MSR address %s!\n",
-              i, addr_str);
-          ret = -6;
-        }
-      }
-    }
+  if(write_msr_dump(MSRSAFE_DUMP, records, nrecords, ncpus, nregs) < 0){
+    slurm_info("Failed to write the MSR dump file '%s'!\n", MSRSAFE_DUMP);
+    ret = -2;
   }
 
-  // Close files
-  for(i = 0; i < ncpus; i++)
-    close(fd_msr[i]);
-  fclose(fd_dump);
-  fclose(fd_wl);
+  free(ops);
+  free(records);
+  put_whitelist(&whitelist);
 
   return ret;
 }
 
 static int restore_msrsafe()
 {
+  struct msr_batch_op *ops;
+  struct msr_dump dump;
+  long i, nops, nentries, nfailed;
   int ret = 0;
-  char msrsave_cpu[BUFFER_SIZE];
-  unsigned long i, j, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
-  FILE *fd_dump;
-  int fd_msr[ncpus];
-  long cpu_id;
-  uint64_t addr, value;
-
-  // Open files
-  fd_dump = fopen(MSRSAFE_DUMP, "r");
-  if(fd_dump == NULL){
-    slurm_info("Failed to open the MSR dump file '%s'!\n", MSRSAFE_DUMP);
-    return -1;
-  }
-  for(i = 0; i < ncpus; i++){
-    sprintf(msrsave_cpu, MSRSAFE_CPU_FILE, i);
-    fd_msr[i] = open(msrsave_cpu, O_WRONLY);
-    if(fd_msr[i] < 0){
-      slurm_info("Failed to open the MSR file '%s'!\n", msrsave_cpu);
-      for(j = 0; j < i; j++)
-        close(fd_msr[i]);
-      fclose(fd_dump);
+
+  // Load the dump
+  ret = map_msr_dump(MSRSAFE_DUMP, &dump);
+  if(ret == 0){
+    nops = dump.header->nrecords;
+    ops = malloc(nops * sizeof(struct msr_batch_op));
+    if(ops == NULL && nops > 0){
+      slurm_info("Failed to allocate the MSR batch operations!\n");
+      unmap_msr_dump(&dump);
       return -2;
     }
+    for(i = 0; i < nops; i++){
+      ops[i].cpu = dump.records[i].cpu;
+      ops[i].isrdmsr = FALSE;
+      ops[i].msr = dump.records[i].msr;
+      ops[i].msrdata = dump.records[i].value;
+      ops[i].wmask = dump.records[i].mask;
+    }
+    unmap_msr_dump(&dump);
   }
+  else if(ret == -2){
+    // Text dump of a previous version of the plugin
+    nops = load_msr_dump_text(MSRSAFE_DUMP, &ops);
+    // Text dumps saved the whole register
+    for(i = 0; i < nops; i++)
+      ops[i].wmask = ~0UL;
+  }
+  else
+    nops = -1;
+  ret = 0;
 
-  // Restore MSRSAFE
-  if(fscanf(fd_dump, "# CPU_ID # MSR # Value\n") == EOF){
+  if(nops < 0){
+    slurm_info("Failed to load the MSR dump file '%s'!\n", MSRSAFE_DUMP);
+    return -1;
+  }
+  if(nops == 0){
     slurm_info("The restore file '%s' is empy!\n", MSRSAFE_DUMP);
-    ret = -3;
+    free(ops);
+    return -3;
   }
-  while(fscanf(fd_dump, "%ld %lx %lu\n", &cpu_id, &addr, &value) != EOF) {
-    if(write_msr(fd_msr[cpu_id], cpu_id, addr, value) < 0){
-      ret = -4;
-      slurm_info("Failed to restore the MSR '%lx' with value '%lu' on cpu '%ld'!\n",
-        addr, value, cpu_id);
+
+  // Restore MSRSAFE
+  if(group_msr_batch_by_cpu(ops, nops) < 0){
+    slurm_info("Failed to allocate the MSR batch operations!\n");
+    free(ops);
+    return -2;
+  }
+  // Read-modify-write of the writable bits that changed
+  nentries = nops;
+  nops = merge_msr_batch(ops, nops, &nfailed);
+  if(nops < 0){
+    slurm_info("Failed to allocate the MSR batch operations!\n");
+    free(ops);
+    return -2;
+  }
+  if(pm_conf.delta_restore)
+    slurm_info("Restored %ld of %ld MSR entries!\n", nops, nentries);
+  if(nfailed > 0)
+    ret = -4;
+  if(exec_msr_batch(ops, nops) > 0){
+    for(i = 0; i < nops; i++){
+      if(ops[i].err != 0){
+        slurm_info("Failed to restore the MSR '%x' with value '%lu' on cpu '%u' (%s)!\n",
+          ops[i].msr, ops[i].msrdata, ops[i].cpu, strerror(-ops[i].err));
+        ret = -4;
+      }
     }
   }
 
-  // Close files
-  for(i = 0; i < ncpus; i++)
-    close(fd_msr[i]);
-  fclose(fd_dump);
+  free(ops);
 
   return ret;
 }
 
 int set_msrsafe(int conf)
 {
-  int ret = 0;
+  int phase, ret = 0;
 
   // Check if MSR_SAFE is intalled in the node
+  phase = phase_begin("check_msrsafe");
   if(check_msrsafe() < 0){
     slurm_info("MSR_SAFE is not installed in the node!\n");
     ret = -1;
   }
+  phase_end(phase);
 
   // Set permissions to MSR_SAFE files
-  if(set_permissions_msrsafe(conf) < 0){
-    slurm_info("Failed to set permissions to MSRSAFE files!\n");
-    ret = -2;
+  if(conf != DUMP){
+    phase = phase_begin("set_permissions_msrsafe");
+    if(set_permissions_msrsafe(conf) < 0){
+      slurm_info("Failed to set permissions to MSRSAFE files!\n");
+      ret = -2;
+    }
+    phase_end(phase);
   }
 
-  if(conf == SET){
+  // The baseline replaces the dump of each job
+  if(conf == SET && baseline_enabled() && check_baseline_file(MSRSAFE_DUMP) == 0)
+    return ret;
+
+  if(conf == SET || conf == DUMP){
     // Dump MSR registers
+    phase = phase_begin("dump_msrsafe");
     if(dump_msrsafe() < 0){
       slurm_info("Failed to dump all MSR registers!\n");
       ret = -3;
     }
+    phase_end(phase);
+
+    // Uncore ratio limits of each package
+    if(set_uncore(conf) < 0)
+      ret = -5;
   }
   else if(conf == RESET){
     // Restore MSR
+    // Report the uncore frequency of the job before restoring the registers
+    if(set_uncore(conf) < 0)
+      ret = -5;
+
+    phase = phase_begin("restore_msrsafe");
     if(restore_msrsafe() < 0){
       slurm_info("Failed to restore all MSR registers!\n");
       ret = -4;
     }
+    phase_end(phase);
   }
 
   return ret;
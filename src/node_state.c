@@ -0,0 +1,613 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+
+#include "pm_msrsafe.h"
+
+// Power state of the node in the current prolog/epilog
+static struct node_state node_state;
+
+static int alloc_node_state(struct node_state *st, long ncpus)
+{
+  long i;
+
+  st->data = malloc(NODE_NARRAYS * ncpus * sizeof(int32_t));
+  if(st->data == NULL)
+    return -1;
+  for(i = 0; i < NODE_NARRAYS * ncpus; i++)
+    st->data[i] = NODE_UNKNOWN;
+
+  st->ncpus = ncpus;
+  st->governor = st->data;
+  st->scaling_max_freq = st->data + ncpus;
+  st->scaling_min_freq = st->data + 2 * ncpus;
+  st->cpuinfo_max_freq = st->data + 3 * ncpus;
+  st->cpuinfo_min_freq = st->data + 4 * ncpus;
+  st->scaling_setspeed = st->data + 5 * ncpus;
+  st->policy = st->data + 6 * ncpus;
+  st->no_turbo = NODE_UNKNOWN;
+  st->max_perf_pct = NODE_UNKNOWN;
+  st->min_perf_pct = NODE_UNKNOWN;
+
+  return 0;
+}
+
+static void release_node_state(struct node_state *st)
+{
+  free(st->data);
+  memset(st, 0, sizeof(struct node_state));
+}
+
+// Set the governor of a cpu, the names are stored once in the state
+int set_node_governor(struct node_state *st, long cpu, const char *name)
+{
+  int i;
+
+  for(i = 0; i < st->ngovernors; i++){
+    if(strcmp(st->governors[i], name) == 0)
+      break;
+  }
+  if(i == st->ngovernors){
+    if(i == NODE_MAX_GOVERNORS || strlen(name) >= NODE_GOVERNOR_SIZE){
+      slurm_info("Unsupported governor '%s' of cpu '%ld'!\n", name, cpu);
+      st->governor[cpu] = NODE_UNKNOWN;
+      return -1;
+    }
+    strcpy(st->governors[i], name);
+    st->ngovernors++;
+  }
+  st->governor[cpu] = i;
+
+  return 0;
+}
+
+// A cpu reads and writes the cpufreq files of its policy only if it is the
+// first cpu of the policy, the other cpus share the same files
+int is_policy_leader(struct node_state *st, long cpu)
+{
+  return st->policy[cpu] == NODE_UNKNOWN || st->policy[cpu] == cpu;
+}
+
+// A job owns a cpufreq policy if it owns all its cpus, all the policies of
+// the online cpus on exclusive nodes
+int job_owns_policy(struct node_state *st, long cpu)
+{
+  long i;
+
+  if(!job_cpuset.shared)
+    return cpu_is_online(cpu);
+  if(!job_owns(cpu, SCOPE_THREAD))
+    return FALSE;
+  if(st->policy[cpu] == NODE_UNKNOWN)
+    return TRUE;
+
+  for(i = 0; i < st->ncpus; i++)
+    if(st->policy[i] == st->policy[cpu] && !job_owns(i, SCOPE_THREAD))
+      return FALSE;
+
+  return TRUE;
+}
+
+// Copy the cpufreq state of the first cpu of each policy to the other cpus
+void sync_node_policies(struct node_state *st)
+{
+  long cpu, leader;
+
+  for(cpu = 0; cpu < st->ncpus; cpu++){
+    if(is_policy_leader(st, cpu))
+      continue;
+    leader = st->policy[cpu];
+    st->governor[cpu] = st->governor[leader];
+    st->scaling_max_freq[cpu] = st->scaling_max_freq[leader];
+    st->scaling_min_freq[cpu] = st->scaling_min_freq[leader];
+    st->cpuinfo_max_freq[cpu] = st->cpuinfo_max_freq[leader];
+    st->cpuinfo_min_freq[cpu] = st->cpuinfo_min_freq[leader];
+    st->scaling_setspeed[cpu] = st->scaling_setspeed[leader];
+  }
+}
+
+// Entry returned by getdents64, read directly to count the syscalls
+struct dirent64_entry {
+  uint64_t ino;
+  int64_t off;
+  unsigned short reclen;
+  unsigned char type;
+  char name[];
+};
+
+// Read the cpus of each cpufreq policy (policyN/affected_cpus), the cpus
+// without a policy directory are handled one by one
+static int scan_node_policies(struct node_state *st)
+{
+  char file[BUFFER_SIZE];
+  char cpus[BUFFER_SIZE];
+  char entries[BUFFER_SIZE * 8];
+  struct dirent64_entry *entry;
+  long id, cpu, first, len, pos;
+  char *ptr, *eptr;
+  int fd_dir;
+
+  if(!pm_conf.cpufreq_policy)
+    return 0;
+
+  fd_dir = open(PM_CPUFREQ_POLICY_DIR, O_RDONLY | O_DIRECTORY);
+  STAT_ADD(nsyscalls, 1);
+  if(fd_dir < 0){
+#ifdef SLURM_SPANK_DEBUG
+    slurm_info("Failed to open '%s', cpufreq files are accessed per cpu!\n",
+      PM_CPUFREQ_POLICY_DIR);
+#endif // SLURM_SPANK_DEBUG
+    return -1;
+  }
+
+  while((len = syscall(SYS_getdents64, fd_dir, entries, sizeof(entries))) > 0){
+    STAT_ADD(nsyscalls, 1);
+    for(pos = 0; pos < len; pos += entry->reclen){
+      entry = (struct dirent64_entry *) (entries + pos);
+      if(sscanf(entry->name, "policy%ld", &id) != 1)
+        continue;
+
+      sprintf(file, PM_CPUFREQ_AFFECTED_CPUS, id);
+      if(read_file(file, cpus, sizeof(cpus)) < 0)
+        continue;
+
+      // The first cpu of the policy accesses its files
+      for(first = -1, ptr = cpus; ; ptr = eptr){
+        cpu = strtol(ptr, &eptr, 10);
+        if(eptr == ptr)
+          break;
+        if(cpu >= 0 && cpu < st->ncpus){
+          if(first < 0)
+            first = cpu;
+          st->policy[cpu] = first;
+        }
+      }
+    }
+  }
+  // The last getdents64 and close
+  STAT_ADD(nsyscalls, 2);
+  close(fd_dir);
+
+  return 0;
+}
+
+static int32_t parse_node_value(struct sysfs_req *req)
+{
+  char *eptr;
+  long value;
+
+  if(req->err != 0){
+    slurm_info("Failed to read the power state from file '%s'!\n", req->path);
+    return NODE_UNKNOWN;
+  }
+
+  value = strtol(req->value, &eptr, 10);
+  if(eptr == req->value || *eptr != '\0' || value < 0 || value > INT32_MAX){
+    slurm_info("Invalid value '%s' of file '%s'!\n", req->value, req->path);
+    return NODE_UNKNOWN;
+  }
+
+  return value;
+}
+
+static int add_node_req(struct sysfs_batch *batch, const char *format, long cpu)
+{
+  char file[BUFFER_SIZE];
+
+  sprintf(file, format, cpu);
+  return add_sysfs_req(batch, SYSFS_READ, file, NULL) < 0 ? -1 : 0;
+}
+
+// Read the groups of fields not loaded yet with a single sysfs batch
+static int scan_node_state(struct node_state *st, int fields)
+{
+  struct sysfs_batch batch, setspeed;
+  struct sysfs_req *req;
+  long i, cpu, *setspeed_cpus;
+  int ret = 0;
+
+  setspeed_cpus = malloc(st->ncpus * sizeof(long));
+  if(setspeed_cpus == NULL)
+    return -1;
+
+  init_sysfs_batch(&batch);
+  init_sysfs_batch(&setspeed);
+
+  for(cpu = 0; cpu < st->ncpus; cpu++){
+    if(!cpu_is_online(cpu) || !is_policy_leader(st, cpu))
+      continue;
+    if(fields & NODE_CPUFREQ){
+      ret |= add_node_req(&batch, PM_GOVERNOR, cpu);
+      ret |= add_node_req(&batch, PM_SCALING_MAX_FREQ, cpu);
+      ret |= add_node_req(&batch, PM_SCALING_MIN_FREQ, cpu);
+    }
+    if(fields & NODE_CPUINFO){
+      ret |= add_node_req(&batch, PM_CPUINFO_MAX_FREQ, cpu);
+      ret |= add_node_req(&batch, PM_CPUINFO_MIN_FREQ, cpu);
+    }
+  }
+  if(fields & NODE_IPSTATE){
+    ret |= add_sysfs_req(&batch, SYSFS_READ, PM_IPSTATE_NO_TURBO, NULL) < 0;
+    ret |= add_sysfs_req(&batch, SYSFS_READ, PM_IPSTATE_MAX_PERF_PCT, NULL) < 0;
+    ret |= add_sysfs_req(&batch, SYSFS_READ, PM_IPSTATE_MIN_PERF_PCT, NULL) < 0;
+  }
+  if(ret != 0){
+    slurm_info("Failed to allocate the requests of the node power state!\n");
+    free_sysfs_batch(&batch);
+    free(setspeed_cpus);
+    return -1;
+  }
+
+  exec_sysfs_batch(&batch);
+
+  // Requests are in the same order as queued
+  req = batch.reqs;
+  for(cpu = 0; cpu < st->ncpus; cpu++){
+    if(!cpu_is_online(cpu) || !is_policy_leader(st, cpu))
+      continue;
+    if(fields & NODE_CPUFREQ){
+      if(req->err != 0){
+        slurm_info("Failed to read the power state from file '%s'!\n", req->path);
+        ret = -2;
+      }
+      else if(set_node_governor(st, cpu, req->value) < 0)
+        ret = -2;
+      req++;
+      st->scaling_max_freq[cpu] = parse_node_value(req++);
+      st->scaling_min_freq[cpu] = parse_node_value(req++);
+
+      // The speed step is available only with the userspace governor
+      if(st->governor[cpu] != NODE_UNKNOWN &&
+         strcmp(st->governors[st->governor[cpu]], "userspace") == 0){
+        setspeed_cpus[setspeed.nreqs] = cpu;
+        ret |= add_node_req(&setspeed, PM_CPUFREQ_SCALING_SETSPEED, cpu);
+      }
+    }
+    if(fields & NODE_CPUINFO){
+      st->cpuinfo_max_freq[cpu] = parse_node_value(req++);
+      st->cpuinfo_min_freq[cpu] = parse_node_value(req++);
+    }
+  }
+  if(fields & NODE_IPSTATE){
+    st->no_turbo = parse_node_value(req++);
+    st->max_perf_pct = parse_node_value(req++);
+    st->min_perf_pct = parse_node_value(req++);
+  }
+
+  if(setspeed.nreqs > 0){
+    exec_sysfs_batch(&setspeed);
+    for(i = 0; i < setspeed.nreqs; i++)
+      st->scaling_setspeed[setspeed_cpus[i]] = parse_node_value(&setspeed.reqs[i]);
+  }
+  sync_node_policies(st);
+
+  free_sysfs_batch(&batch);
+  free_sysfs_batch(&setspeed);
+  free(setspeed_cpus);
+
+  st->fields |= fields;
+
+  return ret;
+}
+
+// Get the power state of the node, reading only the groups of fields not
+// already loaded in this prolog/epilog, return NULL on failure
+struct node_state *get_node_state(int fields)
+{
+  struct node_state *st = &node_state;
+  long zero = 0;
+
+  fields &= ~st->fields;
+  if(fields == 0)
+    return st;
+
+  if(st->data == NULL && alloc_node_state(st, get_ncpus()) < 0){
+    slurm_info("Failed to allocate the node power state!\n");
+    return NULL;
+  }
+
+  if(fields & NODE_DRIVER){
+    char file[BUFFER_SIZE];
+
+    sprintf(file, PM_DRIVER, zero);
+    if(read_str_from_file(file, st->driver) < 0){
+      slurm_info("Failed to read the power driver of file '%s'!\n", file);
+      return NULL;
+    }
+    st->fields |= NODE_DRIVER;
+    fields &= ~NODE_DRIVER;
+  }
+
+  // The policies select the cpus accessing the cpufreq files
+  if((fields & (NODE_POLICY | NODE_CPUFREQ | NODE_CPUINFO)) && !(st->fields & NODE_POLICY)){
+    scan_node_policies(st);
+    st->fields |= NODE_POLICY;
+  }
+  fields &= ~NODE_POLICY;
+
+  if(fields != 0 && scan_node_state(st, fields) == -1)
+    return NULL;
+
+  return st;
+}
+
+// Release the state at the end of a prolog/epilog
+void free_node_state()
+{
+  release_node_state(&node_state);
+}
+
+// Write the node state in binary format
+int write_node_state(const char *file, struct node_state *st)
+{
+  struct node_state_header header;
+  size_t size = NODE_NARRAYS * st->ncpus * sizeof(int32_t);
+  char *data;
+  int ret = 0;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = NODE_STATE_MAGIC;
+  header.version = NODE_STATE_VERSION;
+  header.ncpus = st->ncpus;
+  header.fields = st->fields;
+  header.ngovernors = st->ngovernors;
+  header.no_turbo = st->no_turbo;
+  header.max_perf_pct = st->max_perf_pct;
+  header.min_perf_pct = st->min_perf_pct;
+  memcpy(header.governors, st->governors, sizeof(header.governors));
+  header.checksum = hash_fnv1a(st->data, size);
+
+  data = malloc(sizeof(header) + size);
+  if(data == NULL)
+    return -1;
+  memcpy(data, &header, sizeof(header));
+  memcpy(data + sizeof(header), st->data, size);
+
+  // The dumps of the jobs have predictable names in /tmp, they are never
+  // written through an existing file
+  if(write_file_atomic(file, data, sizeof(header) + size) < 0){
+    slurm_info("Failed to write the node power state to file '%s'!\n", file);
+    ret = -2;
+  }
+
+  free(data);
+
+  return ret;
+}
+
+static int read_node_state(const char *file, struct node_state *st)
+{
+  struct node_state_header header;
+  size_t size;
+  FILE *fd_dump;
+  long i;
+  int ret = 0;
+
+  fd_dump = fopen(file, "r");
+  if(fd_dump == NULL){
+    slurm_info("Failed to open the node state dump file '%s'!\n", file);
+    return -1;
+  }
+
+  if(fread(&header, sizeof(header), 1, fd_dump) != 1 ||
+     header.magic != NODE_STATE_MAGIC || header.version != NODE_STATE_VERSION ||
+     header.ngovernors < 0 || header.ngovernors > NODE_MAX_GOVERNORS){
+    slurm_info("The node state dump file '%s' is corrupted!\n", file);
+    fclose(fd_dump);
+    return -2;
+  }
+
+  memset(st, 0, sizeof(struct node_state));
+  if(alloc_node_state(st, header.ncpus) < 0){
+    fclose(fd_dump);
+    return -3;
+  }
+  size = NODE_NARRAYS * st->ncpus * sizeof(int32_t);
+
+  if(fread(st->data, size, 1, fd_dump) != 1 || fgetc(fd_dump) != EOF ||
+     header.checksum != hash_fnv1a(st->data, size)){
+    slurm_info("The node state dump file '%s' is corrupted!\n", file);
+    release_node_state(st);
+    ret = -4;
+  }
+  else{
+    st->fields = header.fields;
+    st->ngovernors = header.ngovernors;
+    st->no_turbo = header.no_turbo;
+    st->max_perf_pct = header.max_perf_pct;
+    st->min_perf_pct = header.min_perf_pct;
+    memcpy(st->governors, header.governors, sizeof(header.governors));
+    for(i = 0; i < st->ngovernors; i++)
+      st->governors[i][NODE_GOVERNOR_SIZE - 1] = '\0';
+    for(i = 0; i < st->ncpus; i++){
+      if(st->governor[i] >= st->ngovernors)
+        st->governor[i] = NODE_UNKNOWN;
+      if(st->policy[i] >= st->ncpus || st->policy[i] < NODE_UNKNOWN)
+        st->policy[i] = NODE_UNKNOWN;
+    }
+  }
+
+  fclose(fd_dump);
+
+  return ret;
+}
+
+static int add_node_write(struct sysfs_batch *batch, const char *format, long cpu, int32_t value)
+{
+  char file[BUFFER_SIZE];
+  char str[SYSFS_VALUE_SIZE];
+
+  sprintf(file, format, cpu);
+  sprintf(str, "%d", value);
+  return add_sysfs_req(batch, SYSFS_WRITE, file, str) < 0 ? -1 : 0;
+}
+
+// Queue the write of a numeric field if it has been dumped and, in delta
+// mode, if the job changed it
+static int restore_node_value(struct sysfs_batch *batch, const char *format, long cpu,
+  int32_t saved, int32_t current, long *nentries)
+{
+  if(saved == NODE_UNKNOWN)
+    return 0;
+  (*nentries)++;
+  if(pm_conf.delta_restore && saved == current)
+    return 0;
+
+  return add_node_write(batch, format, cpu, saved);
+}
+
+// Execute a stage of the restore, the writes of a batch are not ordered and
+// a limit can be refused until the other one is restored (e.g.
+// scaling_min_freq above scaling_max_freq), the failed writes are retried once
+// in a second batch
+static int exec_restore_batch(struct sysfs_batch *batch, const char *driver)
+{
+  struct sysfs_batch retry;
+  struct sysfs_req *req;
+  long i;
+  int ret = 0;
+
+  if(exec_sysfs_batch(batch) <= 0)
+    return 0;
+
+  init_sysfs_batch(&retry);
+  for(i = 0; i < batch->nreqs; i++){
+    req = &batch->reqs[i];
+    if(req->err != 0 && add_sysfs_req(&retry, SYSFS_WRITE, req->path, req->value) < 0)
+      ret = -1;
+  }
+
+  if(exec_sysfs_batch(&retry) > 0){
+    for(i = 0; i < retry.nreqs; i++){
+      req = &retry.reqs[i];
+      if(req->err != 0){
+        slurm_info("Failed to restore the %s driver '%s' with value '%s': %s!\n",
+          driver, req->path, req->value, strerror(-req->err));
+        ret = -1;
+      }
+    }
+  }
+  free_sysfs_batch(&retry);
+
+  return ret;
+}
+
+// Restore the node state of a dump file, first the governors, then the
+// frequency limits and last the speed steps of the userspace governor
+int restore_node_state(const char *file, const char *driver)
+{
+  struct node_state saved, *current = NULL;
+  struct sysfs_batch governors, limits, setspeed;
+  char path[BUFFER_SIZE];
+  long cpu, nentries = 0, nwritten;
+  int32_t gov;
+  int ret = 0;
+
+  if(read_node_state(file, &saved) < 0)
+    return -1;
+
+  // The current state is needed only to skip the unchanged files
+  if(pm_conf.delta_restore){
+    current = get_node_state(saved.fields & (NODE_CPUFREQ | NODE_IPSTATE));
+    if(current == NULL || current->ncpus != saved.ncpus){
+      slurm_info("Failed to read the current power state, restoring all the %s entries!\n",
+        driver);
+      current = NULL;
+    }
+  }
+  if(current == NULL && saved.ncpus != get_ncpus()){
+    slurm_info("The %s dump file '%s' has %ld cpus instead of %ld!\n", driver, file,
+      saved.ncpus, get_ncpus());
+    release_node_state(&saved);
+    return -2;
+  }
+
+  init_sysfs_batch(&governors);
+  init_sysfs_batch(&limits);
+  init_sysfs_batch(&setspeed);
+
+  // Only the policies pinned by a shared job
+  for(cpu = 0; cpu < saved.ncpus && (saved.fields & NODE_CPUFREQ); cpu++){
+    if(!job_owns_policy(&saved, cpu) || !is_policy_leader(&saved, cpu))
+      continue;
+    gov = saved.governor[cpu];
+    if(gov != NODE_UNKNOWN){
+      nentries++;
+      if(current == NULL || current->governor[cpu] == NODE_UNKNOWN ||
+         strcmp(current->governors[current->governor[cpu]], saved.governors[gov]) != 0){
+        sprintf(path, PM_GOVERNOR, cpu);
+        ret |= add_sysfs_req(&governors, SYSFS_WRITE, path, saved.governors[gov]) < 0;
+      }
+    }
+    ret |= restore_node_value(&limits, PM_SCALING_MAX_FREQ, cpu, saved.scaling_max_freq[cpu],
+      current ? current->scaling_max_freq[cpu] : NODE_UNKNOWN, &nentries);
+    ret |= restore_node_value(&limits, PM_SCALING_MIN_FREQ, cpu, saved.scaling_min_freq[cpu],
+      current ? current->scaling_min_freq[cpu] : NODE_UNKNOWN, &nentries);
+    ret |= restore_node_value(&setspeed, PM_CPUFREQ_SCALING_SETSPEED, cpu,
+      saved.scaling_setspeed[cpu], current ? current->scaling_setspeed[cpu] : NODE_UNKNOWN,
+      &nentries);
+  }
+  if((saved.fields & NODE_IPSTATE) && !job_cpuset.shared){
+    ret |= restore_node_value(&limits, PM_IPSTATE_NO_TURBO, 0, saved.no_turbo,
+      current ? current->no_turbo : NODE_UNKNOWN, &nentries);
+    ret |= restore_node_value(&limits, PM_IPSTATE_MAX_PERF_PCT, 0, saved.max_perf_pct,
+      current ? current->max_perf_pct : NODE_UNKNOWN, &nentries);
+    ret |= restore_node_value(&limits, PM_IPSTATE_MIN_PERF_PCT, 0, saved.min_perf_pct,
+      current ? current->min_perf_pct : NODE_UNKNOWN, &nentries);
+  }
+
+  if(ret != 0){
+    slurm_info("Failed to allocate the %s restore requests!\n", driver);
+    ret = -3;
+  }
+  else{
+    if(exec_restore_batch(&governors, driver) < 0)
+      ret = -4;
+    if(exec_restore_batch(&limits, driver) < 0)
+      ret = -5;
+    if(exec_restore_batch(&setspeed, driver) < 0)
+      ret = -6;
+  }
+
+  nwritten = governors.nreqs + limits.nreqs + setspeed.nreqs;
+  if(pm_conf.delta_restore)
+    slurm_info("Restored %ld of %ld %s entries!\n", nwritten, nentries, driver);
+
+  free_sysfs_batch(&governors);
+  free_sysfs_batch(&limits);
+  free_sysfs_batch(&setspeed);
+  release_node_state(&saved);
+
+  return ret;
+}
@@ -0,0 +1,297 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+#include "pm_msrsafe.h"
+
+// Owner changed by a kind of request at SET, restored to the slurm daemon
+// at RESET
+#define PERM_OWNER_NONE 0
+#define PERM_OWNER_USER 1
+#define PERM_OWNER_GROUP 2
+
+// Permission bits set and reset by each kind of request
+static const struct {
+  mode_t set;
+  mode_t reset;
+  int owner;
+  const char *name;
+} perm_kinds[] = {
+  [PERM_READ] = { S_IROTH, S_IROTH, PERM_OWNER_NONE, "read" },
+  [PERM_READ_WRITE] = { S_IROTH | S_IWOTH, S_IROTH | S_IWOTH, PERM_OWNER_NONE, "read/write" },
+  [PERM_READ_NO_WRITE] = { S_IROTH | S_IWOTH, S_IWOTH, PERM_OWNER_NONE, "read/write" },
+  [PERM_JOB_READ] = { S_IRGRP, S_IROTH | S_IWOTH, PERM_OWNER_GROUP, "job read" },
+  [PERM_JOB_READ_WRITE] = { S_IRUSR | S_IWUSR, S_IROTH | S_IWOTH, PERM_OWNER_USER,
+    "job read/write" },
+};
+
+struct perm_worker {
+  pthread_t thread;
+  struct perm_req *reqs;
+  long nreqs;
+  int conf;
+  uid_t uid;
+  gid_t gid;
+  long nopen;
+  long nclose;
+  long nstat;
+  long nchmod;
+  long nchown;
+};
+
+void init_perm_list(struct perm_list *list)
+{
+  list->reqs = NULL;
+  list->nreqs = 0;
+  list->size = 0;
+  list->uid = getuid();
+  list->gid = getgid();
+}
+
+int add_perm(struct perm_list *list, int kind, const char *file)
+{
+  struct perm_req *tmp;
+
+  if(list->nreqs == list->size){
+    list->size = list->size == 0 ? 64 : list->size * 2;
+    tmp = realloc(list->reqs, list->size * sizeof(struct perm_req));
+    if(tmp == NULL)
+      return -1;
+    list->reqs = tmp;
+  }
+
+  list->reqs[list->nreqs].path = strdup(file);
+  if(list->reqs[list->nreqs].path == NULL)
+    return -1;
+  list->reqs[list->nreqs].kind = kind;
+  list->reqs[list->nreqs].ret = 0;
+  list->nreqs++;
+
+  return 0;
+}
+
+void free_perm_list(struct perm_list *list)
+{
+  long i;
+
+  for(i = 0; i < list->nreqs; i++)
+    free(list->reqs[i].path);
+  free(list->reqs);
+  init_perm_list(list);
+}
+
+// Length of the longest directory containing all the files of the worker,
+// 0 for '/'. The path of each file continues with '/' after it
+static size_t common_dir_len(struct perm_req *reqs, long nreqs)
+{
+  const char *first = reqs[0].path;
+  size_t len = strrchr(first, '/') - first;
+  long i;
+
+  for(i = 1; i < nreqs && len > 0; i++)
+    while(len > 0 && (strncmp(reqs[i].path, first, len) != 0 || reqs[i].path[len] != '/'))
+      len = (char *) memrchr(first, '/', len) - first;
+
+  return len;
+}
+
+static void *perm_worker_run(void *arg)
+{
+  struct perm_worker *w = (struct perm_worker *) arg;
+  char dir[BUFFER_SIZE];
+  struct perm_req *req;
+  struct stat info;
+  uid_t uid;
+  gid_t gid;
+  mode_t mode;
+  char *name;
+  size_t len;
+  long i;
+  int fd_dir;
+
+  if(w->nreqs <= 0)
+    return NULL;
+
+  // All the files are accessed relatively to their common directory, e.g.
+  // /dev/cpu for the MSR_SAFE files
+  len = common_dir_len(w->reqs, w->nreqs);
+  memcpy(dir, w->reqs[0].path, len);
+  dir[len] = '\0';
+  fd_dir = open(len == 0 ? "/" : dir, O_PATH | O_DIRECTORY);
+  w->nopen++;
+
+  for(i = 0; i < w->nreqs; i++){
+    req = &w->reqs[i];
+    name = req->path + len + 1;
+
+    if(fd_dir < 0 || fstatat(fd_dir, name, &info, 0) < 0){
+      req->ret = (fd_dir < 0 || errno == ENOENT) ? -1 : -2;
+      if(fd_dir >= 0)
+        w->nstat++;
+      continue;
+    }
+    w->nstat++;
+
+    mode = info.st_mode & 07777;
+    if(w->conf == SET)
+      mode |= perm_kinds[req->kind].set;
+    else if(w->conf == RESET)
+      mode &= ~perm_kinds[req->kind].reset;
+
+    // The files of a job are owned by its user or its group, the owner can
+    // change their mode until the epilog gives them back to the daemon
+    uid = info.st_uid;
+    gid = info.st_gid;
+    if(perm_kinds[req->kind].owner != PERM_OWNER_NONE){
+      if(w->conf == RESET){
+        uid = getuid();
+        gid = getgid();
+        // The group read of a read-only job
+        if(info.st_gid != gid)
+          mode &= ~(S_IRGRP | S_IWGRP);
+      }
+      else if(perm_kinds[req->kind].owner == PERM_OWNER_USER)
+        uid = w->uid;
+      else
+        gid = w->gid;
+    }
+    if(uid != info.st_uid || gid != info.st_gid){
+      w->nchown++;
+      if(fchownat(fd_dir, name, uid, gid, AT_SYMLINK_NOFOLLOW) != 0){
+        req->ret = -3;
+        continue;
+      }
+    }
+
+    // Skip the files that already have the requested permissions
+    if(mode == (info.st_mode & 07777))
+      continue;
+
+    w->nchmod++;
+    if(fchmodat(fd_dir, name, mode, 0) != 0)
+      req->ret = -3;
+  }
+
+  if(fd_dir >= 0){
+    close(fd_dir);
+    w->nclose++;
+  }
+
+  return NULL;
+}
+
+// Set or reset the permissions of all the files in the list spreading the work
+// over the worker threads, the files of each worker are accessed relatively to
+// a single descriptor of their common directory
+int apply_permissions(struct perm_list *list, int conf, const char *phase)
+{
+  long i, nworkers, chunk, nopen = 0, nclose = 0, nstat = 0, nchmod = 0, nchown = 0;
+  struct perm_worker *workers;
+  int ret = 0;
+#ifdef SLURM_SPANK_DEBUG
+  struct timespec begin, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+#endif // SLURM_SPANK_DEBUG
+
+  // Without the threads argument a worker for each PERM_MIN_FILES_PER_WORKER
+  // files, at most one for each online cpu
+  nworkers = list->nreqs / PERM_MIN_FILES_PER_WORKER;
+  if(pm_conf.nthreads > 0 && nworkers > pm_conf.nthreads)
+    nworkers = pm_conf.nthreads;
+  if(nworkers > get_nonline())
+    nworkers = get_nonline();
+  if(nworkers < 1)
+    nworkers = 1;
+
+  workers = calloc(nworkers, sizeof(struct perm_worker));
+  if(workers == NULL)
+    return -1;
+
+  chunk = (list->nreqs + nworkers - 1) / nworkers;
+  for(i = 0; i < nworkers; i++){
+    workers[i].reqs = &list->reqs[i * chunk];
+    workers[i].nreqs = (i + 1) * chunk < list->nreqs ? chunk : list->nreqs - i * chunk;
+    if(workers[i].nreqs < 0)
+      workers[i].nreqs = 0;
+    workers[i].conf = conf;
+    workers[i].uid = list->uid;
+    workers[i].gid = list->gid;
+    // The first chunk is handled by the current thread
+    if(i > 0 && pthread_create(&workers[i].thread, NULL, perm_worker_run, &workers[i]) != 0){
+      perm_worker_run(&workers[i]);
+      workers[i].conf = -1;
+    }
+  }
+  perm_worker_run(&workers[0]);
+
+  for(i = 0; i < nworkers; i++){
+    if(i > 0 && workers[i].conf != -1)
+      pthread_join(workers[i].thread, NULL);
+    nopen += workers[i].nopen;
+    nclose += workers[i].nclose;
+    nstat += workers[i].nstat;
+    nchmod += workers[i].nchmod;
+    nchown += workers[i].nchown;
+  }
+  free(workers);
+  STAT_ADD(nsyscalls, nopen + nclose + nstat + nchmod + nchown);
+
+  for(i = 0; i < list->nreqs; i++){
+    switch(list->reqs[i].ret){
+      case 0:
+        continue;
+      case -1:
+        slurm_info("'%s' does not exist!\n", list->reqs[i].path);
+        break;
+      case -2:
+        slurm_info("Failed to read the permissions of file '%s'!\n", list->reqs[i].path);
+        break;
+      default:
+        slurm_info("Failed to set the %s permission of file '%s'!\n",
+          perm_kinds[list->reqs[i].kind].name, list->reqs[i].path);
+        break;
+    }
+    ret = -2;
+  }
+
+#ifdef SLURM_SPANK_DEBUG
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  slurm_info("Permissions of %s: %ld files, %ld syscalls (%ld open, %ld close, %ld stat,"
+    " %ld chmod, %ld chown) in %.3f ms with %ld threads\n", phase, list->nreqs,
+    nopen + nclose + nstat + nchmod + nchown, nopen, nclose, nstat, nchmod, nchown,
+    (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6, nworkers);
+#endif // SLURM_SPANK_DEBUG
+
+  return ret;
+}
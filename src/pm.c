@@ -37,17 +37,15 @@ Author: Daniele Cesarini, University of Bologna
 // Configure the power manager of the system
 int set_pm(int conf)
 {
-  char file[BUFFER_SIZE];
-  char data[BUFFER_SIZE];
-  long zero = 0;
+  struct node_state *st;
+  char *data;
   int ret = 0;
 
   // Read the power driver
-  sprintf(file, PM_DRIVER, zero);
-  if(read_str_from_file(file, data) < 0){
-    slurm_info("Failed to read the power driver of file '%s'!\n", file);
+  st = get_node_state(NODE_DRIVER);
+  if(st == NULL)
     return -1;
-  }
+  data = st->driver;
 
   // Identify the routine for the power driver
   if(strncmp(data, "acpi-cpufreq", strlen("acpi-cpufreq")) == 0 ||  // intel_pstate=disable
@@ -36,16 +36,26 @@ Author: Daniele Cesarini, University of Bologna
 
 SPANK_PLUGIN(pm_msrsafe, 1);
 
-#ifdef SLURM_SPANK_TEST
+// The benchmark has its own main (see bench.c)
+#if defined(SLURM_SPANK_TEST) && !defined(SLURM_SPANK_BENCH)
 int main(int argc, char **argv)
 {
   spank_t spank_ctx = NULL;
   int prolog = FALSE;
   int epilog = FALSE;
-  int i;
+  int baseline = FALSE;
+  int table = FALSE;
+  char *inspect = NULL, *samples = NULL, *convert[2] = {NULL, NULL};
+  char samples_file[BUFFER_SIZE + 32];
+  long sampling = 0;
+  char *args[argc + 1];
+  int i, nargs = 0;
 
   for(i = 1; i < argc; i++){
-    if(argv[i][0] == '-'){
+    // Plugin arguments as in plugstack.conf
+    if(argv[i][0] != '-')
+      args[nargs++] = argv[i];
+    else{
       switch(argv[i][1]){
         case 'p':
           prolog = TRUE;
@@ -53,47 +63,258 @@ int main(int argc, char **argv)
         case 'e':
           epilog = TRUE;
           break;
+        case 'b':
+          baseline = TRUE;
+          break;
+        case 'f':
+          table = TRUE;
+          break;
+        case 'i':
+          if(i + 1 < argc)
+            inspect = argv[++i];
+          break;
+        case 's':
+          if(i + 1 < argc)
+            sampling = atol(argv[++i]);
+          break;
+        case 'r':
+          if(i + 1 < argc)
+            samples = argv[++i];
+          break;
+        case 'c':
+          if(i + 2 < argc){
+            convert[0] = argv[++i];
+            convert[1] = argv[++i];
+          }
+          break;
         default:
           break;
       }
     }
   }
 
+  // Refresh the baseline of the node (baseline=on is implied)
+  if(baseline){
+    char baseline_arg[] = "baseline=on";
+    args[nargs++] = baseline_arg;
+    parse_plugin_args(nargs, args);
+    if(capture_baseline(TRUE) < 0)
+      printf("Failed to refresh the baseline in '%s'!\n", PM_BASELINE_DIR);
+  }
+
   if(prolog)
-    slurm_spank_job_prolog(spank_ctx, 0, NULL);
+    slurm_spank_job_prolog(spank_ctx, nargs, args);
 
   if(epilog)
-    slurm_spank_job_epilog(spank_ctx, 0, NULL);
+    slurm_spank_job_epilog(spank_ctx, nargs, args);
+
+  if(inspect != NULL)
+    print_msr_dump(inspect);
+
+  if(table){
+    struct freq_table *ft;
+    char str[BUFFER_SIZE];
+
+    parse_plugin_args(nargs, args);
+    ft = get_freq_table(TRUE);
+    if(ft == NULL || format_freq_table(ft, str, sizeof(str)) < 0)
+      printf("Failed to build the frequency table of the node!\n");
+    else
+      printf("%s=\"%s\"\n", FREQ_TABLE_ENV, str);
+  }
 
-  if(prolog == FALSE && epilog == FALSE){
+  // Run the sampler in the background for some seconds
+  if(sampling > 0){
+    parse_plugin_args(nargs, args);
+    if(pm_conf.sampler_rate == 0)
+      pm_conf.sampler_rate = 10;
+    snprintf(samples_file, sizeof(samples_file), "%s/pm_msrsafe.test.samples",
+      pm_conf.sampler_dir);
+    if(start_sampler(samples_file) < 0)
+      printf("Failed to start the sampler!\n");
+    else{
+      sleep(sampling);
+      stop_sampler();
+      print_samples(samples_file);
+    }
+  }
+
+  if(samples != NULL)
+    print_samples(samples);
+
+  if(convert[0] != NULL){
+    if(convert_msr_dump(convert[0], convert[1]) < 0)
+      printf("Failed to convert '%s' to '%s'!\n", convert[0], convert[1]);
+  }
+
+  if(prolog == FALSE && epilog == FALSE && baseline == FALSE && inspect == NULL &&
+     table == FALSE && sampling == 0 && samples == NULL && convert[0] == NULL){
     printf("Missing parameters:\n");
     printf("  '-p': prolog test\n");
     printf("  '-e': epilog test\n");
+    printf("  '-b': capture again the baseline of the node\n");
+    printf("  '-f': print the frequency table of the node\n");
+    printf("  '-i <dump>': print a binary MSR dump in text format\n");
+    printf("  '-c <text dump> <dump>': convert a text MSR dump to binary format\n");
+    printf("  '-s <seconds>': run the sampler and print the samples\n");
+    printf("  '-r <samples>': print a samples file\n");
+    printf("  'key=value': plugin argument as in plugstack.conf\n");
   }
 
   return 0;
 }
-#endif // SLURM_SPANK_TEST
+#endif // SLURM_SPANK_TEST && !SLURM_SPANK_BENCH
 
 static void cleanup_dumps()
 {
+  // Only the files of the job on shared nodes, the restored registers of the
+  // job are copied in the reference of the drift check
+  if(job_cpuset.shared){
+    if(pm_conf.drift != DRIFT_OFF)
+      refresh_drift_reference(MSRSAFE_DUMP);
+    remove(MSRSAFE_DUMP);
+    remove(PM_UNCORE_DUMP);
+    remove(job_cpuset.cpufreq_dump);
+    remove(job_cpuset.file);
+    return;
+  }
+
+  // The baseline is kept for the next jobs
+  if(baseline_enabled()){
+    remove(PM_STARTED);
+    return;
+  }
+
   remove(PM_IPSTATE_DUMP);
   remove(PM_CPUFREQ_DUMP);
-  remove(MSRSAFE_DUMP);
+  remove(PM_UNCORE_DUMP);
+  remove(PM_HWP_DUMP);
+
+  // The restored MSRs are the reference of the next drift check
+  if(pm_conf.drift == DRIFT_OFF || rename(MSRSAFE_DUMP, MSRSAFE_REFERENCE) < 0)
+    remove(MSRSAFE_DUMP);
+}
+
+// Return a negative value if the node has to be drained
+static int check_drift(const char *hostname)
+{
+  int phase;
+  long ndrifts;
+
+  if(pm_conf.drift == DRIFT_OFF)
+    return 0;
+
+  phase = phase_begin("check_msr_drift");
+  ndrifts = check_msr_drift();
+  phase_end(phase);
+
+  if(ndrifts > 0 && pm_conf.drift == DRIFT_DRAIN){
+    slurm_info("The MSRs of the node '%s' drifted from the reference configuration. "
+      "Failing the prolog to drain the node!\n", hostname);
+    return -1;
+  }
+
+  return 0;
 }
 
 int slurm_spank_init(spank_t spank_ctx, int argc, char **argv)
 {
     slurm_info("Loaded spank PM_MSRSAFE plugin.\n");
+    if(parse_plugin_args(argc, argv) < 0)
+      slurm_info("Invalid arguments of spank PM_MSRSAFE plugin in plugstack.conf!\n");
+    register_job_options(spank_ctx);
     return 0;
 }
 
 int slurm_spank_slurmd_init(spank_t spank_ctx, int argc, char **argv)
 {
     slurm_info("Loaded spank PM_MSRSAFE plugin.\n");
+    parse_plugin_args(argc, argv);
+
+    // Compile the MSR_SAFE whitelist once for all the jobs
+    if(build_whitelist_cache() < 0)
+      slurm_info("Failed to build the MSR_SAFE whitelist cache '%s'!\n", MSRSAFE_WL_CACHE);
+
+    // Parse the online cpus and their topology once for all the jobs
+    if(build_topology_cache() < 0)
+      slurm_info("Failed to build the topology cache '%s'!\n", PM_TOPOLOGY_CACHE);
+
+    // Decode the frequencies of the node once per boot
+    if(get_freq_table(TRUE) == NULL)
+      slurm_info("Failed to build the frequency table of the node!\n");
+
+    // Capture the configuration restored after each job
+    if(pm_conf.baseline && capture_baseline(FALSE) < 0)
+      slurm_info("Failed to capture the baseline of the node in '%s'!\n", PM_BASELINE_DIR);
+
+    // Do not keep the MSR_SAFE files open in slurmd
+    free_msr_context();
+
     return 0;
 }
 
+// Export the frequency table and start the sampler of the step, the plugin
+// arguments are parsed by slurm_spank_init() in the same process
+int slurm_spank_user_init(spank_t spank_ctx, int argc, char **argv)
+{
+  char file[BUFFER_SIZE];
+  char table[BUFFER_SIZE];
+  struct freq_table *ft;
+
+  // Frequencies of the node for the runtimes of all the jobs
+  ft = get_freq_table(FALSE);
+  if(ft != NULL && format_freq_table(ft, table, sizeof(table)) == 0)
+    spank_setenv(spank_ctx, FREQ_TABLE_ENV, table, 1);
+
+  if(pm_conf.sampler_rate == 0 || check_enable_step(spank_ctx) < 0)
+    return 0;
+
+  // Cpus of the job saved by the prolog on shared nodes
+  if(pm_conf.shared && load_job_cpuset(RESET) < 0){
+    slurm_info("Failed to start the sampler of the step!\n");
+    return 0;
+  }
+
+  if(get_samples_file(spank_ctx, file) < 0 || start_sampler(file) < 0)
+    slurm_info("Failed to start the sampler of the step!\n");
+  free_job_cpuset();
+  free_topology();
+
+  return 0;
+}
+
+// Stop the sampler when the last local task of the step exits
+int slurm_spank_task_exit(spank_t spank_ctx, int argc, char **argv)
+{
+  static uint32_t nexited = 0;
+  uint32_t ntasks;
+
+  if(spank_get_item(spank_ctx, S_JOB_LOCAL_TASK_COUNT, &ntasks) != ESPANK_SUCCESS ||
+     ++nexited >= ntasks)
+    stop_sampler();
+
+  return 0;
+}
+
+int slurm_spank_exit(spank_t spank_ctx, int argc, char **argv)
+{
+  stop_sampler();
+  return 0;
+}
+
+// Every exit of the prolog and of the epilog writes the report of the hook
+// and releases the caches of the process
+static int end_hook(int ret)
+{
+  report_end(ret);
+  free_node_state();
+  free_job_cpuset();
+  free_topology();
+  free_msr_context();
+
+  return ret;
+}
+
 int slurm_spank_job_prolog(spank_t spank_ctx, int argc, char **argv)
 {
   int ret = 0;
@@ -101,49 +322,110 @@ int slurm_spank_job_prolog(spank_t spank_ctx, int argc, char **argv)
 
   gethostname(hostname, sizeof(hostname));
 
+  // The job prolog runs in its own process
+  parse_plugin_args(argc, argv);
+
+  report_begin("prolog");
+
+  // Check that the MSRs did not drift since the last epilog or the baseline,
+  // also for the jobs not using the plugin. On shared nodes only the cpus of
+  // the job are checked, after they are loaded
+  if(!pm_conf.shared && check_drift(hostname) < 0)
+    return end_hook(-4);
+
+  // Energy accounting of all the jobs
+  if(pm_conf.energy_dir[0] != '\0'){
+    int phase = phase_begin("rapl_snapshot");
+    if(rapl_snapshot() < 0)
+      slurm_info("Failed to save the RAPL energy counters of the node '%s'!\n", hostname);
+    phase_end(phase);
+  }
+
 #ifndef SLURM_SPANK_TEST
   // Check if the job wants to use PM_MSRSAFE plugin
   if(check_enable_plugin() < 0){
     slurm_info("Spank PM_MSRSAFE plugin is not enabled by job user on the node '%s'. Exit!\n",
       hostname);
-    return 0;
+    return end_hook(0);
   }
   else
     slurm_info("Running spank PM_MSRSAFE plugin on the node '%s'!\n", hostname);
 
-  // Check if the job is exclusive on the node
-  if(check_exclusive_node(spank_ctx) < 0){
+  // Check if the job is exclusive on the node, shared nodes are managed only
+  // on the cpus of the job
+  if(!pm_conf.shared && check_exclusive_node(spank_ctx) < 0){
     slurm_info("This node is not exclusive! Power management cannot be allowed on node '%s'. Exit!\n",
       hostname);
-    return 0;
+    return end_hook(0);
   }
 #endif // SLURM_SPANK_TEST
 
+  // Cpus of the job on shared nodes
+  if(pm_conf.shared && load_job_cpuset(SET) < 0){
+    slurm_info("Failed to read the cpus of the job! Power management cannot be allowed on node '%s'. Exit!\n",
+      hostname);
+    return end_hook(0);
+  }
+  if(pm_conf.shared && check_drift(hostname) < 0){
+    remove(job_cpuset.file);
+    return end_hook(-4);
+  }
+
+  // The epilog restores the baseline only after a prolog
+  if(baseline_enabled() && mark_plugin_started() < 0)
+    ret = -3;
+
   // Configure MSRSAFE
   if(set_msrsafe(SET) < 0){
     ret = -1;
   }
 
-  // Configure OS power manager
-  if(set_pm(SET) < 0){
+  // Configure OS power manager, its settings are global for the node
+  if(!job_cpuset.shared && set_pm(SET) < 0){
     ret = -2;
   }
 
-  return ret;
+  // Frequencies requested by the job, after the power manager
+  if(apply_job_options(spank_ctx) < 0){
+    ret = -5;
+  }
+
+  return end_hook(ret);
 }
 
 int slurm_spank_job_epilog(spank_t spank_ctx, int argc, char **argv)
 {
-  int ret = 0;
+  int ret = 0, cpuset_ret;
   char hostname[BUFFER_SIZE];
 
   gethostname(hostname, sizeof(hostname));
 
+  // The job epilog runs in its own process
+  parse_plugin_args(argc, argv);
+
+  report_begin("epilog");
+
+  // Cpus of the job saved by the prolog on shared nodes
+  cpuset_ret = pm_conf.shared ? load_job_cpuset(RESET) : 0;
+
+  // Energy accounting of all the jobs, on shared nodes only of the packages
+  // owned by the job if its cpus are known
+  if(pm_conf.energy_dir[0] != '\0'){
+    int phase = phase_begin("rapl_account");
+    rapl_account();
+    phase_end(phase);
+  }
+
+  if(cpuset_ret < 0){
+    slurm_info("Failed to read the cpus of the job on the node '%s'. Exit!\n", hostname);
+    return end_hook(0);
+  }
+
   // Check if spank PM_MSRSAFE plugin started
   if(check_plugin_started() < 0){
     slurm_info("Spank PM_MSRSAFE did not run on the node '%s'. Exit!\n",
       hostname);
-    return 0;
+    return end_hook(0);
   }
 #ifndef SLURM_SPANK_TEST
   else
@@ -156,12 +438,17 @@ int slurm_spank_job_epilog(spank_t spank_ctx, int argc, char **argv)
   }
 
   // Reset OS power manager
-  if(set_pm(RESET) < 0){
+  if(!job_cpuset.shared && set_pm(RESET) < 0){
+    ret = -2;
+  }
+
+  // Only the cpufreq policies pinned by --cpu-freq-pm on shared nodes
+  if(job_cpuset.shared && restore_job_cpufreq() < 0){
     ret = -2;
   }
 
   // Remove dump files
   cleanup_dumps();
 
-  return ret;
+  return end_hook(ret);
 }
@@ -0,0 +1,413 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+
+#include "pm_msrsafe.h"
+
+// Registers read on each package: units, power info and the energy domains
+#define RAPL_NOPS (RAPL_NDOMAINS + 2)
+
+static const uint32_t rapl_msrs[RAPL_NDOMAINS] = {
+  MSR_PKG_ENERGY_STATUS,
+  MSR_DRAM_ENERGY_STATUS,
+  MSR_PP0_ENERGY_STATUS,
+};
+
+static const char *rapl_names[RAPL_NDOMAINS] = { "pkg", "dram", "pp0" };
+
+static int64_t now_ns()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Xeon server processors with a fixed DRAM energy unit, ignoring the unit
+// of MSR_RAPL_POWER_UNIT
+static const int rapl_dram_server_models[] = {
+  0x3f,                                 // Haswell-X
+  0x4f,                                 // Broadwell-X
+  0x56,                                 // Broadwell-DE
+  0x55,                                 // Skylake-X, Cascade Lake and Cooper Lake
+  0x6a,                                 // Ice Lake-X
+  0x6c,                                 // Ice Lake-D
+  0x8f,                                 // Sapphire Rapids
+  0xcf,                                 // Emerald Rapids
+  0xad,                                 // Granite Rapids-X
+  0xae,                                 // Granite Rapids-D
+  0x57,                                 // Xeon Phi Knights Landing
+  0x85,                                 // Xeon Phi Knights Mill
+};
+
+static uint32_t rapl_dram_unit(uint32_t unit)
+{
+  struct cpu_model *model = get_cpu_model();
+  long i;
+
+  if(!model->intel || model->family != 6)
+    return unit;
+  for(i = 0; i < sizeof(rapl_dram_server_models) / sizeof(rapl_dram_server_models[0]); i++)
+    if(rapl_dram_server_models[i] == model->model)
+      return RAPL_DRAM_SERVER_UNIT;
+
+  return unit;
+}
+
+// Snapshot of the job in the environment
+static int rapl_snapshot_file(char *file, uint32_t *job_id)
+{
+  const char *env_job_id = getenv("SLURM_JOB_ID");
+
+  if(env_job_id == NULL){
+    slurm_info("Failed to read the job id of the RAPL snapshot!\n");
+    return -1;
+  }
+  *job_id = strtoul(env_job_id, NULL, 10);
+  snprintf(file, BUFFER_SIZE, PM_RAPL_SNAPSHOT, *job_id);
+
+  return 0;
+}
+
+// Read the units, the thermal design power and the energy counters of each
+// package with one batch, return the number of packages
+static long read_rapl(struct rapl_sample **samples)
+{
+  struct rapl_sample *s;
+  struct msr_batch_op *ops, *op;
+  uint32_t *cpus, *pkgs, unit, power_unit;
+  long i, d, npkgs;
+
+  npkgs = get_package_leaders(&cpus, &pkgs);
+  if(npkgs < 0)
+    return -1;
+
+  s = calloc(npkgs, sizeof(struct rapl_sample));
+  ops = malloc(npkgs * RAPL_NOPS * sizeof(struct msr_batch_op));
+  if(s == NULL || ops == NULL){
+    free(s);
+    free(ops);
+    free(cpus);
+    free(pkgs);
+    return -1;
+  }
+
+  for(i = 0; i < npkgs; i++){
+    s[i].pkg = pkgs[i];
+    s[i].cpu = cpus[i];
+    for(d = 0; d < RAPL_NOPS; d++){
+      op = &ops[i * RAPL_NOPS + d];
+      op->cpu = cpus[i];
+      op->isrdmsr = TRUE;
+      op->err = 0;
+      if(d == 0)
+        op->msr = MSR_RAPL_POWER_UNIT;
+      else if(d == 1)
+        op->msr = MSR_PKG_POWER_INFO;
+      else
+        op->msr = rapl_msrs[d - 2];
+      op->msrdata = 0;
+      op->wmask = 0;
+    }
+  }
+  free(cpus);
+  free(pkgs);
+
+  exec_msr_batch(ops, npkgs * RAPL_NOPS);
+
+  for(i = 0; i < npkgs; i++){
+    op = &ops[i * RAPL_NOPS];
+    if(op[0].err != 0)
+      continue;
+    // Energy status units, bits 12:8, and power units, bits 3:0
+    unit = (op[0].msrdata >> 8) & 0x1f;
+    power_unit = op[0].msrdata & 0xf;
+    for(d = 0; d < RAPL_NDOMAINS; d++)
+      s[i].unit[d] = d == RAPL_DRAM ? rapl_dram_unit(unit) : unit;
+    // Thermal design power, bits 14:0
+    if(op[1].err == 0)
+      s[i].tdp_w = (op[1].msrdata & 0x7fff) >> power_unit;
+    for(d = 0; d < RAPL_NDOMAINS; d++){
+      if(op[d + 2].err == 0){
+        s[i].energy[d] = op[d + 2].msrdata & 0xffffffff;
+        s[i].valid |= 1 << d;
+      }
+    }
+  }
+
+  free(ops);
+  *samples = s;
+
+  return npkgs;
+}
+
+// Save the energy counters of all the packages at the beginning of the job
+int rapl_snapshot()
+{
+  struct rapl_snapshot_header header;
+  struct rapl_sample *samples;
+  char file[BUFFER_SIZE];
+  size_t size;
+  long npkgs;
+  char *data;
+  int ret = 0;
+
+  memset(&header, 0, sizeof(header));
+  if(rapl_snapshot_file(file, &header.job_id) < 0)
+    return -1;
+  header.time_ns = now_ns();
+
+  npkgs = read_rapl(&samples);
+  if(npkgs < 0){
+    slurm_info("Failed to read the RAPL energy counters!\n");
+    return -1;
+  }
+
+  header.magic = RAPL_SNAPSHOT_MAGIC;
+  header.version = RAPL_SNAPSHOT_VERSION;
+  header.npkgs = npkgs;
+  header.checksum = hash_fnv1a(samples, npkgs * sizeof(struct rapl_sample));
+
+  size = sizeof(header) + npkgs * sizeof(struct rapl_sample);
+  data = malloc(size);
+  if(data == NULL){
+    free(samples);
+    return -2;
+  }
+  memcpy(data, &header, sizeof(header));
+  memcpy(data + sizeof(header), samples, npkgs * sizeof(struct rapl_sample));
+
+  // A stale snapshot of a requeued job, or a file created by a user, is
+  // replaced and never written through
+  if(write_file_atomic(file, data, size) < 0){
+    slurm_info("Failed to write the RAPL snapshot '%s'!\n", file);
+    ret = -3;
+  }
+
+  free(data);
+  free(samples);
+
+  return ret;
+}
+
+// Load the snapshot of the prolog of the job, return the number of packages
+static long load_rapl_snapshot(const char *file, uint32_t job_id,
+  struct rapl_snapshot_header *header, struct rapl_sample **samples)
+{
+  struct rapl_sample *s;
+  FILE *fd_snap;
+  int fd;
+
+  fd = open_baseline_file(file);
+  if(fd < 0)
+    return -1;
+  fd_snap = fdopen(fd, "r");
+  if(fd_snap == NULL){
+    close(fd);
+    return -1;
+  }
+
+  if(fread(header, sizeof(struct rapl_snapshot_header), 1, fd_snap) != 1 ||
+     header->magic != RAPL_SNAPSHOT_MAGIC || header->version != RAPL_SNAPSHOT_VERSION ||
+     header->job_id != job_id){
+    fclose(fd_snap);
+    return -2;
+  }
+
+  s = malloc(header->npkgs * sizeof(struct rapl_sample));
+  if(s == NULL && header->npkgs > 0){
+    fclose(fd_snap);
+    return -3;
+  }
+  if(fread(s, sizeof(struct rapl_sample), header->npkgs, fd_snap) != header->npkgs ||
+     header->checksum != hash_fnv1a(s, header->npkgs * sizeof(struct rapl_sample))){
+    free(s);
+    fclose(fd_snap);
+    return -2;
+  }
+  fclose(fd_snap);
+
+  *samples = s;
+
+  return header->npkgs;
+}
+
+// Energy in joules between two reads of a 32-bit counter, a single
+// wraparound is handled
+static double rapl_energy(uint64_t begin, uint64_t end, uint32_t unit)
+{
+  return (double) ((end - begin) & 0xffffffff) / (double) (1UL << unit);
+}
+
+// The counter may have wrapped more than once if the package can consume the
+// whole range of the counter at its thermal design power. Without the design
+// power the range must be larger than the elapsed time at 1 kW
+static int rapl_may_wrap(double elapsed_s, uint32_t tdp_w, uint32_t unit)
+{
+  double range_j = (double) (1UL << 32) / (double) (1UL << unit);
+
+  return elapsed_s * (tdp_w > 0 ? tdp_w : 1000) >= range_j;
+}
+
+static int write_energy_report(const char *job_id, const char *hostname, double elapsed_s,
+  double node_j, int complete, int node_wide, struct rapl_sample *begin, struct rapl_sample *end,
+  double *energy, long npkgs)
+{
+  char file[BUFFER_SIZE];
+  FILE *fd_report;
+  long i, d;
+
+  if(snprintf(file, sizeof(file), "%s/pm_msrsafe.%s.%s.energy.json", pm_conf.energy_dir,
+     job_id, hostname) >= sizeof(file)){
+    slurm_info("The path of the energy report in '%s' is too long!\n", pm_conf.energy_dir);
+    return -1;
+  }
+  fd_report = fopen(file, "w");
+  if(fd_report == NULL){
+    slurm_info("Failed to open the energy report '%s'!\n", file);
+    return -1;
+  }
+
+  fprintf(fd_report, "{\"job\":\"%s\",\"node\":\"%s\",\"elapsed_s\":%.3f,"
+    "\"energy_j\":%.3f,\"power_w\":%.3f,\"complete\":%s,\"node_wide\":%s,\"packages\":[",
+    job_id, hostname, elapsed_s, node_j, elapsed_s > 0 ? node_j / elapsed_s : 0.0,
+    complete ? "true" : "false", node_wide ? "true" : "false");
+  for(i = 0; i < npkgs; i++){
+    fprintf(fd_report, "%s{\"package\":%u", i > 0 ? "," : "", end[i].pkg);
+    for(d = 0; d < RAPL_NDOMAINS; d++)
+      if(begin[i].valid & end[i].valid & (1 << d))
+        fprintf(fd_report, ",\"%s_j\":%.3f,\"%s_w\":%.3f", rapl_names[d],
+          energy[i * RAPL_NDOMAINS + d], rapl_names[d],
+          elapsed_s > 0 ? energy[i * RAPL_NDOMAINS + d] / elapsed_s : 0.0);
+    fprintf(fd_report, "}");
+  }
+  fprintf(fd_report, "]}\n");
+
+  if(fclose(fd_report) != 0){
+    slurm_info("Failed to write the energy report '%s'!\n", file);
+    return -2;
+  }
+
+  return 0;
+}
+
+// Compute the energy of each package and of the node since the prolog, log
+// it and write the energy report of the job. On shared nodes only the
+// packages owned by the job are accounted, the report is node-wide if the
+// cpus of the job are not known
+int rapl_account()
+{
+  struct rapl_snapshot_header header;
+  struct rapl_sample *begin, *end;
+  char hostname[BUFFER_SIZE], file[BUFFER_SIZE];
+  const char *job_id = getenv("SLURM_JOB_ID");
+  double elapsed_s, node_j = 0, *energy;
+  long i, j, d, npkgs;
+  uint32_t id;
+  int64_t end_ns = now_ns();
+  int complete = TRUE, ret = 0;
+
+  gethostname(hostname, sizeof(hostname));
+  if(rapl_snapshot_file(file, &id) < 0)
+    return -1;
+
+  if(load_rapl_snapshot(file, id, &header, &begin) < 0){
+    slurm_info("Failed to load the RAPL snapshot '%s' of job %s!\n", file, job_id);
+    return -1;
+  }
+  remove(file);
+
+  // On shared nodes only the packages owned by the job are read, the
+  // snapshot has all the packages in the same order
+  npkgs = read_rapl(&end);
+  for(i = 0, j = 0; i < npkgs; i++, j++){
+    while(j < header.npkgs && begin[j].pkg != end[i].pkg)
+      j++;
+    if(j == header.npkgs)
+      break;
+    begin[i] = begin[j];
+  }
+  if(npkgs < 0 || i < npkgs){
+    slurm_info("Failed to read the RAPL energy counters of job %s!\n", job_id);
+    free(begin);
+    if(npkgs >= 0)
+      free(end);
+    return -2;
+  }
+
+  energy = calloc(npkgs * RAPL_NDOMAINS, sizeof(double));
+  if(energy == NULL && npkgs > 0){
+    free(begin);
+    free(end);
+    return -3;
+  }
+
+  elapsed_s = (end_ns - header.time_ns) / 1e9;
+  for(i = 0; i < npkgs; i++){
+    for(d = 0; d < RAPL_NDOMAINS; d++){
+      if(!(begin[i].valid & end[i].valid & (1 << d)))
+        continue;
+      // The energy of a counter that may have wrapped is left out
+      if(rapl_may_wrap(elapsed_s, end[i].tdp_w, end[i].unit[d])){
+        slurm_info("The RAPL counter '%s' of job %s on package %u may have wrapped!\n",
+          rapl_names[d], job_id, end[i].pkg);
+        end[i].valid &= ~(1 << d);
+        if(d != RAPL_PP0)
+          complete = FALSE;
+        continue;
+      }
+      energy[i * RAPL_NDOMAINS + d] = rapl_energy(begin[i].energy[d], end[i].energy[d],
+        end[i].unit[d]);
+    }
+    // PP0 (cores) is part of the package domain
+    node_j += energy[i * RAPL_NDOMAINS + RAPL_PKG] + energy[i * RAPL_NDOMAINS + RAPL_DRAM];
+    slurm_info("Energy of job %s on package %u: pkg %.3f J, dram %.3f J, pp0 %.3f J!\n",
+      job_id, end[i].pkg, energy[i * RAPL_NDOMAINS + RAPL_PKG],
+      energy[i * RAPL_NDOMAINS + RAPL_DRAM], energy[i * RAPL_NDOMAINS + RAPL_PP0]);
+  }
+  slurm_info("Energy of job %s on %s '%s': %.3f J, %.3f W on average over %.3f s%s!\n",
+    job_id, job_cpuset.shared ? "the packages of the job on node" : "node", hostname,
+    node_j, elapsed_s > 0 ? node_j / elapsed_s : 0.0, elapsed_s,
+    complete ? "" : ", incomplete");
+
+  if(write_energy_report(job_id, hostname, elapsed_s, node_j, complete,
+     pm_conf.shared && !job_cpuset.shared, begin, end, energy, npkgs) < 0)
+    ret = -4;
+
+  free(energy);
+  free(begin);
+  free(end);
+
+  return ret;
+}
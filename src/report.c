@@ -0,0 +1,154 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+#include "pm_msrsafe.h"
+
+// Counters of the current prolog/epilog
+struct pm_stats pm_stats;
+
+static struct {
+  const char *hook;
+  struct timespec begin;
+  struct pm_phase phases[REPORT_MAX_PHASES];
+  int nphases;
+} pm_report;
+
+static double elapsed_ms(struct timespec *begin, struct timespec *end)
+{
+  return (end->tv_sec - begin->tv_sec) * 1e3 + (end->tv_nsec - begin->tv_nsec) / 1e6;
+}
+
+// Start the instrumentation of a prolog or epilog
+void report_begin(const char *hook)
+{
+  memset(&pm_stats, 0, sizeof(pm_stats));
+  memset(&pm_report, 0, sizeof(pm_report));
+  pm_report.hook = hook;
+  clock_gettime(CLOCK_MONOTONIC, &pm_report.begin);
+}
+
+// Start a phase, return its index or -1 if there are too many phases
+int phase_begin(const char *name)
+{
+  struct pm_phase *phase;
+
+  if(pm_report.nphases == REPORT_MAX_PHASES)
+    return -1;
+
+  phase = &pm_report.phases[pm_report.nphases];
+  phase->name = name;
+  phase->nsyscalls = pm_stats.nsyscalls;
+  phase->nmsr_ops = pm_stats.nmsr_ops;
+  clock_gettime(CLOCK_MONOTONIC, &phase->begin);
+
+  return pm_report.nphases++;
+}
+
+void phase_end(int index)
+{
+  struct pm_phase *phase;
+  struct timespec end;
+
+  if(index < 0)
+    return;
+
+  phase = &pm_report.phases[index];
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  phase->elapsed_ms = elapsed_ms(&phase->begin, &end);
+  phase->nsyscalls = pm_stats.nsyscalls - phase->nsyscalls;
+  phase->nmsr_ops = pm_stats.nmsr_ops - phase->nmsr_ops;
+}
+
+static int write_report(const char *job_id, const char *hostname, int ret, double total_ms)
+{
+  char file[BUFFER_SIZE];
+  FILE *fd_report;
+  int i;
+
+  if(snprintf(file, sizeof(file), "%s/pm_msrsafe.%s.%s.%s.json", pm_conf.report_dir,
+     job_id, hostname, pm_report.hook) >= sizeof(file)){
+    slurm_info("The path of the report file in '%s' is too long!\n", pm_conf.report_dir);
+    return -1;
+  }
+  fd_report = fopen(file, "w");
+  if(fd_report == NULL){
+    slurm_info("Failed to open the report file '%s'!\n", file);
+    return -1;
+  }
+
+  fprintf(fd_report, "{\"job\":\"%s\",\"node\":\"%s\",\"hook\":\"%s\",\"ret\":%d,"
+    "\"elapsed_ms\":%.3f,\"syscalls\":%ld,\"msr_ops\":%ld,\"phases\":[",
+    job_id, hostname, pm_report.hook, ret, total_ms, pm_stats.nsyscalls, pm_stats.nmsr_ops);
+  for(i = 0; i < pm_report.nphases; i++)
+    fprintf(fd_report, "%s{\"name\":\"%s\",\"elapsed_ms\":%.3f,\"syscalls\":%ld,\"msr_ops\":%ld}",
+      i > 0 ? "," : "", pm_report.phases[i].name, pm_report.phases[i].elapsed_ms,
+      pm_report.phases[i].nsyscalls, pm_report.phases[i].nmsr_ops);
+  fprintf(fd_report, "]}\n");
+
+  if(fclose(fd_report) != 0){
+    slurm_info("Failed to write the report file '%s'!\n", file);
+    return -2;
+  }
+
+  return 0;
+}
+
+// Conclude the instrumentation, log a summary and write the JSON report
+int report_end(int ret)
+{
+  char hostname[BUFFER_SIZE], summary[BUFFER_SIZE];
+  const char *job_id = getenv("SLURM_JOB_ID");
+  struct timespec end;
+  double total_ms;
+  int i, len;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  total_ms = elapsed_ms(&pm_report.begin, &end);
+  gethostname(hostname, sizeof(hostname));
+  if(job_id == NULL)
+    job_id = "none";
+
+  // One line summary with the time of each phase
+  len = snprintf(summary, sizeof(summary), "%.3f ms, %ld syscalls, %ld MSR ops:",
+    total_ms, pm_stats.nsyscalls, pm_stats.nmsr_ops);
+  for(i = 0; i < pm_report.nphases && len < sizeof(summary); i++)
+    len += snprintf(summary + len, sizeof(summary) - len, " %s=%.3f",
+      pm_report.phases[i].name, pm_report.phases[i].elapsed_ms);
+  slurm_info("Spank PM_MSRSAFE %s of job %s: %s\n", pm_report.hook, job_id, summary);
+
+  if(pm_conf.report_dir[0] != '\0')
+    return write_report(job_id, hostname, ret, total_ms);
+
+  return 0;
+}
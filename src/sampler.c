@@ -0,0 +1,517 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+
+#include "pm_msrsafe.h"
+
+// Sampler process, started by the step and stopped when its tasks exit
+static pid_t sampler_pid = -1;
+
+static volatile sig_atomic_t sampler_stop = FALSE;
+
+static void handle_stop(int sig)
+{
+  sampler_stop = TRUE;
+}
+
+static int64_t now_ns()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static struct sampler_slot *get_slot(struct sampler_header *header, uint64_t index)
+{
+  return (struct sampler_slot *) ((char *) (header + 1) +
+    (index % header->nslots) * header->slot_size);
+}
+
+// Prepare the read operations of a sample: the registers of each cpu of the
+// job, the energy counters and the uncore frequency of each package, return
+// the number of operations
+static long init_sampler_ops(struct msr_batch_op **ops, long ncpus, long *npkgs)
+{
+  struct msr_batch_op *op;
+  uint32_t *cpus, *pkgs;
+  long i, nops, n = 0;
+
+  *npkgs = get_package_leaders(&cpus, &pkgs);
+  if(*npkgs < 0)
+    return -1;
+
+  nops = ncpus * SAMPLER_CPU_REGS + *npkgs * SAMPLER_PKG_REGS;
+  op = calloc(nops, sizeof(struct msr_batch_op));
+  if(op == NULL){
+    free(cpus);
+    free(pkgs);
+    return -1;
+  }
+
+  for(i = 0; i < ncpus; i++){
+    op[n].cpu = job_cpu(i);
+    op[n++].msr = MSR_IA32_APERF;
+    op[n].cpu = job_cpu(i);
+    op[n++].msr = MSR_IA32_MPERF;
+    op[n].cpu = job_cpu(i);
+    op[n++].msr = MSR_IA32_PERF_STATUS;
+  }
+  for(i = 0; i < *npkgs; i++){
+    op[n].cpu = cpus[i];
+    op[n++].msr = MSR_PKG_ENERGY_STATUS;
+    op[n].cpu = cpus[i];
+    op[n++].msr = MSR_DRAM_ENERGY_STATUS;
+    op[n].cpu = cpus[i];
+    op[n++].msr = MSR_UNCORE_PERF_STATUS;
+  }
+  for(i = 0; i < nops; i++)
+    op[i].isrdmsr = TRUE;
+  free(cpus);
+  free(pkgs);
+
+  *ops = op;
+
+  return nops;
+}
+
+// Open the MSR_SAFE file of each cpu of the operations before the fork, the
+// descriptor of each operation is saved in fds and the ones of each cpu in
+// cpu_fds to be closed, return the number of files opened
+static long open_sampler_fds(struct msr_batch_op *ops, long nops, int *fds, int *cpu_fds,
+  long ncpus)
+{
+  char file[BUFFER_SIZE];
+  long i, nfiles = 0;
+
+  for(i = 0; i < ncpus; i++)
+    cpu_fds[i] = -1;
+  for(i = 0; i < nops; i++){
+    if(ops[i].cpu >= ncpus)
+      return -1;
+    if(cpu_fds[ops[i].cpu] < 0){
+      sprintf(file, MSRSAFE_CPU_FILE, (long) ops[i].cpu);
+      cpu_fds[ops[i].cpu] = open(file, O_RDONLY);
+      STAT_ADD(nsyscalls, 1);
+      if(cpu_fds[ops[i].cpu] < 0){
+        slurm_info("Failed to open '%s'!\n", file);
+        return -1;
+      }
+      nfiles++;
+    }
+    fds[i] = cpu_fds[ops[i].cpu];
+  }
+
+  return nfiles;
+}
+
+static void close_sampler_fds(int *cpu_fds, long ncpus)
+{
+  long i;
+
+  for(i = 0; i < ncpus; i++){
+    if(cpu_fds[i] >= 0){
+      close(cpu_fds[i]);
+      STAT_ADD(nsyscalls, 1);
+    }
+  }
+}
+
+// Split the operations in the chunks submitted to the batch device, return
+// the number of chunks
+static long init_sampler_batches(struct msr_batch_op *ops, long nops,
+  struct msr_batch_array **batches)
+{
+  long i, nbatches = (nops + MSRSAFE_BATCH_MAX_OPS - 1) / MSRSAFE_BATCH_MAX_OPS;
+
+  *batches = malloc((nbatches > 0 ? nbatches : 1) * sizeof(struct msr_batch_array));
+  if(*batches == NULL)
+    return -1;
+  for(i = 0; i < nbatches; i++){
+    (*batches)[i].ops = &ops[i * MSRSAFE_BATCH_MAX_OPS];
+    (*batches)[i].numops = nops - i * MSRSAFE_BATCH_MAX_OPS < MSRSAFE_BATCH_MAX_OPS ?
+      nops - i * MSRSAFE_BATCH_MAX_OPS : MSRSAFE_BATCH_MAX_OPS;
+  }
+
+  return nbatches;
+}
+
+// Read the registers of a sample with raw syscalls, the sampler process is
+// forked from the multithreaded slurmstepd and must not allocate memory or
+// take locks. All the registers are read with one ioctl of the batch device
+// for each chunk, the per-cpu files are read one register at a time only if
+// the device is not usable
+static void read_sample_regs(struct msr_batch_op *ops, int *fds, long nops,
+  struct msr_batch_array *batches, long nbatches, int *batch_fd)
+{
+  long i;
+
+  if(*batch_fd >= 0){
+    for(i = 0; i < nops; i++)
+      ops[i].err = 0;
+    // EIO marks the faulted operations, any other error aborts the chunk
+    for(i = 0; i < nbatches; i++)
+      if(ioctl(*batch_fd, X86_IOC_MSR_BATCH, &batches[i]) < 0 && errno != EIO)
+        break;
+    if(i == nbatches)
+      return;
+    *batch_fd = -1;
+  }
+
+  for(i = 0; i < nops; i++)
+    ops[i].err = pread(fds[i], &ops[i].msrdata, sizeof(uint64_t), ops[i].msr) ==
+      sizeof(uint64_t) ? 0 : -EIO;
+}
+
+// Store a sample in the next slot of the ring buffer, the readers detect
+// the slots overwritten while they copy them
+static void write_sample(struct sampler_header *header, struct msr_batch_op *ops, long nops,
+  int64_t time_ns)
+{
+  uint64_t head = header->head;
+  struct sampler_slot *slot = get_slot(header, head);
+  long i;
+
+  __atomic_store_n(&slot->seq, 2 * head + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->time_ns = time_ns;
+  for(i = 0; i < nops; i++)
+    slot->data[i] = ops[i].err == 0 ? ops[i].msrdata : 0;
+  __atomic_store_n(&slot->seq, 2 * head + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&header->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Main loop of the sampler process, the period is doubled whenever the time
+// spent sampling since the last change exceeds SAMPLER_MAX_OVERHEAD of a cpu
+static void run_sampler(struct sampler_header *header, struct msr_batch_op *ops, int *fds,
+  long nops, struct msr_batch_array *batches, long nbatches, int batch_fd)
+{
+  struct timespec next;
+  int64_t next_ns, begin_ns, end_ns, window_ns, window_overhead_ns = 0;
+
+  next_ns = window_ns = header->begin_ns;
+  while(!sampler_stop){
+    next_ns += header->period_us * 1000L;
+    next.tv_sec = next_ns / 1000000000L;
+    next.tv_nsec = next_ns % 1000000000L;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    if(sampler_stop)
+      break;
+
+    begin_ns = now_ns();
+    read_sample_regs(ops, fds, nops, batches, nbatches, &batch_fd);
+    write_sample(header, ops, nops, begin_ns);
+    end_ns = now_ns();
+
+    header->overhead_ns += end_ns - begin_ns;
+    header->elapsed_ns = end_ns - header->begin_ns;
+    if(end_ns - begin_ns > header->max_sample_ns)
+      header->max_sample_ns = end_ns - begin_ns;
+
+    window_overhead_ns += end_ns - begin_ns;
+    if(window_overhead_ns > SAMPLER_MAX_OVERHEAD * (end_ns - window_ns) &&
+       header->period_us < 1000000){
+      header->period_us *= 2;
+      window_overhead_ns = 0;
+      window_ns = end_ns;
+    }
+
+    // Skip the samples missed instead of catching up
+    if(next_ns < end_ns)
+      next_ns = end_ns;
+  }
+}
+
+// Create the samples file and fork the sampler process. Everything the
+// sampler needs is prepared before the fork, the descriptors of the batch
+// device and of the MSR_SAFE files are opened here and closed by the step
+// after the fork
+int start_sampler(const char *file)
+{
+  struct sampler_header *header;
+  struct msr_batch_array *batches = NULL;
+  struct msr_batch_op *ops;
+  uint64_t unit;
+  long nops, npkgs, nbatches, ncpus = job_ncpus(), nfds = get_ncpus();
+  size_t slot_size, size;
+  int fd, batch_fd, *fds, *cpu_fds;
+  pid_t pid;
+
+  if(pm_conf.sampler_rate <= 0 || pm_conf.sampler_slots < 2){
+    slurm_info("Invalid configuration of the sampler!\n");
+    return -1;
+  }
+
+  nops = init_sampler_ops(&ops, ncpus, &npkgs);
+  if(nops < 0){
+    slurm_info("Failed to allocate the MSR batch operations!\n");
+    return -2;
+  }
+  fds = malloc(nops * sizeof(int));
+  cpu_fds = malloc(nfds * sizeof(int));
+  nbatches = init_sampler_batches(ops, nops, &batches);
+  if(fds == NULL || cpu_fds == NULL || nbatches < 0){
+    slurm_info("Failed to allocate the MSR batch operations!\n");
+    free(ops);
+    free(fds);
+    free(cpu_fds);
+    free(batches);
+    return -2;
+  }
+  if(open_sampler_fds(ops, nops, fds, cpu_fds, nfds) < 0){
+    close_sampler_fds(cpu_fds, nfds);
+    free(ops);
+    free(fds);
+    free(cpu_fds);
+    free(batches);
+    return -2;
+  }
+  // The per-cpu files are still needed if the device refuses a batch
+  batch_fd = open(MSRSAFE_BATCH_FILE, O_RDWR);
+  STAT_ADD(nsyscalls, 1);
+#ifdef SLURM_SPANK_DEBUG
+  if(batch_fd < 0)
+    slurm_info("Failed to open '%s', the sampler reads the MSR_SAFE files!\n",
+      MSRSAFE_BATCH_FILE);
+#endif // SLURM_SPANK_DEBUG
+  slot_size = sizeof(struct sampler_slot) + nops * sizeof(uint64_t);
+  size = sizeof(struct sampler_header) + pm_conf.sampler_slots * slot_size;
+
+  // The samples file is in a directory writable by the users
+  fd = open(file, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644);
+  if(fd < 0 || ftruncate(fd, size) < 0){
+    slurm_info("Failed to create the samples file '%s'!\n", file);
+    header = MAP_FAILED;
+  }
+  else
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(fd >= 0)
+    close(fd);
+  if(header == MAP_FAILED){
+    slurm_info("Failed to map the samples file '%s'!\n", file);
+    close_sampler_fds(cpu_fds, nfds);
+    if(batch_fd >= 0)
+      close(batch_fd);
+    free(ops);
+    free(fds);
+    free(cpu_fds);
+    free(batches);
+    return -3;
+  }
+
+  header->ncpus = ncpus;
+  header->npkgs = npkgs;
+  header->nslots = pm_conf.sampler_slots;
+  header->slot_size = slot_size;
+  header->period_us = pm_conf.sampler_rate < 1000000 ? 1000000 / pm_conf.sampler_rate : 1;
+  // Energy status units, bits 12:8, read on the first package
+  if(npkgs > 0){
+    if(pread(fds[ncpus * SAMPLER_CPU_REGS], &unit, sizeof(unit), MSR_RAPL_POWER_UNIT) ==
+       sizeof(unit))
+      header->energy_unit = (unit >> 8) & 0x1f;
+    STAT_ADD(nsyscalls, 1);
+  }
+  header->begin_ns = now_ns();
+  header->version = SAMPLER_VERSION;
+  __atomic_store_n(&header->magic, SAMPLER_MAGIC, __ATOMIC_RELEASE);
+
+  pid = fork();
+  if(pid < 0){
+    slurm_info("Failed to start the sampler process!\n");
+    munmap(header, size);
+    close_sampler_fds(cpu_fds, nfds);
+    if(batch_fd >= 0)
+      close(batch_fd);
+    free(ops);
+    free(fds);
+    free(cpu_fds);
+    free(batches);
+    return -4;
+  }
+  if(pid == 0){
+    // Stop also when the step dies
+    signal(SIGTERM, handle_stop);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    run_sampler(header, ops, fds, nops, batches, nbatches, batch_fd);
+    _exit(0);
+  }
+
+  sampler_pid = pid;
+  munmap(header, size);
+  close_sampler_fds(cpu_fds, nfds);
+  if(batch_fd >= 0){
+    close(batch_fd);
+    STAT_ADD(nsyscalls, 1);
+  }
+  free(ops);
+  free(fds);
+  free(cpu_fds);
+  free(batches);
+
+  return 0;
+}
+
+int stop_sampler()
+{
+  if(sampler_pid < 0)
+    return 0;
+
+  kill(sampler_pid, SIGTERM);
+  waitpid(sampler_pid, NULL, 0);
+  sampler_pid = -1;
+
+  return 0;
+}
+
+// Copy a slot consistently, return -1 if it is written or overwritten
+static int read_sample(struct sampler_header *header, uint64_t index, struct sampler_slot *copy)
+{
+  struct sampler_slot *slot = get_slot(header, index);
+  uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+  if(seq != 2 * index + 2)
+    return -1;
+  memcpy(copy, slot, header->slot_size);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq ? 0 : -1;
+}
+
+// Print the samples in the ring buffer as frequency ratios, power and uncore
+// frequency, it can be called while the sampler is running
+int print_samples(const char *file)
+{
+  struct sampler_header *header;
+  struct sampler_slot *prev, *cur, *tmp;
+  uint64_t i, head, first, *p, *c;
+  double dt, ratio, pstate, joules, sum_uncore = 0;
+  long cpu, pkg, d, nactive, nuncore = 0;
+  struct stat info;
+  void *addr;
+  int fd, valid = FALSE;
+
+  fd = open(file, O_RDONLY);
+  if(fd < 0 || fstat(fd, &info) < 0 || info.st_size < sizeof(struct sampler_header)){
+    printf("'%s' is not a valid samples file!\n", file);
+    if(fd >= 0)
+      close(fd);
+    return -1;
+  }
+  addr = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(addr == MAP_FAILED){
+    printf("Failed to map the samples file '%s'!\n", file);
+    return -1;
+  }
+
+  header = addr;
+  if(__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SAMPLER_MAGIC ||
+     header->version != SAMPLER_VERSION ||
+     info.st_size < sizeof(struct sampler_header) + header->nslots * (uint64_t) header->slot_size){
+    printf("'%s' is not a valid samples file!\n", file);
+    munmap(addr, info.st_size);
+    return -1;
+  }
+
+  prev = malloc(header->slot_size);
+  cur = malloc(header->slot_size);
+  if(prev == NULL || cur == NULL){
+    free(prev);
+    free(cur);
+    munmap(addr, info.st_size);
+    return -2;
+  }
+
+  head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+  first = head > header->nslots ? head - header->nslots : 0;
+
+  printf("# %u CPUs, %u packages, %lu samples, period %u us\n", header->ncpus,
+    header->npkgs, head, header->period_us);
+  printf("# Time(s) # APERF/MPERF # PERF_STATUS(MHz) # Package power(W) and uncore(MHz): "
+    "pkg dram uncore ...\n");
+  for(i = first; i < head; i++){
+    if(read_sample(header, i, cur) < 0){
+      valid = FALSE;
+      continue;
+    }
+    if(valid){
+      dt = (cur->time_ns - prev->time_ns) / 1e9;
+      ratio = 0;
+      pstate = 0;
+      nactive = 0;
+      for(cpu = 0; cpu < header->ncpus; cpu++){
+        p = &prev->data[cpu * SAMPLER_CPU_REGS];
+        c = &cur->data[cpu * SAMPLER_CPU_REGS];
+        // Busy frequency relative to the base one
+        if(c[1] > p[1]){
+          ratio += (double) (c[0] - p[0]) / (double) (c[1] - p[1]);
+          nactive++;
+        }
+        // Current ratio, bits 15:8, in units of 100 MHz
+        pstate += ((c[2] >> 8) & 0xff) * 100;
+      }
+      printf("%.3f %.3f %.0f", (cur->time_ns - header->begin_ns) / 1e9,
+        nactive > 0 ? ratio / nactive : 0.0, pstate / header->ncpus);
+      for(pkg = 0; pkg < header->npkgs; pkg++){
+        p = &prev->data[header->ncpus * SAMPLER_CPU_REGS + pkg * SAMPLER_PKG_REGS];
+        c = &cur->data[header->ncpus * SAMPLER_CPU_REGS + pkg * SAMPLER_PKG_REGS];
+        for(d = 0; d < 2; d++){
+          joules = (double) ((c[d] - p[d]) & 0xffffffff) / (double) (1UL << header->energy_unit);
+          printf(" %.3f", dt > 0 ? joules / dt : 0.0);
+        }
+        // Current uncore ratio, bits 6:0, in units of 100 MHz
+        sum_uncore += (c[2] & 0x7f) * 100;
+        nuncore++;
+        printf(" %lu", (c[2] & 0x7f) * 100);
+      }
+      printf("\n");
+    }
+    tmp = prev;
+    prev = cur;
+    cur = tmp;
+    valid = TRUE;
+  }
+
+  printf("# Average uncore frequency of the samples: %.0f MHz\n",
+    nuncore > 0 ? sum_uncore / nuncore : 0.0);
+  printf("# Sampling overhead: %.3f%% of a cpu, max %.3f ms per sample\n",
+    header->elapsed_ns > 0 ? header->overhead_ns * 100.0 / header->elapsed_ns : 0.0,
+    header->max_sample_ns / 1e6);
+
+  free(prev);
+  free(cur);
+  munmap(addr, info.st_size);
+
+  return 0;
+}
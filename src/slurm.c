@@ -72,7 +72,8 @@ int check_exclusive_node()
   }
   else{
     char *eptr;
-    long os_ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    // Online cpus, get_ncpus() is the last online cpu + 1
+    long os_ncpus = get_nonline();
     long job_ncpus = strtol(env_ncpus, &eptr, 10);
 
     if(os_ncpus != job_ncpus){
@@ -97,6 +98,17 @@ int check_plugin_started()
   // Get slurm uid
   slurm_uid = getuid();
 
+  // The baseline always exists, the prolog leaves a marker
+  if(baseline_enabled()){
+    if(access(PM_STARTED, F_OK) < 0)
+      return -4;
+    if(check_baseline_file(PM_STARTED) < 0){
+      remove(PM_STARTED);
+      return -5;
+    }
+    return 0;
+  }
+
   // Check if exist the intel_pstate dump file and if the ownership own to slurm
   if(access(PM_IPSTATE_DUMP, F_OK) >= 0){
     stat(PM_IPSTATE_DUMP, &info_ipstate);
@@ -145,3 +157,37 @@ int check_plugin_started()
       return -4;
   }
 }
+
+// The step sees the environment of the job through spank_getenv()
+int check_enable_step(spank_t spank_ctx)
+{
+  char env_check[BUFFER_SIZE];
+
+  if(spank_getenv(spank_ctx, "SLURM_SPANK_PM_MSRSAFE", env_check,
+     sizeof(env_check)) != ESPANK_SUCCESS)
+    return -1;
+
+  return str_to_bool(env_check) ? 0 : -2;
+}
+
+// Samples file of the step: SAMPLER_DIR/pm_msrsafe.JOBID.STEPID.HOSTNAME.samples
+int get_samples_file(spank_t spank_ctx, char *file)
+{
+  char hostname[BUFFER_SIZE];
+  uint32_t job_id, step_id;
+
+  if(spank_get_item(spank_ctx, S_JOB_ID, &job_id) != ESPANK_SUCCESS ||
+     spank_get_item(spank_ctx, S_JOB_STEPID, &step_id) != ESPANK_SUCCESS){
+    slurm_info("Failed to read the job and step ids!\n");
+    return -1;
+  }
+  gethostname(hostname, sizeof(hostname));
+
+  if(snprintf(file, BUFFER_SIZE, "%s/pm_msrsafe.%u.%u.%s.samples", pm_conf.sampler_dir,
+     job_id, step_id, hostname) >= BUFFER_SIZE){
+    slurm_info("The path of the samples file in '%s' is too long!\n", pm_conf.sampler_dir);
+    return -2;
+  }
+
+  return 0;
+}
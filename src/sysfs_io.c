@@ -0,0 +1,441 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+
+#include "pm_msrsafe.h"
+
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif // HAVE_IO_URING
+
+void init_sysfs_batch(struct sysfs_batch *batch)
+{
+  batch->reqs = NULL;
+  batch->nreqs = 0;
+  batch->size = 0;
+}
+
+// Queue a read or write of a sysfs file, return the index of the request
+long add_sysfs_req(struct sysfs_batch *batch, int write, const char *file, const char *value)
+{
+  struct sysfs_req *tmp, *req;
+
+  if(batch->nreqs == batch->size){
+    batch->size = batch->size == 0 ? 64 : batch->size * 2;
+    tmp = realloc(batch->reqs, batch->size * sizeof(struct sysfs_req));
+    if(tmp == NULL)
+      return -1;
+    batch->reqs = tmp;
+  }
+
+  req = &batch->reqs[batch->nreqs];
+  req->path = strdup(file);
+  if(req->path == NULL)
+    return -1;
+  req->value[0] = '\0';
+  if(value != NULL){
+    strncpy(req->value, value, SYSFS_VALUE_SIZE - 1);
+    req->value[SYSFS_VALUE_SIZE - 1] = '\0';
+  }
+  req->write = write;
+  req->fd = -1;
+  req->err = 0;
+
+  return batch->nreqs++;
+}
+
+void free_sysfs_batch(struct sysfs_batch *batch)
+{
+  long i;
+
+  for(i = 0; i < batch->nreqs; i++)
+    free(batch->reqs[i].path);
+  free(batch->reqs);
+  init_sysfs_batch(batch);
+}
+
+// Keep the first word of the content as fscanf("%s") in read_str_from_file()
+static int parse_sysfs_value(char *value, ssize_t len)
+{
+  char *begin, *end;
+
+  if(len < 0)
+    return -EIO;
+  value[len] = '\0';
+
+  for(begin = value; *begin == ' ' || *begin == '\t' || *begin == '\n'; begin++);
+  for(end = begin; *end != '\0' && *end != ' ' && *end != '\t' && *end != '\n'; end++);
+  *end = '\0';
+  if(begin == end)
+    return -ENODATA;
+  memmove(value, begin, end - begin + 1);
+
+  return 0;
+}
+
+static long exec_sysfs_sync(struct sysfs_req *reqs, long nreqs)
+{
+  long i, nerrs = 0;
+  ssize_t len;
+  int fd;
+
+  for(i = 0; i < nreqs; i++){
+    if(reqs[i].write)
+      fd = open(reqs[i].path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    else
+      fd = open(reqs[i].path, O_RDONLY);
+    if(fd < 0){
+      STAT_ADD(nsyscalls, 1);
+      reqs[i].err = -errno;
+      nerrs++;
+      continue;
+    }
+
+    if(reqs[i].write){
+      len = strlen(reqs[i].value);
+      reqs[i].err = write(fd, reqs[i].value, len) == len ? 0 : -EIO;
+    }
+    else{
+      len = read(fd, reqs[i].value, SYSFS_VALUE_SIZE - 1);
+      reqs[i].err = parse_sysfs_value(reqs[i].value, len);
+    }
+    STAT_ADD(nsyscalls, 3);
+    if(close(fd) != 0 && reqs[i].err == 0)
+      reqs[i].err = -errno;
+
+    if(reqs[i].err != 0)
+      nerrs++;
+  }
+
+  return nerrs;
+}
+
+#ifdef HAVE_IO_URING
+// Number of requests in flight for each stage of the pipeline
+#define SYSFS_RING_ENTRIES 256
+
+static struct {
+  int fd;                               // -1 not initialized, -2 not available
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+} sysfs_ring = { .fd = -1 };
+
+// Check that the kernel supports the opcodes of the pipeline (Linux >= 5.6)
+static int probe_sysfs_ring(int fd)
+{
+  static const int opcodes[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE };
+  struct io_uring_probe *probe;
+  size_t size = sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  int i, ret = 0;
+
+  probe = calloc(1, size);
+  if(probe == NULL)
+    return -1;
+
+  if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0)
+    ret = -2;
+  for(i = 0; ret == 0 && i < (int) (sizeof(opcodes) / sizeof(opcodes[0])); i++){
+    if(opcodes[i] > probe->last_op || !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED))
+      ret = -3;
+  }
+
+  free(probe);
+
+  return ret;
+}
+
+// Create the ring once per process, return -1 if io_uring is not available
+static int init_sysfs_ring()
+{
+  struct io_uring_params p;
+  size_t sq_size, cq_size;
+  void *sq_ptr, *cq_ptr, *sqes;
+  int fd;
+
+  if(sysfs_ring.fd != -1)
+    return sysfs_ring.fd >= 0 ? 0 : -1;
+  sysfs_ring.fd = -2;
+
+  memset(&p, 0, sizeof(p));
+  fd = syscall(__NR_io_uring_setup, SYSFS_RING_ENTRIES, &p);
+  if(fd < 0){
+#ifdef SLURM_SPANK_DEBUG
+    slurm_info("io_uring is not available (%s), using synchronous sysfs I/O!\n",
+      strerror(errno));
+#endif // SLURM_SPANK_DEBUG
+    return -1;
+  }
+
+  if(probe_sysfs_ring(fd) < 0){
+#ifdef SLURM_SPANK_DEBUG
+    slurm_info("io_uring does not support file operations, using synchronous sysfs I/O!\n");
+#endif // SLURM_SPANK_DEBUG
+    close(fd);
+    return -1;
+  }
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP)
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+  sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    fd, IORING_OFF_SQ_RING);
+  if(sq_ptr == MAP_FAILED){
+    close(fd);
+    return -1;
+  }
+  if(p.features & IORING_FEAT_SINGLE_MMAP)
+    cq_ptr = sq_ptr;
+  else{
+    cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd, IORING_OFF_CQ_RING);
+    if(cq_ptr == MAP_FAILED){
+      munmap(sq_ptr, sq_size);
+      close(fd);
+      return -1;
+    }
+  }
+  sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if(sqes == MAP_FAILED){
+    if(cq_ptr != sq_ptr)
+      munmap(cq_ptr, cq_size);
+    munmap(sq_ptr, sq_size);
+    close(fd);
+    return -1;
+  }
+
+  // The ring lives until the prolog/epilog process exits
+  sysfs_ring.sq_head = (unsigned *) ((char *) sq_ptr + p.sq_off.head);
+  sysfs_ring.sq_tail = (unsigned *) ((char *) sq_ptr + p.sq_off.tail);
+  sysfs_ring.sq_mask = (unsigned *) ((char *) sq_ptr + p.sq_off.ring_mask);
+  sysfs_ring.sq_array = (unsigned *) ((char *) sq_ptr + p.sq_off.array);
+  sysfs_ring.cq_head = (unsigned *) ((char *) cq_ptr + p.cq_off.head);
+  sysfs_ring.cq_tail = (unsigned *) ((char *) cq_ptr + p.cq_off.tail);
+  sysfs_ring.cq_mask = (unsigned *) ((char *) cq_ptr + p.cq_off.ring_mask);
+  sysfs_ring.cqes = (struct io_uring_cqe *) ((char *) cq_ptr + p.cq_off.cqes);
+  sysfs_ring.sqes = (struct io_uring_sqe *) sqes;
+  sysfs_ring.fd = fd;
+
+  return 0;
+}
+
+static struct io_uring_sqe *get_sqe(unsigned *tail)
+{
+  unsigned index = *tail & *sysfs_ring.sq_mask;
+  struct io_uring_sqe *sqe = &sysfs_ring.sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sysfs_ring.sq_array[index] = index;
+  (*tail)++;
+
+  return sqe;
+}
+
+// Stages of the pipeline
+#define SYSFS_STAGE_OPEN 0
+#define SYSFS_STAGE_IO 1
+#define SYSFS_STAGE_CLOSE 2
+
+// Submit the queued entries and wait all their completions, the result of
+// each request is stored in its 'fd' (open) or 'err' (read/write) field. The
+// kernel can consume only a part of the entries (e.g. an entry failing early
+// or EAGAIN), then it returns without waiting and the rest is submitted again
+static int submit_sysfs_ring(struct sysfs_req *reqs, unsigned tail, unsigned nsqes, int stage)
+{
+  struct io_uring_cqe *cqe;
+  struct sysfs_req *req;
+  unsigned head, nsubmitted = 0, ncqes = 0;
+  int ret, stalled;
+
+  if(nsqes == 0)
+    return 0;
+
+  __atomic_store_n(sysfs_ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+  while(ncqes < nsqes){
+    ret = syscall(__NR_io_uring_enter, sysfs_ring.fd, nsqes - nsubmitted,
+      nsqes - ncqes, IORING_ENTER_GETEVENTS, NULL, 0);
+    STAT_ADD(nsyscalls, 1);
+    if(ret > 0)
+      nsubmitted += ret;
+    else if(ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      return -1;
+    // Nothing submitted by this call, retried only if interrupted
+    stalled = ret == 0 || (ret < 0 && errno != EINTR);
+
+    head = *sysfs_ring.cq_head;
+    while(head != __atomic_load_n(sysfs_ring.cq_tail, __ATOMIC_ACQUIRE)){
+      cqe = &sysfs_ring.cqes[head & *sysfs_ring.cq_mask];
+      req = &reqs[cqe->user_data];
+      if(stage == SYSFS_STAGE_OPEN){
+        if(cqe->res < 0)
+          req->err = cqe->res;
+        else
+          req->fd = cqe->res;
+      }
+      else if(stage == SYSFS_STAGE_IO){
+        if(req->write)
+          req->err = cqe->res == (int) strlen(req->value) ? 0 : (cqe->res < 0 ? cqe->res : -EIO);
+        else
+          req->err = parse_sysfs_value(req->value, cqe->res);
+      }
+      head++;
+      ncqes++;
+    }
+    __atomic_store_n(sysfs_ring.cq_head, head, __ATOMIC_RELEASE);
+
+    // No entry in flight and the kernel does not accept the others
+    if(stalled && ncqes == nsubmitted && nsubmitted < nsqes)
+      return -1;
+  }
+
+  return 0;
+}
+
+// Open, read/write and close a chunk of files with three submissions
+static int exec_sysfs_ring(struct sysfs_req *reqs, long nreqs)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail, nsqes;
+  long i;
+  int ret;
+
+  // Open stage
+  tail = *sysfs_ring.sq_tail;
+  for(i = 0; i < nreqs; i++){
+    sqe = get_sqe(&tail);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long) reqs[i].path;
+    sqe->open_flags = reqs[i].write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+    sqe->len = 0644;
+    sqe->user_data = i;
+  }
+  ret = submit_sysfs_ring(reqs, tail, nreqs, SYSFS_STAGE_OPEN);
+
+  // Read/write stage
+  tail = *sysfs_ring.sq_tail;
+  nsqes = 0;
+  for(i = 0; ret == 0 && i < nreqs; i++){
+    if(reqs[i].fd < 0)
+      continue;
+    sqe = get_sqe(&tail);
+    sqe->opcode = reqs[i].write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = reqs[i].fd;
+    sqe->addr = (unsigned long) reqs[i].value;
+    sqe->len = reqs[i].write ? strlen(reqs[i].value) : SYSFS_VALUE_SIZE - 1;
+    sqe->off = 0;
+    sqe->user_data = i;
+    nsqes++;
+  }
+  if(ret == 0)
+    ret = submit_sysfs_ring(reqs, tail, nsqes, SYSFS_STAGE_IO);
+
+  // Close stage, after a failure the descriptors are closed synchronously
+  tail = *sysfs_ring.sq_tail;
+  nsqes = 0;
+  for(i = 0; i < nreqs; i++){
+    if(reqs[i].fd < 0)
+      continue;
+    if(ret < 0){
+      close(reqs[i].fd);
+      STAT_ADD(nsyscalls, 1);
+    }
+    else{
+      sqe = get_sqe(&tail);
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->fd = reqs[i].fd;
+      sqe->user_data = i;
+      nsqes++;
+    }
+    reqs[i].fd = -1;
+  }
+  if(ret == 0)
+    ret = submit_sysfs_ring(reqs, tail, nsqes, SYSFS_STAGE_CLOSE);
+
+  return ret;
+}
+
+// Execute the requests through io_uring, return -1 if the ring is not available
+static long exec_sysfs_uring(struct sysfs_req *reqs, long nreqs)
+{
+  long i, n, nerrs = 0;
+
+  if(init_sysfs_ring() < 0)
+    return -1;
+
+  for(i = 0; i < nreqs; i += n){
+    n = nreqs - i < SYSFS_RING_ENTRIES ? nreqs - i : SYSFS_RING_ENTRIES;
+    if(exec_sysfs_ring(&reqs[i], n) < 0){
+      slurm_info("Failed to submit the sysfs requests to io_uring, using synchronous I/O!\n");
+      // Entries of the failed chunk can still be in flight, drop the ring
+      close(sysfs_ring.fd);
+      sysfs_ring.fd = -2;
+      for(n = i; n < nreqs; n++)
+        reqs[n].err = 0;
+      exec_sysfs_sync(&reqs[i], nreqs - i);
+      break;
+    }
+  }
+
+  for(i = 0; i < nreqs; i++){
+    if(reqs[i].err != 0)
+      nerrs++;
+  }
+
+  return nerrs;
+}
+#endif // HAVE_IO_URING
+
+// Execute the batch of sysfs reads/writes, through io_uring if available,
+// return the number of failed requests
+long exec_sysfs_batch(struct sysfs_batch *batch)
+{
+  long nerrs = -1;
+
+#ifdef HAVE_IO_URING
+  if(pm_conf.io_uring)
+    nerrs = exec_sysfs_uring(batch->reqs, batch->nreqs);
+#endif // HAVE_IO_URING
+
+  if(nerrs < 0)
+    nerrs = exec_sysfs_sync(batch->reqs, batch->nreqs);
+
+  return nerrs;
+}
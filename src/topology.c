@@ -0,0 +1,590 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+#include "pm_msrsafe.h"
+
+// Scope of the MSRs shared by more than one logical cpu, from the Intel SDM
+// vol. 4 for Xeon server processors (family 6). Sorted by address
+static const struct msr_scope_entry {
+  uint32_t addr;
+  int scope;
+} msr_scopes[] = {
+  { 0x0E2, SCOPE_CORE },                // MSR_PKG_CST_CONFIG_CONTROL
+  { 0x0E4, SCOPE_CORE },                // MSR_PMG_IO_CAPTURE_BASE
+  { 0x19B, SCOPE_CORE },                // IA32_THERM_INTERRUPT
+  { 0x19C, SCOPE_CORE },                // IA32_THERM_STATUS
+  { 0x1A2, SCOPE_PACKAGE },             // MSR_TEMPERATURE_TARGET
+  { 0x1AD, SCOPE_PACKAGE },             // MSR_TURBO_RATIO_LIMIT
+  { 0x1AE, SCOPE_PACKAGE },             // MSR_TURBO_RATIO_LIMIT1
+  { 0x1AF, SCOPE_PACKAGE },             // MSR_TURBO_RATIO_LIMIT2
+  { 0x1B1, SCOPE_PACKAGE },             // IA32_PACKAGE_THERM_STATUS
+  { 0x1B2, SCOPE_PACKAGE },             // IA32_PACKAGE_THERM_INTERRUPT
+  { 0x1FC, SCOPE_PACKAGE },             // MSR_POWER_CTL
+  { 0x3F8, SCOPE_PACKAGE },             // MSR_PKG_C3_RESIDENCY
+  { 0x3F9, SCOPE_PACKAGE },             // MSR_PKG_C6_RESIDENCY
+  { 0x3FA, SCOPE_PACKAGE },             // MSR_PKG_C7_RESIDENCY
+  { 0x3FC, SCOPE_CORE },                // MSR_CORE_C3_RESIDENCY
+  { 0x3FD, SCOPE_CORE },                // MSR_CORE_C6_RESIDENCY
+  { 0x3FE, SCOPE_CORE },                // MSR_CORE_C7_RESIDENCY
+  { 0x606, SCOPE_PACKAGE },             // MSR_RAPL_POWER_UNIT
+  { 0x60A, SCOPE_PACKAGE },             // MSR_PKGC3_IRTL
+  { 0x60B, SCOPE_PACKAGE },             // MSR_PKGC6_IRTL
+  { 0x60C, SCOPE_PACKAGE },             // MSR_PKGC7_IRTL
+  { 0x60D, SCOPE_PACKAGE },             // MSR_PKG_C2_RESIDENCY
+  { 0x610, SCOPE_PACKAGE },             // MSR_PKG_POWER_LIMIT
+  { 0x611, SCOPE_PACKAGE },             // MSR_PKG_ENERGY_STATUS
+  { 0x613, SCOPE_PACKAGE },             // MSR_PKG_PERF_STATUS
+  { 0x614, SCOPE_PACKAGE },             // MSR_PKG_POWER_INFO
+  { 0x618, SCOPE_PACKAGE },             // MSR_DRAM_POWER_LIMIT
+  { 0x619, SCOPE_PACKAGE },             // MSR_DRAM_ENERGY_STATUS
+  { 0x61B, SCOPE_PACKAGE },             // MSR_DRAM_PERF_STATUS
+  { 0x61C, SCOPE_PACKAGE },             // MSR_DRAM_POWER_INFO
+  { 0x620, SCOPE_PACKAGE },             // MSR_UNCORE_RATIO_LIMIT
+  { 0x621, SCOPE_PACKAGE },             // MSR_UNCORE_PERF_STATUS
+  { 0x638, SCOPE_PACKAGE },             // MSR_PP0_POWER_LIMIT
+  { 0x639, SCOPE_PACKAGE },             // MSR_PP0_ENERGY_STATUS
+  { 0x63A, SCOPE_PACKAGE },             // MSR_PP0_POLICY
+  { 0x640, SCOPE_PACKAGE },             // MSR_PP1_POWER_LIMIT
+  { 0x641, SCOPE_PACKAGE },             // MSR_PP1_ENERGY_STATUS
+  { 0x642, SCOPE_PACKAGE },             // MSR_PP1_POLICY
+  { 0x648, SCOPE_PACKAGE },             // MSR_CONFIG_TDP_NOMINAL
+  { 0x649, SCOPE_PACKAGE },             // MSR_CONFIG_TDP_LEVEL1
+  { 0x64A, SCOPE_PACKAGE },             // MSR_CONFIG_TDP_LEVEL2
+  { 0x64B, SCOPE_PACKAGE },             // MSR_CONFIG_TDP_CONTROL
+  { 0x64C, SCOPE_PACKAGE },             // MSR_TURBO_ACTIVATION_RATIO
+  { 0x64F, SCOPE_PACKAGE },             // MSR_CORE_PERF_LIMIT_REASONS
+  { 0x6B0, SCOPE_PACKAGE },             // MSR_GRAPHICS_PERF_LIMIT_REASONS
+  { 0x6B1, SCOPE_PACKAGE },             // MSR_RING_PERF_LIMIT_REASONS
+};
+
+static int cmp_msr_scope(const void *key, const void *entry)
+{
+  uint32_t addr = *(const uint32_t *) key;
+  const struct msr_scope_entry *e = entry;
+  return (addr > e->addr) - (addr < e->addr);
+}
+
+// Check if the scopes of the table apply to the processor of the node
+int msr_scope_known()
+{
+  struct cpu_model *model = get_cpu_model();
+
+  return model->intel && model->family == 6;
+}
+
+// Return the scope of the MSR, registers not in the table are per-thread.
+// On other processors every register is accessed on every cpu
+int msr_scope(uint64_t addr)
+{
+  const struct msr_scope_entry *e;
+  uint32_t key = addr;
+
+  // The jobs of a shared node access the core and package registers only on
+  // the domains they own
+  if((!pm_conf.msr_scope && !job_cpuset.shared) || !msr_scope_known())
+    return SCOPE_THREAD;
+
+  e = bsearch(&key, msr_scopes, sizeof(msr_scopes) / sizeof(msr_scopes[0]),
+    sizeof(msr_scopes[0]), cmp_msr_scope);
+
+  return e == NULL ? SCOPE_THREAD : e->scope;
+}
+
+// Vendor and model of the processor of the node, loaded once per process
+static struct cpu_model cpu_model;
+static int cpu_model_loaded = FALSE;
+
+// Check if a flag is in the space-separated list of the processor flags
+static int has_cpu_flag(const char *flags, const char *flag)
+{
+  size_t len = strlen(flag);
+  const char *ptr;
+
+  for(ptr = strstr(flags, flag); ptr != NULL; ptr = strstr(ptr + len, flag))
+    if((ptr == flags || isspace(ptr[-1])) && (ptr[len] == '\0' || isspace(ptr[len])))
+      return TRUE;
+
+  return FALSE;
+}
+
+// Parse the first processor of /proc/cpuinfo, an unknown processor is not Intel
+struct cpu_model *get_cpu_model()
+{
+  char buf[BUFFER_SIZE * 16];
+  char *line, *next, *value, *end;
+  long nkeys = 0;
+
+  if(cpu_model_loaded)
+    return &cpu_model;
+  cpu_model_loaded = TRUE;
+
+  // The first processor is at the beginning, the file is read only up to the
+  // size of the buffer
+  if(read_file(PM_CPUINFO, buf, sizeof(buf)) < 0){
+    slurm_info("Failed to read the processor model from '%s'!\n", PM_CPUINFO);
+    return &cpu_model;
+  }
+
+  // The fields of the other processors are the same, stop at the first blank line
+  for(line = buf; line != NULL; line = next){
+    next = strchr(line, '\n');
+    if(next != NULL)
+      *next++ = '\0';
+
+    value = strchr(line, ':');
+    if(value == NULL){
+      if(nkeys > 0)
+        break;
+      continue;
+    }
+    nkeys++;
+
+    // Key without the tabs before ':'
+    for(end = value; end > line && isspace(end[-1]); end--);
+    *end = '\0';
+    value++;
+
+    if(strcmp(line, "vendor_id") == 0)
+      cpu_model.intel = strstr(value, "GenuineIntel") != NULL;
+    else if(strcmp(line, "cpu family") == 0)
+      cpu_model.family = atoi(value);
+    else if(strcmp(line, "model") == 0)
+      cpu_model.model = atoi(value);
+    else if(strcmp(line, "microcode") == 0)
+      cpu_model.microcode = strtoul(value, NULL, 0);
+    else if(strcmp(line, "flags") == 0)
+      cpu_model.hwp = has_cpu_flag(value, "hwp");
+  }
+
+  return &cpu_model;
+}
+
+static int read_topology_id(const char *fmt, long cpu, int *id)
+{
+  char file[BUFFER_SIZE];
+  char data[BUFFER_SIZE];
+
+  sprintf(file, fmt, cpu);
+  if(read_str_from_file(file, data) != 1)
+    return -1;
+  *id = atoi(data);
+
+  return 0;
+}
+
+// Topology of the node, loaded once per process
+static struct cpu_topology topology;
+static int topology_loaded = FALSE;
+
+// Size of the cache, the arrays follow the header in the order of struct cpu_topology
+static size_t topology_size(long ncpus, long nonline)
+{
+  return sizeof(struct topology_cache_header) + TOPOLOGY_WORDS(ncpus) * sizeof(uint64_t) +
+    nonline * sizeof(uint32_t) + 2 * ncpus * sizeof(int32_t) + ncpus * sizeof(uint8_t);
+}
+
+static void set_topology_arrays(struct cpu_topology *topo, void *data, size_t size)
+{
+  struct topology_cache_header *header = data;
+
+  topo->ncpus = header->ncpus;
+  topo->nonline = header->nonline;
+  topo->npkgs = header->npkgs;
+  topo->online = (uint64_t *) (header + 1);
+  topo->cpus = (uint32_t *) (topo->online + TOPOLOGY_WORDS(topo->ncpus));
+  topo->pkg_id = (int32_t *) (topo->cpus + topo->nonline);
+  topo->core_id = topo->pkg_id + topo->ncpus;
+  topo->leader = (uint8_t *) (topo->core_id + topo->ncpus);
+  topo->data = data;
+  topo->size = size;
+}
+
+// Read the online cpus, e.g. '0-3,8-11', and the hash of the list
+static int read_online_cpus(char *online, uint64_t *hash)
+{
+  if(read_str_from_file(PM_CPU_ONLINE, online) != 1)
+    snprintf(online, BUFFER_SIZE, "0-%ld", get_ncpus() - 1);
+  *hash = hash_fnv1a(online, strlen(online));
+
+  return 0;
+}
+
+// Read the package, the die and the core of each online cpu and elect the
+// first cpu of each core and package as the leader of its domain. The core
+// ids repeat on the dies of a package, the core of each cpu is numbered
+// across the dies. Without the ids of all the cpus every online cpu is the
+// leader of its domains and npkgs is 0
+static int scan_topology(struct cpu_topology *topo, const char *online, uint64_t hash)
+{
+  struct topology_cache_header *header;
+  long i, n = 0, nonline, ncpus = get_ncpus();
+  int max_pkg = 0, max_die = 0, max_core = 0, ids = TRUE;
+  uint8_t *mark, *seen_pkg, *seen_core;
+  int32_t *die_id;
+  size_t size;
+  void *data;
+
+  mark = calloc(ncpus, sizeof(uint8_t));
+  if(mark == NULL)
+    return -1;
+  nonline = parse_cpu_list(online, mark, ncpus);
+  if(nonline <= 0){
+    slurm_info("Invalid list of online cpus '%s'!\n", online);
+    free(mark);
+    return -2;
+  }
+
+  size = topology_size(ncpus, nonline);
+  data = calloc(1, size);
+  die_id = calloc(ncpus, sizeof(int32_t));
+  if(data == NULL || die_id == NULL){
+    free(mark);
+    free(data);
+    free(die_id);
+    return -1;
+  }
+  header = data;
+  header->magic = TOPOLOGY_CACHE_MAGIC;
+  header->version = TOPOLOGY_CACHE_VERSION;
+  header->ncpus = ncpus;
+  header->nonline = nonline;
+  header->online_hash = hash;
+  set_topology_arrays(topo, data, size);
+
+  for(i = 0; i < ncpus; i++){
+    topo->pkg_id[i] = topo->core_id[i] = -1;
+    if(!mark[i])
+      continue;
+    topo->online[i / 64] |= 1UL << (i % 64);
+    topo->cpus[n++] = i;
+    if(ids && (read_topology_id(PM_TOPOLOGY_PACKAGE_ID, i, &topo->pkg_id[i]) < 0 ||
+       read_topology_id(PM_TOPOLOGY_CORE_ID, i, &topo->core_id[i]) < 0 ||
+       topo->pkg_id[i] < 0 || topo->core_id[i] < 0)){
+      slurm_info("Failed to read the topology of cpu '%ld'!\n", i);
+      ids = FALSE;
+    }
+    // Kernels before 5.2 do not report the dies, one die per package
+    if(read_topology_id(PM_TOPOLOGY_DIE_ID, i, &die_id[i]) < 0 || die_id[i] < 0)
+      die_id[i] = 0;
+    if(topo->pkg_id[i] > max_pkg)
+      max_pkg = topo->pkg_id[i];
+    if(die_id[i] > max_die)
+      max_die = die_id[i];
+    if(topo->core_id[i] > max_core)
+      max_core = topo->core_id[i];
+  }
+  free(mark);
+
+  // Number the cores across the dies of each package
+  for(n = 0; n < nonline && ids; n++){
+    i = topo->cpus[n];
+    topo->core_id[i] += die_id[i] * (max_core + 1);
+  }
+  max_core = (max_die + 1) * (max_core + 1) - 1;
+  free(die_id);
+
+  seen_pkg = calloc(max_pkg + 1, sizeof(uint8_t));
+  seen_core = calloc((max_pkg + 1) * (max_core + 1), sizeof(uint8_t));
+  if(seen_pkg == NULL || seen_core == NULL){
+    free(seen_pkg);
+    free(seen_core);
+    free(data);
+    return -1;
+  }
+
+  for(n = 0; n < nonline; n++){
+    uint8_t *core;
+
+    i = topo->cpus[n];
+    if(!ids){
+      topo->leader[i] = (1 << SCOPE_THREAD) | (1 << SCOPE_CORE) | (1 << SCOPE_PACKAGE);
+      continue;
+    }
+
+    core = &seen_core[topo->pkg_id[i] * (max_core + 1) + topo->core_id[i]];
+    topo->leader[i] = 1 << SCOPE_THREAD;
+    if(!*core){
+      topo->leader[i] |= 1 << SCOPE_CORE;
+      *core = TRUE;
+    }
+    if(!seen_pkg[topo->pkg_id[i]]){
+      topo->leader[i] |= 1 << SCOPE_PACKAGE;
+      seen_pkg[topo->pkg_id[i]] = TRUE;
+    }
+  }
+
+  free(seen_pkg);
+  free(seen_core);
+
+  header->npkgs = topo->npkgs = ids ? max_pkg + 1 : 0;
+  header->checksum = hash_fnv1a(header + 1, size - sizeof(struct topology_cache_header));
+
+  return 0;
+}
+
+// Write the topology to the cache, mapped by the prologs and epilogs
+static int write_topology_cache(struct cpu_topology *topo)
+{
+  char tmp_file[BUFFER_SIZE + 8];
+  FILE *fd_cache;
+  int fd, ret = 0;
+
+  // Replace the cache atomically, a prolog could map it at the same time. The
+  // temporary file is created with a unique name, a file pre-created by a
+  // user in /tmp is never reused
+  sprintf(tmp_file, "%s.XXXXXX", PM_TOPOLOGY_CACHE);
+  fd = mkstemp(tmp_file);
+  if(fd < 0 || fchmod(fd, 0644) < 0 || (fd_cache = fdopen(fd, "w")) == NULL){
+    slurm_info("Failed to open '%s'!\n", tmp_file);
+    if(fd >= 0){
+      close(fd);
+      remove(tmp_file);
+    }
+    return -1;
+  }
+
+  if(fwrite(topo->data, topo->size, 1, fd_cache) != 1){
+    slurm_info("Failed to write the topology cache '%s'!\n", tmp_file);
+    ret = -2;
+  }
+  if(fclose(fd_cache) != 0)
+    ret = -2;
+
+  if(ret == 0 && rename(tmp_file, PM_TOPOLOGY_CACHE) < 0){
+    slurm_info("Failed to rename '%s' to '%s'!\n", tmp_file, PM_TOPOLOGY_CACHE);
+    ret = -3;
+  }
+  if(ret < 0)
+    remove(tmp_file);
+
+  return ret;
+}
+
+// Map the topology cache if it has been built with the same online cpus
+static int map_topology_cache(struct cpu_topology *topo, uint64_t hash)
+{
+  struct topology_cache_header *header;
+  struct stat info;
+  void *addr;
+  int fd;
+
+  fd = open(PM_TOPOLOGY_CACHE, O_RDONLY | O_NOFOLLOW);
+  if(fd < 0)
+    return -1;
+
+  // Only trust a cache written by the slurm daemon
+  if(fstat(fd, &info) < 0 || info.st_uid != getuid() ||
+     (info.st_mode & (S_IWGRP | S_IWOTH)) ||
+     info.st_size < sizeof(struct topology_cache_header)){
+    close(fd);
+    return -2;
+  }
+
+  addr = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(addr == MAP_FAILED)
+    return -3;
+
+  header = (struct topology_cache_header *) addr;
+  if(header->magic != TOPOLOGY_CACHE_MAGIC ||
+     header->version != TOPOLOGY_CACHE_VERSION ||
+     header->online_hash != hash || header->ncpus != get_ncpus() ||
+     info.st_size != topology_size(header->ncpus, header->nonline) ||
+     header->checksum != hash_fnv1a(header + 1,
+       info.st_size - sizeof(struct topology_cache_header))){
+    munmap(addr, info.st_size);
+    return -4;
+  }
+
+  set_topology_arrays(topo, addr, info.st_size);
+  topo->map = TRUE;
+
+  return 0;
+}
+
+// Parse the topology of the node and save it to the cache
+int build_topology_cache()
+{
+  struct cpu_topology topo;
+  char online[BUFFER_SIZE];
+  uint64_t hash;
+  int ret = 0;
+
+  memset(&topo, 0, sizeof(struct cpu_topology));
+  read_online_cpus(online, &hash);
+  if(scan_topology(&topo, online, hash) < 0)
+    return -1;
+
+  // A partial topology is parsed again by each prolog
+  if(topo.npkgs == 0)
+    ret = -3;
+  else if(write_topology_cache(&topo) < 0)
+    ret = -2;
+
+  free(topo.data);
+
+  return ret;
+}
+
+// Load the topology of the node once per process, from the cache built by
+// the slurm daemon while the online cpus do not change
+static struct cpu_topology *load_topology()
+{
+  struct cpu_topology *topo = &topology;
+  char online[BUFFER_SIZE];
+  uint64_t hash;
+
+  if(topology_loaded)
+    return topo->data != NULL ? topo : NULL;
+  topology_loaded = TRUE;
+
+  read_online_cpus(online, &hash);
+  if(map_topology_cache(topo, hash) == 0)
+    return topo;
+
+#ifdef SLURM_SPANK_DEBUG
+  slurm_info("The topology cache '%s' is not valid, parsing '%s'!\n",
+    PM_TOPOLOGY_CACHE, PM_CPU_ONLINE);
+#endif // SLURM_SPANK_DEBUG
+
+  if(scan_topology(topo, online, hash) < 0){
+    memset(topo, 0, sizeof(struct cpu_topology));
+    return NULL;
+  }
+  if(topo->npkgs > 0)
+    write_topology_cache(topo);
+
+  return topo;
+}
+
+// Return the topology of the node, NULL if the package and core of the cpus
+// are not known
+struct cpu_topology *get_topology()
+{
+  struct cpu_topology *topo = load_topology();
+
+  return topo != NULL && topo->npkgs > 0 ? topo : NULL;
+}
+
+// Release the topology at the end of a prolog/epilog
+void free_topology()
+{
+  if(topology.map)
+    munmap(topology.data, topology.size);
+  else
+    free(topology.data);
+  memset(&topology, 0, sizeof(struct cpu_topology));
+  topology_loaded = FALSE;
+}
+
+// Check if the cpu is online, all the cpus are online without topology
+int cpu_is_online(long cpu)
+{
+  struct cpu_topology *topo = load_topology();
+
+  if(topo == NULL)
+    return TRUE;
+  if(cpu < 0 || cpu >= topo->ncpus)
+    return FALSE;
+
+  return (topo->online[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+// Number of online cpus and the i-th online cpu, all the cpus without topology
+long get_nonline()
+{
+  struct cpu_topology *topo = load_topology();
+
+  return topo != NULL ? topo->nonline : get_ncpus();
+}
+
+long get_online_cpu(long i)
+{
+  struct cpu_topology *topo = load_topology();
+
+  return topo != NULL ? topo->cpus[i] : i;
+}
+
+// Check if the cpu is the one accessing the registers of its domain
+int topology_is_leader(struct cpu_topology *topo, long cpu, int scope)
+{
+  // Without topology every cpu accesses its own registers
+  if(topo == NULL)
+    return TRUE;
+
+  return (topo->leader[cpu] & (1 << scope)) != 0;
+}
+
+// First cpu of each package with its package id, only cpu 0 without
+// topology. On shared nodes only the packages owned by the job, return the
+// number of packages
+long get_package_leaders(uint32_t **cpus, uint32_t **pkgs)
+{
+  struct cpu_topology *topo;
+  long i, n = 0, npkgs = 1;
+
+  topo = get_topology();
+  if(topo == NULL)
+    slurm_info("Failed to read the cpu topology, only the package of cpu 0 is accessed!\n");
+  else
+    npkgs = topo->npkgs;
+
+  *cpus = malloc(npkgs * sizeof(uint32_t));
+  *pkgs = malloc(npkgs * sizeof(uint32_t));
+  if(*cpus == NULL || *pkgs == NULL){
+    free(*cpus);
+    free(*pkgs);
+    return -1;
+  }
+
+  if(topo == NULL){
+    if(!job_owns(0, SCOPE_PACKAGE))
+      return 0;
+    (*cpus)[0] = 0;
+    (*pkgs)[0] = 0;
+    return 1;
+  }
+
+  for(i = 0; i < topo->nonline && n < npkgs; i++){
+    long cpu = topo->cpus[i];
+
+    if(topology_is_leader(topo, cpu, SCOPE_PACKAGE) && job_owns(cpu, SCOPE_PACKAGE)){
+      (*cpus)[n] = cpu;
+      (*pkgs)[n] = topo->pkg_id[cpu];
+      n++;
+    }
+  }
+
+  return n;
+}
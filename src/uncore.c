@@ -0,0 +1,213 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+
+#include "pm_msrsafe.h"
+
+// Read a register of each package with one batch, return the number of
+// packages or a negative value if no package can be read
+static long read_uncore(uint32_t msr, struct msr_batch_op **ops, uint32_t **pkgs)
+{
+  struct msr_batch_op *op;
+  uint32_t *cpus;
+  long i, npkgs;
+
+  npkgs = get_package_leaders(&cpus, pkgs);
+  if(npkgs < 0)
+    return -1;
+
+  op = calloc(npkgs, sizeof(struct msr_batch_op));
+  if(op == NULL){
+    free(cpus);
+    free(*pkgs);
+    return -1;
+  }
+  for(i = 0; i < npkgs; i++){
+    op[i].cpu = cpus[i];
+    op[i].isrdmsr = TRUE;
+    op[i].msr = msr;
+  }
+  free(cpus);
+
+  if(exec_msr_batch(op, npkgs) == npkgs){
+#ifdef SLURM_SPANK_DEBUG
+    slurm_info("Failed to read the MSR '%x' of all the packages!\n", msr);
+#endif // SLURM_SPANK_DEBUG
+    free(op);
+    free(*pkgs);
+    return -2;
+  }
+
+  *ops = op;
+
+  return npkgs;
+}
+
+// Dump the uncore ratio limits of each package
+static int dump_uncore()
+{
+  struct msr_batch_op *ops;
+  uint32_t *pkgs;
+  long npkgs;
+  int ret;
+
+  // Not supported or not whitelisted
+  npkgs = read_uncore(MSR_UNCORE_RATIO_LIMIT, &ops, &pkgs);
+  if(npkgs < 0)
+    return 0;
+
+  ret = dump_msr_ops(PM_UNCORE_DUMP, ops, npkgs, UNCORE_RATIO_MASK, 1);
+
+  free(ops);
+  free(pkgs);
+
+  return ret;
+}
+
+// Log the uncore frequency of each package read at the end of the job, when
+// the package may be already idle. The frequency during the job is recorded
+// by the sampler
+static int report_uncore()
+{
+  struct msr_batch_op *status, *limits;
+  uint32_t *pkgs, *pkgs_limits;
+  long i, npkgs;
+
+  npkgs = read_uncore(MSR_UNCORE_PERF_STATUS, &status, &pkgs);
+  if(npkgs < 0)
+    return 0;
+  if(read_uncore(MSR_UNCORE_RATIO_LIMIT, &limits, &pkgs_limits) != npkgs){
+    free(status);
+    free(pkgs);
+    return -1;
+  }
+
+  for(i = 0; i < npkgs; i++){
+    if(status[i].err != 0 || limits[i].err != 0)
+      continue;
+    slurm_info("Uncore frequency of package %u at the end of the job: %lu MHz, limits %lu-%lu MHz!\n", pkgs[i],
+      (status[i].msrdata & 0x7f) * 100, ((limits[i].msrdata >> 8) & 0x7f) * 100,
+      (limits[i].msrdata & 0x7f) * 100);
+  }
+
+  free(status);
+  free(pkgs);
+  free(limits);
+  free(pkgs_limits);
+
+  return 0;
+}
+
+// Pin the uncore frequency of all the packages between min_khz and max_khz
+int set_uncore_freq(long min_khz, long max_khz)
+{
+  struct msr_batch_op *ops;
+  uint32_t *pkgs;
+  long i, npkgs, nops = 0;
+  uint64_t ratios;
+  int ret = 0;
+
+  if(min_khz < 100000 || max_khz > 12700000 || min_khz > max_khz){
+    slurm_info("Invalid uncore frequencies '%ld-%ld'!\n", min_khz, max_khz);
+    return -1;
+  }
+  ratios = ((min_khz / 100000) << 8) | (max_khz / 100000);
+
+  // The uncore is shared by all the cpus of the package
+  if(job_cpuset.shared && job_cpuset.npkgs == 0){
+    slurm_info("The job does not own a whole package, the uncore frequency is not set!\n");
+    return -5;
+  }
+
+  npkgs = read_uncore(MSR_UNCORE_RATIO_LIMIT, &ops, &pkgs);
+  if(npkgs < 0){
+    slurm_info("The uncore ratio limits are not accessible!\n");
+    return -2;
+  }
+
+  // Keep the other bits of the register
+  for(i = 0; i < npkgs; i++){
+    if(ops[i].err != 0){
+      slurm_info("Failed to read the uncore ratio limits of package '%u'!\n", pkgs[i]);
+      ret = -3;
+      continue;
+    }
+    ops[nops] = ops[i];
+    ops[nops].isrdmsr = FALSE;
+    ops[nops].msrdata = (ops[i].msrdata & ~UNCORE_RATIO_MASK) | ratios;
+    nops++;
+  }
+
+  if(exec_msr_batch(ops, nops) > 0){
+    for(i = 0; i < nops; i++){
+      if(ops[i].err != 0){
+        slurm_info("Failed to set the uncore ratio limits of cpu '%u'!\n", ops[i].cpu);
+        ret = -4;
+      }
+    }
+  }
+
+  free(ops);
+  free(pkgs);
+
+  return ret;
+}
+
+int set_uncore(int conf)
+{
+  int phase, ret = 0;
+
+  if(conf == SET || conf == DUMP){
+    phase = phase_begin("dump_uncore");
+    if(dump_uncore() < 0){
+      slurm_info("Failed to dump the uncore ratio limits!\n");
+      ret = -1;
+    }
+    phase_end(phase);
+  }
+  else if(conf == RESET){
+    phase = phase_begin("report_uncore");
+    report_uncore();
+    phase_end(phase);
+
+    phase = phase_begin("restore_uncore");
+    if(restore_msr_dump(PM_UNCORE_DUMP) < 0){
+      slurm_info("Failed to restore the uncore ratio limits!\n");
+      ret = -2;
+    }
+    phase_end(phase);
+  }
+
+  return ret;
+}
@@ -0,0 +1,292 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+#include "pm_msrsafe.h"
+
+// Read the whole content of a file, the size of device files is unknown
+static long read_whole_file(const char *file, char **content)
+{
+  long size = 0, capacity = 16384;
+  char *buf, *tmp;
+  ssize_t len;
+  int fd;
+
+  fd = open(file, O_RDONLY);
+  if(fd < 0){
+    slurm_info("Failed to open '%s'!\n", file);
+    return -1;
+  }
+
+  buf = malloc(capacity + 1);
+  if(buf == NULL){
+    close(fd);
+    return -2;
+  }
+
+  while((len = read(fd, buf + size, capacity - size)) > 0){
+    size += len;
+    if(size == capacity){
+      capacity *= 2;
+      tmp = realloc(buf, capacity + 1);
+      if(tmp == NULL){
+        free(buf);
+        close(fd);
+        return -2;
+      }
+      buf = tmp;
+    }
+  }
+  close(fd);
+
+  if(len < 0){
+    slurm_info("Failed to read '%s'!\n", file);
+    free(buf);
+    return -3;
+  }
+  buf[size] = '\0';
+
+  *content = buf;
+  return size;
+}
+
+static int cmp_wl_entry(const void *a, const void *b)
+{
+  const struct msr_wl_entry *x = a, *y = b;
+  return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+// Parse the MSR_SAFE whitelist, return the number of entries sorted by address
+static long parse_whitelist(char *content, struct msr_wl_entry **wl)
+{
+  char *line, *addr_str, *mask_str, *saveptr_line, *saveptr;
+  long nwl = 0, size = 256;
+  struct msr_wl_entry *entries, *tmp;
+
+  entries = malloc(size * sizeof(struct msr_wl_entry));
+  if(entries == NULL)
+    return -2;
+
+  for(line = strtok_r(content, "\n", &saveptr_line); line != NULL;
+      line = strtok_r(NULL, "\n", &saveptr_line)){
+    if(line[0] == '#')
+      continue;
+
+    addr_str = strtok_r(line, " ", &saveptr);
+    mask_str = strtok_r(NULL, " ", &saveptr);
+    if(addr_str == NULL || mask_str == NULL)
+      continue;
+
+    if(nwl == size){
+      size *= 2;
+      tmp = realloc(entries, size * sizeof(struct msr_wl_entry));
+      if(tmp == NULL){
+        free(entries);
+        return -2;
+      }
+      entries = tmp;
+    }
+
+    entries[nwl].addr = strtoul(addr_str, NULL, 16);
+    entries[nwl].mask = strtoul(mask_str, NULL, 16);
+    nwl++;
+  }
+
+  qsort(entries, nwl, sizeof(struct msr_wl_entry), cmp_wl_entry);
+
+  *wl = entries;
+  return nwl;
+}
+
+// Write the compiled whitelist and the hash of its source to the cache file
+static int write_whitelist_cache(uint64_t hash, struct msr_wl_entry *entries, long nentries)
+{
+  struct msr_wl_cache_header header;
+  char tmp_file[BUFFER_SIZE + 8];
+  FILE *fd_cache;
+  int fd, ret = 0;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = MSRSAFE_WL_CACHE_MAGIC;
+  header.version = MSRSAFE_WL_CACHE_VERSION;
+  header.hash = hash;
+  header.nentries = nentries;
+
+  // Replace the cache atomically, a prolog could map it at the same time. The
+  // temporary file in /tmp has a unique name and it is created by mkstemp
+  sprintf(tmp_file, "%s.XXXXXX", MSRSAFE_WL_CACHE);
+  fd = mkstemp(tmp_file);
+  if(fd < 0 || fchmod(fd, 0644) < 0 || (fd_cache = fdopen(fd, "w")) == NULL){
+    slurm_info("Failed to open '%s'!\n", tmp_file);
+    if(fd >= 0){
+      close(fd);
+      remove(tmp_file);
+    }
+    return -1;
+  }
+
+  if(fwrite(&header, sizeof(header), 1, fd_cache) != 1 ||
+     fwrite(entries, sizeof(struct msr_wl_entry), nentries, fd_cache) != nentries){
+    slurm_info("Failed to write the whitelist cache '%s'!\n", tmp_file);
+    ret = -2;
+  }
+  if(fclose(fd_cache) != 0)
+    ret = -2;
+
+  if(ret == 0 && rename(tmp_file, MSRSAFE_WL_CACHE) < 0){
+    slurm_info("Failed to rename '%s' to '%s'!\n", tmp_file, MSRSAFE_WL_CACHE);
+    ret = -3;
+  }
+  if(ret < 0)
+    remove(tmp_file);
+
+  return ret;
+}
+
+// Map the whitelist cache if it has been compiled from a whitelist with the
+// given hash
+static int map_whitelist_cache(uint64_t hash, struct msr_whitelist *wl)
+{
+  struct msr_wl_cache_header *header;
+  struct stat info;
+  void *addr;
+  int fd;
+
+  fd = open(MSRSAFE_WL_CACHE, O_RDONLY | O_NOFOLLOW);
+  if(fd < 0)
+    return -1;
+
+  // Only trust a cache written by the slurm daemon
+  if(fstat(fd, &info) < 0 || info.st_uid != getuid() ||
+     (info.st_mode & (S_IWGRP | S_IWOTH)) ||
+     info.st_size < sizeof(struct msr_wl_cache_header)){
+    close(fd);
+    return -2;
+  }
+
+  addr = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(addr == MAP_FAILED)
+    return -3;
+
+  header = (struct msr_wl_cache_header *) addr;
+  if(header->magic != MSRSAFE_WL_CACHE_MAGIC ||
+     header->version != MSRSAFE_WL_CACHE_VERSION ||
+     header->hash != hash ||
+     info.st_size != sizeof(struct msr_wl_cache_header) +
+       header->nentries * sizeof(struct msr_wl_entry)){
+    munmap(addr, info.st_size);
+    return -4;
+  }
+
+  wl->entries = (struct msr_wl_entry *) (header + 1);
+  wl->nentries = header->nentries;
+  wl->map = addr;
+  wl->size = info.st_size;
+
+  return 0;
+}
+
+// Compile the whitelist and save it to the cache
+int build_whitelist_cache()
+{
+  struct msr_wl_entry *entries;
+  char *content;
+  long size, nentries;
+  uint64_t hash;
+  int ret = 0;
+
+  size = read_whole_file(MSRSAFE_WHITELIST_FILE, &content);
+  if(size < 0)
+    return -1;
+  hash = hash_fnv1a(content, size);
+
+  nentries = parse_whitelist(content, &entries);
+  free(content);
+  if(nentries < 0)
+    return -2;
+
+  if(write_whitelist_cache(hash, entries, nentries) < 0)
+    ret = -3;
+
+  free(entries);
+
+  return ret;
+}
+
+// Get the compiled whitelist, the cache is used until the live whitelist
+// changes, in that case the whitelist is parsed again and the cache refreshed
+long get_whitelist(struct msr_whitelist *wl)
+{
+  struct msr_wl_entry *entries;
+  char *content;
+  long size, nentries;
+  uint64_t hash;
+
+  size = read_whole_file(MSRSAFE_WHITELIST_FILE, &content);
+  if(size < 0)
+    return -1;
+  hash = hash_fnv1a(content, size);
+
+  if(map_whitelist_cache(hash, wl) == 0){
+    free(content);
+    return wl->nentries;
+  }
+
+#ifdef SLURM_SPANK_DEBUG
+  slurm_info("The whitelist cache '%s' is not valid, parsing '%s'!\n",
+    MSRSAFE_WL_CACHE, MSRSAFE_WHITELIST_FILE);
+#endif // SLURM_SPANK_DEBUG
+
+  nentries = parse_whitelist(content, &entries);
+  free(content);
+  if(nentries < 0)
+    return -2;
+
+  write_whitelist_cache(hash, entries, nentries);
+
+  wl->entries = entries;
+  wl->nentries = nentries;
+  wl->map = NULL;
+  wl->size = 0;
+
+  return nentries;
+}
+
+void put_whitelist(struct msr_whitelist *wl)
+{
+  if(wl->map != NULL)
+    munmap(wl->map, wl->size);
+  else
+    free(wl->entries);
+}
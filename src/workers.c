@@ -0,0 +1,175 @@
+/*
+BSD 3-Clause License
+
+Copyright (c) 2018, University of Bologna
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of the copyright holder nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Author: Daniele Cesarini, University of Bologna
+*/
+
+#include "pm_msrsafe.h"
+
+struct msr_worker {
+  pthread_t thread;
+  long cpu_begin;                       // First cpu handled by the worker
+  long cpu_end;                         // Last cpu (excluded)
+  long *cpu_offset;                     // Operations of cpu i are index[cpu_offset[i]..cpu_offset[i+1]]
+  long *index;
+  struct msr_batch_op *ops;
+};
+
+// Migrate the calling thread on a single cpu
+static int pin_thread(long cpu)
+{
+  cpu_set_t set;
+
+  if(cpu >= CPU_SETSIZE)
+    return -1;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+
+  return sched_setaffinity(0, sizeof(set), &set);
+}
+
+static void *msr_worker_run(void *arg)
+{
+  struct msr_worker *w = (struct msr_worker *) arg;
+  struct msr_batch_op *op;
+  long cpu, i;
+  int fd;
+
+  for(cpu = w->cpu_begin; cpu < w->cpu_end; cpu++){
+    if(w->cpu_offset[cpu] == w->cpu_offset[cpu + 1])
+      continue;
+
+    // Run on the target cpu so that the driver accesses a local MSR
+#ifdef SLURM_SPANK_DEBUG
+    if(pin_thread(cpu) < 0)
+      slurm_info("Failed to pin the MSR worker on cpu '%ld'!\n", cpu);
+#else
+    pin_thread(cpu);
+#endif // SLURM_SPANK_DEBUG
+
+    fd = get_msr_fd(cpu);
+    // Affinity and one pread/pwrite for each operation
+    STAT_ADD(nsyscalls, fd < 0 ? 1 : 1 + w->cpu_offset[cpu + 1] - w->cpu_offset[cpu]);
+
+    for(i = w->cpu_offset[cpu]; i < w->cpu_offset[cpu + 1]; i++){
+      op = &w->ops[w->index[i]];
+      if(fd < 0)
+        op->err = -ENXIO;
+      else if(op->isrdmsr){
+        if(read_msr(fd, cpu, op->msr, &op->msrdata) < 0)
+          op->err = -EIO;
+      }
+      else{
+        if(write_msr(fd, cpu, op->msr, op->msrdata) < 0)
+          op->err = -EIO;
+      }
+    }
+
+    if(fd >= 0)
+      put_msr_fd(cpu);
+  }
+
+  return NULL;
+}
+
+// Execute the MSR operations with a pool of workers, each worker migrates on
+// the cpus of its subset and accesses only local MSRs. The result of each
+// operation is reported in its err field, return -1 if no operation has been
+// executed
+int exec_msr_parallel(struct msr_batch_op *ops, long nops, long nthreads)
+{
+  long i, max_cpu = 0, ncpus, chunk, *cpu_offset, *index;
+  struct msr_worker *workers;
+  cpu_set_t affinity;
+  int fallback = FALSE;
+
+  for(i = 0; i < nops; i++)
+    if(ops[i].cpu > max_cpu)
+      max_cpu = ops[i].cpu;
+  ncpus = max_cpu + 1;
+  if(nthreads > ncpus)
+    nthreads = ncpus;
+
+  cpu_offset = calloc(ncpus + 1, sizeof(long));
+  index = malloc(nops * sizeof(long));
+  workers = calloc(nthreads, sizeof(struct msr_worker));
+  if(cpu_offset == NULL || index == NULL || workers == NULL){
+    free(cpu_offset);
+    free(index);
+    free(workers);
+    return -1;
+  }
+
+  // Index the operations by cpu
+  for(i = 0; i < nops; i++)
+    cpu_offset[ops[i].cpu + 1]++;
+  for(i = 1; i <= ncpus; i++)
+    cpu_offset[i] += cpu_offset[i - 1];
+  for(i = 0; i < nops; i++)
+    index[cpu_offset[ops[i].cpu]++] = i;
+  for(i = ncpus; i > 0; i--)
+    cpu_offset[i] = cpu_offset[i - 1];
+  cpu_offset[0] = 0;
+
+  // Save the affinity of the current thread if a worker falls back on it
+  sched_getaffinity(0, sizeof(affinity), &affinity);
+
+  // Split the cpus among the workers
+  chunk = (ncpus + nthreads - 1) / nthreads;
+  for(i = 0; i < nthreads; i++){
+    workers[i].cpu_begin = i * chunk;
+    workers[i].cpu_end = (i + 1) * chunk < ncpus ? (i + 1) * chunk : ncpus;
+    workers[i].cpu_offset = cpu_offset;
+    workers[i].index = index;
+    workers[i].ops = ops;
+    if(pthread_create(&workers[i].thread, NULL, msr_worker_run, &workers[i]) != 0){
+      slurm_info("Failed to create the MSR worker %ld!\n", i);
+      // Run the work in the current thread
+      msr_worker_run(&workers[i]);
+      workers[i].cpu_end = -1;
+      fallback = TRUE;
+    }
+  }
+
+  for(i = 0; i < nthreads; i++)
+    if(workers[i].cpu_end >= 0)
+      pthread_join(workers[i].thread, NULL);
+
+  if(fallback)
+    sched_setaffinity(0, sizeof(affinity), &affinity);
+
+  free(cpu_offset);
+  free(index);
+  free(workers);
+
+  return 0;
+}